@@ -0,0 +1,355 @@
+// Benchmarks for the engine's hot paths. Runs without a window and prints one JSON document with a result per case, so
+// runs can be diffed between releases. See `roguely_bench --help`.
+
+#include "engine.h"
+
+#include <SDL2/SDL.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory_resource>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace roguely;
+
+namespace {
+
+struct Options {
+    std::vector<Size> map_sizes{{64, 64}, {256, 256}, {1024, 1024}};
+    std::vector<int> entity_counts{100, 1000, 10000};
+    uint64_t replay_frames{600};
+    double min_seconds{0.25}; // each case repeats for at least this long
+    std::string filter;       // only run cases whose name starts with this
+    std::string out;          // write the JSON here instead of stdout
+};
+
+struct Result {
+    std::string name;
+    std::string params; // a JSON object
+    size_t iterations{};
+    double min_ns{}, median_ns{}, mean_ns{};
+};
+
+// Keeps the optimizer from dropping a result that is otherwise unused
+template <typename T>
+void keep(T value) {
+    static volatile T sink;
+    sink = value;
+}
+
+std::string size_params(const Size & size, const std::string & extra = {}) {
+    return std::format(R"({{"width":{},"height":{}{}}})", size.width, size.height, extra);
+}
+
+// Calls body() repeatedly, timing each call, until min_seconds have passed (at least 3 calls after one warm up)
+template <typename Body>
+Result measure(const Options & options, std::string name, std::string params, Body && body) {
+    using clock = std::chrono::steady_clock;
+    body();
+
+    std::vector<double> samples;
+    const auto start = clock::now();
+    while (samples.size() < 3 || std::chrono::duration<double>(clock::now() - start).count() < options.min_seconds) {
+        const auto t0 = clock::now();
+        body();
+        samples.push_back(std::chrono::duration<double, std::nano>(clock::now() - t0).count());
+    }
+
+    std::ranges::sort(samples);
+    return {.name = std::move(name),
+            .params = std::move(params),
+            .iterations = samples.size(),
+            .min_ns = samples.front(),
+            .median_ns = samples[samples.size() / 2],
+            .mean_ns = std::accumulate(samples.begin(), samples.end(), 0.0) / double(samples.size())};
+}
+
+std::shared_ptr<Map> make_map(const Size & size, ThreadPool & pool) {
+    return Engine::generate_map("bench", size.width, size.height, {.seed = 42}, pool);
+}
+
+void bench_map_generation(const Options & options, ThreadPool & pool, std::vector<Result> & results) {
+    for (const auto & size : options.map_sizes) {
+        results.push_back(measure(options, "map_generate", size_params(size), [&] { make_map(size, pool); }));
+
+        const MapGenerationParams params{.seed = 42};
+        const auto initial = Engine::init_cellular_automata(size.width, size.height, params, pool);
+        auto walls = initial;
+        results.push_back(measure(options, "map_cellular_automaton_pass", size_params(size, R"(,"passes":1)"), [&] {
+            walls = initial;
+            Engine::perform_cellular_automaton(walls, size.width, size.height, 1, pool);
+        }));
+    }
+}
+
+void bench_field_of_view(const Options & options, ThreadPool & pool, std::vector<Result> & results) {
+    for (const auto & size : options.map_sizes) {
+        auto map = make_map(size, pool);
+        RandomStream rng{7};
+        std::vector<Point> eyes(64);
+        for (auto & eye : eyes) eye = map->get_random_point({0}, rng);
+
+        size_t i = 0;
+        const Dimension dimensions{.point = {0, 0}, .size = {size.width, size.height}};
+        results.push_back(measure(
+            options, "fov_shadowcast", size_params(size, std::format(R"(,"radius":{})", map->get_fov_radius())),
+            [&] {
+                auto d = dimensions;
+                d.supplemental_point = eyes[i++ % eyes.size()];
+                map->calculate_field_of_view(d);
+            }));
+    }
+}
+
+void bench_path_finding(const Options & options, ThreadPool & pool, std::vector<Result> & results) {
+    for (const auto & size : options.map_sizes) {
+        auto map = make_map(size, pool);
+        RandomStream rng{11};
+        std::vector<std::pair<Point, Point>> trips(64);
+        for (auto & [from, to] : trips) {
+            from = map->get_random_point({0}, rng);
+            to = map->get_random_point({0}, rng);
+        }
+
+        AStar::PathfinderContext pathfinder;
+        const auto run = [&](const char * name, AStar::PathfinderContext::Mode mode) {
+            size_t i = 0;
+            results.push_back(measure(options, name, size_params(size), [&] {
+                const auto & [from, to] = trips[i++ % trips.size()];
+                pathfinder.find_path(*map->get_map(), from, to, 1, mode);
+            }));
+        };
+        run("path_astar", AStar::PathfinderContext::Mode::AStar);
+        run("path_jps", AStar::PathfinderContext::Mode::JumpPoint);
+    }
+}
+
+void bench_spatial_queries(const Options & options, ThreadPool & pool, std::vector<Result> & results) {
+    const Size size = options.map_sizes.back();
+    auto map = make_map(size, pool);
+
+    for (int count : options.entity_counts) {
+        sol::state lua;
+        EntityManager entity_manager(lua.lua_state());
+        RandomStream rng{13};
+        std::vector<std::string> ids;
+        for (int n = 0; n < count; ++n) {
+            const auto p = map->get_random_point({0}, rng);
+            auto e = entity_manager.make_entity("mob");
+            e->add_component(entity_manager.make_component<LuaComponent>(
+                "lua component", lua.create_table_with("position_component",
+                                                       lua.create_table_with("x", p.x, "y", p.y, "blocking", true))));
+            entity_manager.add_entity_to_group("mobs", e, lua.lua_state());
+            ids.push_back(e->get_id());
+        }
+
+        std::vector<Point> probes(256);
+        for (auto & p : probes) p = map->get_random_point({0}, rng);
+        const std::string params = size_params(size, std::format(R"(,"entities":{})", count));
+        const Size viewport{40, 22};
+
+        size_t i = 0;
+        results.push_back(measure(options, "spatial_for_each_in_rect", params, [&] {
+            const auto & p = probes[i++ % probes.size()];
+            size_t found = 0;
+            const Point bottom_right{p.x + viewport.width - 1, p.y + viewport.height - 1};
+            entity_manager.get_spatial_index().for_each_in_rect(p, bottom_right,
+                                                                [&](const Point &, const auto &) { ++found; });
+            keep(found);
+        }));
+        results.push_back(measure(options, "spatial_is_blocking_at", params, [&] {
+            bool blocked = false;
+            for (const auto & p : probes) blocked |= entity_manager.is_blocking_at(p);
+            keep(blocked);
+        }));
+        results.push_back(measure(options, "spatial_set_entity_position", params, [&] {
+            const auto & p = probes[i++ % probes.size()];
+            entity_manager.set_entity_position("mobs", ids[i % ids.size()], p.x, p.y);
+        }));
+        // Alternating between two viewports defeats the cache, so each call rebuilds the Lua table
+        results.push_back(measure(options, "spatial_lua_entities_in_viewport", params, [&] {
+            const auto & p = probes[i++ % 2];
+            entity_manager.get_lua_entities_in_viewport(p, {p.x + viewport.width - 1, p.y + viewport.height - 1},
+                                                        lua.lua_state());
+        }));
+    }
+}
+
+// Spawns a level's worth of entities into a fresh manager and tears it all down again, once with every entity and
+// component on the heap and once in a slab pool released whole afterwards, the way the engine does it
+void bench_entity_lifetime(const Options & options, std::vector<Result> & results) {
+    sol::state lua;
+    for (int count : options.entity_counts) {
+        // pool is nullptr for the heap
+        const auto run = [&](const char * name, std::pmr::unsynchronized_pool_resource * pool) {
+            results.push_back(measure(options, name, std::format(R"({{"entities":{}}})", count), [&] {
+                {
+                    EntityManager entity_manager(lua.lua_state(),
+                                                 pool ? pool : std::pmr::get_default_resource());
+                    for (int n = 0; n < count; ++n) {
+                        auto e = entity_manager.make_entity("mob");
+                        e->add_component(
+                            entity_manager.make_component<LuaComponent>("lua component", lua.create_table()));
+                        entity_manager.add_entity_to_group("mobs", e, lua.lua_state());
+                    }
+                }
+                lua.collect_garbage();
+                if (pool) pool->release();
+            }));
+        };
+        run("entity_lifetime_heap", nullptr);
+        std::pmr::unsynchronized_pool_resource pool;
+        run("entity_lifetime_pool", &pool);
+    }
+}
+
+// Plays roguely.lua for a number of frames at a fixed 60 fps frame time: the title screen is dismissed on the first
+// frame and the player then walks around in a fixed pattern. Runs once with SDL's dummy video and audio drivers, once
+// headless and then with one headless engine per pool thread at once, to show how batch runs scale.
+void bench_replay(const Options & options, const ThreadPool & pool, std::vector<Result> & results) {
+    if (options.replay_frames == 0) return;
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+
+    Engine::LoopOptions loop{.max_frames = options.replay_frames, .fixed_frame_time = 1.0 / 60, .random_seed = 1337};
+    loop.key_presses.emplace_back(0, SDLK_SPACE);
+    const SDL_Keycode walk[] = {SDLK_UP, SDLK_RIGHT, SDLK_RIGHT, SDLK_DOWN, SDLK_LEFT, SDLK_LEFT};
+    for (uint64_t frame = 2; frame < options.replay_frames; frame += 2)
+        loop.key_presses.emplace_back(frame, walk[(frame / 2) % std::size(walk)]);
+
+    // Reports the time per frame summed over every engine; ideal scaling keeps it flat as instances go up
+    const auto replay = [&](std::string name, bool headless, size_t instances) {
+        auto instance_loop = loop;
+        instance_loop.headless = headless;
+        const auto start = std::chrono::steady_clock::now();
+        if (instances == 1) {
+            Engine engine;
+            engine.game_loop(instance_loop);
+        } else {
+            std::vector<std::exception_ptr> errors(instances);
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < instances; ++i)
+                threads.emplace_back([&, i] {
+                    try {
+                        Engine engine{1};
+                        engine.game_loop(instance_loop);
+                    } catch (...) {
+                        errors[i] = std::current_exception();
+                    }
+                });
+            for (auto & thread : threads) thread.join();
+            for (const auto & error : errors)
+                if (error) std::rethrow_exception(error);
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const double total_ns = std::chrono::duration<double, std::nano>(elapsed).count();
+        const double per_frame = total_ns / double(options.replay_frames * instances);
+        results.push_back({.name = std::move(name),
+                           .params = std::format(R"({{"frames":{},"instances":{}}})", options.replay_frames, instances),
+                           .iterations = options.replay_frames * instances,
+                           .min_ns = per_frame,
+                           .median_ns = per_frame,
+                           .mean_ns = per_frame});
+    };
+    replay("replay_roguely_lua", false, 1);
+    replay("replay_roguely_lua_headless", true, 1);
+    if (pool.size() > 1) replay("replay_roguely_lua_headless_parallel", true, pool.size());
+}
+
+std::vector<Size> parse_sizes(const std::string & text) {
+    std::vector<Size> sizes;
+    std::stringstream ss(text);
+    for (std::string item; std::getline(ss, item, ',');) {
+        const auto x = item.find('x');
+        if (x == std::string::npos) throw std::runtime_error(std::format("bad map size '{}', expected WxH", item));
+        sizes.push_back({std::stoi(item.substr(0, x)), std::stoi(item.substr(x + 1))});
+    }
+    return sizes;
+}
+
+std::vector<int> parse_ints(const std::string & text) {
+    std::vector<int> values;
+    std::stringstream ss(text);
+    for (std::string item; std::getline(ss, item, ',');) values.push_back(std::stoi(item));
+    return values;
+}
+
+Options parse_options(int argc, char ** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const auto value = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::runtime_error(std::format("{} needs a value", arg));
+            return argv[++i];
+        };
+        if (arg == "--sizes") options.map_sizes = parse_sizes(value());
+        else if (arg == "--entities") options.entity_counts = parse_ints(value());
+        else if (arg == "--frames") options.replay_frames = std::stoull(value());
+        else if (arg == "--min-time") options.min_seconds = std::stod(value());
+        else if (arg == "--filter") options.filter = value();
+        else if (arg == "--out") options.out = value();
+        else if (arg == "--help") {
+            std::cout << "usage: roguely_bench [--sizes 64x64,256x256] [--entities 100,1000] [--frames 600]\n"
+                         "                     [--min-time seconds] [--filter name] [--out results.json]\n"
+                         "--frames 0 skips the roguely.lua replay, which needs roguely.lua and assets/ in the\n"
+                         "working directory.\n";
+            std::exit(EXIT_SUCCESS);
+        } else throw std::runtime_error(std::format("unknown option '{}'", arg));
+    }
+    if (options.map_sizes.empty()) throw std::runtime_error("--sizes needs at least one size");
+    return options;
+}
+
+std::string to_json(const std::vector<Result> & results, unsigned threads) {
+    std::string json = std::format(R"({{"version":1,"threads":{},"results":[)", threads);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto & r = results[i];
+        json += std::format(R"({}{{"name":"{}","params":{},"iterations":{},"min_ns":{:.0f},"median_ns":{:.0f},)"
+                            R"("mean_ns":{:.0f}}})",
+                            i > 0 ? "," : "", r.name, r.params, r.iterations, r.min_ns, r.median_ns, r.mean_ns);
+    }
+    return json + "]}\n";
+}
+
+} // namespace
+
+int main(int argc, char ** argv) {
+    try {
+        const Options options = parse_options(argc, argv);
+        ThreadPool pool;
+        std::vector<Result> results;
+
+        // Case names start with their group's prefix, so a filter picks whole groups or single cases alike
+        const auto wanted = [&](std::string_view prefix) {
+            return prefix.starts_with(options.filter) || std::string_view(options.filter).starts_with(prefix);
+        };
+        if (wanted("map_")) bench_map_generation(options, pool, results);
+        if (wanted("fov_")) bench_field_of_view(options, pool, results);
+        if (wanted("path_")) bench_path_finding(options, pool, results);
+        if (wanted("spatial_")) bench_spatial_queries(options, pool, results);
+        if (wanted("entity_")) bench_entity_lifetime(options, results);
+        if (wanted("replay_")) bench_replay(options, pool, results);
+        std::erase_if(results, [&](const Result & r) { return !r.name.starts_with(options.filter); });
+
+        const auto json = to_json(results, unsigned(pool.size()));
+        if (options.out.empty()) {
+            std::cout << json;
+        } else {
+            std::ofstream out(options.out, std::ios::trunc);
+            if (!(out << json)) throw std::runtime_error(std::format("could not write '{}'", options.out));
+        }
+        return EXIT_SUCCESS;
+    } catch (const std::exception & e) {
+        std::cerr << "roguely_bench: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
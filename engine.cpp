@@ -4,15 +4,31 @@
 #undef NDEBUG // force assert() to work
 #endif
 #include <cassert>
+#include <charconv>
+#include <cmath>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
 #include <limits>
 #include <mutex>
+#include <numeric>
 #include <queue>
 #include <random>
 #include <source_location>
 #include <stdexcept>
 #include <string_view>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #ifdef _MSC_VER
 #pragma warning( disable : 4068 ) /* Disable unknown pragma 'mark' warning */
 #endif
@@ -22,14 +38,189 @@ namespace roguely {
 #pragma mark anon_namespace
 
 namespace {
-std::mutex gen_mut;
-std::mt19937 gen_mt(std::random_device{}());
+// {passes = n, fill = 0..1, seed = n}, any of which may be missing
+MapGenerationParams read_map_generation_params(const sol::optional<sol::table> & options) {
+    MapGenerationParams params;
+    if (options) {
+        params.passes = std::max(options->get_or("passes", params.passes), 0);
+        params.wall_fill = std::clamp(options->get_or("fill", params.wall_fill), 0.0, 1.0);
+        if (sol::optional<lua_Integer> seed = (*options)["seed"]; seed) params.seed = static_cast<uint64_t>(*seed);
+    }
+    return params;
+}
 
-int generate_random_int(int min, int max) {
-    std::uniform_int_distribution<> dis(min, max);
-    std::unique_lock l(gen_mut);
-    return dis(gen_mt);
+// cell_sprites maps cell id -> sprite id; light_tints maps light value -> {r, g, b, a} and falls back to the current
+// rules' tints when absent
+Map::TileRules read_tile_rules(const sol::table & cell_sprites, const sol::optional<sol::table> & light_tints,
+                               const Map::TileRules & current) {
+    Map::TileRules rules;
+    for (const auto & [key, value] : cell_sprites) {
+        if (!key.is<int>() || !value.is<int>() || key.as<int>() < 0) continue;
+        const auto cell_id = size_t(key.as<int>());
+        if (cell_id >= rules.sprite_for_cell.size()) rules.sprite_for_cell.resize(cell_id + 1u, -1);
+        rules.sprite_for_cell[cell_id] = value.as<int>();
+    }
+
+    if (!light_tints) {
+        rules.tint_for_light = current.tint_for_light;
+    } else {
+        for (const auto & [key, value] : *light_tints) {
+            if (!key.is<int>() || !value.is<sol::table>() || key.as<int>() < 0) continue;
+            const auto light = size_t(key.as<int>());
+            const auto color = value.as<sol::table>();
+            if (light >= rules.tint_for_light.size()) rules.tint_for_light.resize(light + 1u);
+            rules.tint_for_light[light] = SDL_Color{.r = Uint8(color.get_or(1, 255)), .g = Uint8(color.get_or(2, 255)),
+                                                    .b = Uint8(color.get_or(3, 255)), .a = Uint8(color.get_or(4, 255))};
+        }
+    }
+    return rules;
 }
+
+// Level files (save_level / load_level) are a LevelHeader, the map name, the saved group names, then the map's cell
+// and light bytes as two raw width x height arrays that load_level copies straight out of the mapping, and finally
+// one record per entity. Everything is in native byte order.
+constexpr char LEVEL_MAGIC[4] = {'R', 'G', 'L', 'V'};
+constexpr uint32_t LEVEL_VERSION = 1;
+
+struct LevelHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t group_count;
+    uint32_t entity_count;
+};
+
+// Lua values are stored as a tag byte followed by the payload. Functions, userdata and threads aren't saved.
+enum class LevelValueTag : uint8_t { Nil, False, True, Integer, Number, String, Table };
+constexpr int MAX_LEVEL_TABLE_DEPTH = 32; // also stops cyclic tables
+
+class LevelWriter {
+public:
+    template <typename T>
+    void put(const T & value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        const auto * p = reinterpret_cast<const uint8_t *>(&value);
+        bytes.insert(bytes.end(), p, p + sizeof(T));
+    }
+
+    void put_string(std::string_view str) {
+        put(uint32_t(str.size()));
+        bytes.insert(bytes.end(), str.begin(), str.end());
+    }
+
+    static bool is_saveable(const sol::object & value) {
+        switch (value.get_type()) {
+        case sol::type::boolean:
+        case sol::type::number:
+        case sol::type::string:
+        case sol::type::table: return true;
+        default: return false;
+        }
+    }
+
+    void put_lua_value(const sol::object & value, int depth = 0) {
+        switch (value.get_type()) {
+        case sol::type::boolean: put(value.as<bool>() ? LevelValueTag::True : LevelValueTag::False); break;
+        case sol::type::number: {
+            // Integral numbers keep full 64 bit precision; the check works on Lua 5.1 style (double only) VMs too
+            const double d = value.as<double>();
+            if (std::trunc(d) == d && std::abs(d) < 0x1.0p63) {
+                put(LevelValueTag::Integer);
+                put(int64_t(value.as<lua_Integer>()));
+            } else {
+                put(LevelValueTag::Number);
+                put(d);
+            }
+            break;
+        }
+        case sol::type::string:
+            put(LevelValueTag::String);
+            put_string(value.as<std::string_view>());
+            break;
+        case sol::type::table: {
+            if (depth >= MAX_LEVEL_TABLE_DEPTH) {
+                put(LevelValueTag::Nil);
+                break;
+            }
+            std::vector<std::pair<sol::object, sol::object>> entries;
+            for (const auto & [k, v] : value.as<sol::table>())
+                if (is_saveable(k) && k.get_type() != sol::type::table && is_saveable(v)) entries.emplace_back(k, v);
+            put(LevelValueTag::Table);
+            put(uint32_t(entries.size()));
+            for (const auto & [k, v] : entries) {
+                put_lua_value(k, depth + 1);
+                put_lua_value(v, depth + 1);
+            }
+            break;
+        }
+        default: put(LevelValueTag::Nil); break;
+        }
+    }
+
+    std::vector<uint8_t> bytes;
+};
+
+class LevelReader {
+public:
+    explicit LevelReader(std::span<const uint8_t> b) : bytes(b) {}
+
+    std::span<const uint8_t> take(size_t n) {
+        if (n > bytes.size() - offset) throw std::runtime_error("Truncated level file");
+        auto ret = bytes.subspan(offset, n);
+        offset += n;
+        return ret;
+    }
+
+    size_t remaining() const { return bytes.size() - offset; }
+    // Throws unless count items of at least min_size bytes each could still be in the file, so a corrupt count is
+    // caught before anything is sized from it
+    void check_count(size_t count, size_t min_size) const {
+        if (count > remaining() / min_size) throw std::runtime_error("Truncated level file");
+    }
+
+    template <typename T>
+    T get() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, take(sizeof(T)).data(), sizeof(T));
+        return value;
+    }
+
+    std::string get_string() {
+        const auto length = get<uint32_t>();
+        const auto b = take(length);
+        return std::string(reinterpret_cast<const char *>(b.data()), b.size());
+    }
+
+    sol::object get_lua_value(sol::state_view & lua, int depth = 0) {
+        if (depth > MAX_LEVEL_TABLE_DEPTH) throw std::runtime_error("Level file nests tables too deeply");
+        switch (get<LevelValueTag>()) {
+        case LevelValueTag::Nil: return sol::lua_nil;
+        case LevelValueTag::False: return sol::make_object(lua, false);
+        case LevelValueTag::True: return sol::make_object(lua, true);
+        case LevelValueTag::Integer: return sol::make_object(lua, lua_Integer(get<int64_t>()));
+        case LevelValueTag::Number: return sol::make_object(lua, get<double>());
+        case LevelValueTag::String: return sol::make_object(lua, get_string());
+        case LevelValueTag::Table: {
+            const auto count = get<uint32_t>();
+            sol::table table = lua.create_table();
+            for (uint32_t i = 0; i < count; ++i) {
+                auto k = get_lua_value(lua, depth + 1);
+                auto v = get_lua_value(lua, depth + 1);
+                if (k.valid() && k.get_type() != sol::type::lua_nil) table[k] = v;
+            }
+            return table;
+        }
+        }
+        throw std::runtime_error("Corrupt value in level file");
+    }
+
+private:
+    std::span<const uint8_t> bytes;
+    size_t offset{};
+};
+
 #define check_sdl_ptr_or_throw(obj, msg) \
     do { \
         if (!obj) { \
@@ -46,6 +237,21 @@ struct Defer {
     Defer(Func && f) : func(std::move(f)) {}
     ~Defer() { func(); }
 };
+// Wraps a Lua binding so every call is timed under the binding's name. Spells out the lambda's parameter list rather
+// than forwarding a pack, since sol2 works out what to pull off the Lua stack from the signature it's handed.
+template <typename Func, typename Ret, typename Class, typename... Args>
+auto make_profiled(const char * name, Func func, Ret (Class::*)(Args...) const) {
+    return [name, func = std::move(func)](Args... args) -> Ret {
+        const Profiler::Scope scope(name);
+        return func(std::forward<Args>(args)...);
+    };
+}
+
+template <typename Func>
+auto profiled(const char * name, Func func) {
+    return make_profiled(name, std::move(func), &Func::operator());
+}
+
 } // namespace
 
 #pragma mark detail
@@ -58,6 +264,10 @@ namespace detail {
     void Deleter::operator()(SDL_Renderer *p) const { SDL_DestroyRenderer(p); }
     void Deleter::operator()(SDL_Window *p) const { SDL_DestroyWindow(p); }
     void Deleter::operator()(TTF_Font *p) const { TTF_CloseFont(p); }
+    size_t next_component_type_id() {
+        static std::atomic_size_t next_id{0u};
+        return next_id++;
+    }
 } // namespace detail
 
 #pragma mark Id
@@ -66,9 +276,16 @@ namespace detail {
 std::string Id::to_string() const { return std::format("{}", id); }
 std::string generate_uuid() { return Id().to_string(); }
 
+/* static */ void Id::reserve_through(size_t id) {
+    size_t next = nextId.load();
+    while (next <= id && !nextId.compare_exchange_weak(next, id + 1)) {}
+}
+
 #pragma mark Text
 
 int Text::load_font(const std::string & path, int ptsize) {
+    cache.clear();
+    lru.clear();
     font.reset(TTF_OpenFont(path.c_str(), ptsize));
 
     if (!font) {
@@ -79,6 +296,21 @@ int Text::load_font(const std::string & path, int ptsize) {
     return 0;
 }
 
+int Text::load_font(std::vector<char> data, int ptsize) {
+    cache.clear();
+    lru.clear();
+    font.reset(); // before the data it reads from goes
+    font_data = std::move(data);
+    font.reset(TTF_OpenFontRW(SDL_RWFromConstMem(font_data.data(), int(font_data.size())), 1, ptsize));
+
+    if (!font) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to load font from memory\n%s", TTF_GetError());
+        return -1;
+    }
+
+    return 0;
+}
+
 Size Text::get_text_extents(const std::string & text) {
     Size ret;
     if (!font || TTF_SizeText(font.get(), text.c_str(), &ret.width, &ret.height) != 0)
@@ -93,19 +325,43 @@ void Text::draw_text(SDL_Renderer * renderer, int x, int y, const std::string &
 void Text::draw_text(SDL_Renderer * renderer, int x, int y, const std::string & t, SDL_Color color) {
     if (t.size() <= 0) return;
 
-    if (text != t) {
-        text = t;
-        UPtr<SDL_Surface> text_surface{TTF_RenderText_Blended(font.get(), t.c_str(), color)};
+    key_scratch.assign({char(color.r), char(color.g), char(color.b)});
+    key_scratch += t;
+
+    auto it = cache.find(key_scratch);
+    if (it != cache.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+    } else {
+        const SDL_Color opaque{.r = color.r, .g = color.g, .b = color.b, .a = 255};
+        UPtr<SDL_Surface> text_surface{TTF_RenderText_Blended(font.get(), t.c_str(), opaque)};
         check_sdl_ptr_or_throw(text_surface, "Unable to create surface for text");
-        text_texture.reset(SDL_CreateTextureFromSurface(renderer, text_surface.get()));
+        UPtr<SDL_Texture> text_texture{SDL_CreateTextureFromSurface(renderer, text_surface.get())};
         check_sdl_ptr_or_throw(text_texture, "Unable to create texture for text");
-        text_rect = {.x = x, .y = y, .w = text_surface->w, .h = text_surface->h};
-    } else {
-        text_rect.x = x;
-        text_rect.y = y;
+        Profiler::get().count("text_rasterized");
+        Profiler::get().count("sdl_textures_created");
+
+        lru.push_front({.key = key_scratch, .texture = std::move(text_texture), .width = text_surface->w,
+                        .height = text_surface->h});
+        cache.emplace(key_scratch, lru.begin());
+
+        while (lru.size() > cache_capacity) {
+            cache.erase(lru.back().key);
+            lru.pop_back();
+        }
     }
 
-    SDL_RenderCopy(renderer, text_texture.get(), nullptr, &text_rect);
+    const auto & rendered = *lru.begin();
+    const SDL_Rect text_rect{.x = x, .y = y, .w = rendered.width, .h = rendered.height};
+    SDL_SetTextureAlphaMod(rendered.texture.get(), color.a);
+    SDL_RenderCopy(renderer, rendered.texture.get(), nullptr, &text_rect);
+}
+
+void Text::set_cache_capacity(size_t capacity) {
+    cache_capacity = std::max<size_t>(capacity, 1u);
+    while (lru.size() > cache_capacity) {
+        cache.erase(lru.back().key);
+        lru.pop_back();
+    }
 }
 
 #pragma mark EntityGroupName
@@ -128,19 +384,15 @@ std::shared_ptr<EntityGroup> EntityManager::create_entity_group(const std::strin
     entityGroup->name = group_name;
     entityGroup->entities = std::make_shared<std::vector<std::shared_ptr<Entity>>>();
     entity_groups.push_back(entityGroup);
+    entity_groups_by_name[group_name] = entityGroup;
     return entityGroup;
 }
 
 void EntityManager::add_entity_to_group(const std::string & group_name, std::shared_ptr<Entity> e, sol::this_state s) {
     sol::state_view lua(s);
     auto group = get_entity_group(group_name);
-    if (group == nullptr) {
-        group = std::make_shared<EntityGroup>();
-        group->name = group_name;
-        group->entities = std::make_unique<std::vector<std::shared_ptr<Entity>>>();
-        entity_groups.push_back(group);
-    }
-    group->entities->emplace_back(e);
+    if (group == nullptr) group = create_entity_group(group_name);
+    group->add(e);
 
     // Create Lua mapping (entity_group->entity->components)
     sol::table lua_entity_table;
@@ -149,7 +401,7 @@ void EntityManager::add_entity_to_group(const std::string & group_name, std::sha
     } else
         lua_entity_table = lua_entities[group_name];
 
-    auto lua_component = e->find_first_component_by_type<LuaComponent>();
+    auto * lua_component = e->get_component<LuaComponent>();
 
     if (lua_component != nullptr) {
         auto full_name = std::format("{}-{}", e->get_name(), e->get_id());
@@ -159,14 +411,17 @@ void EntityManager::add_entity_to_group(const std::string & group_name, std::sha
     }
 
     lua_entities.set(group_name, lua_entity_table);
+
+    refresh_components(group_name, e);
+    install_component_hook(group_name, e);
 }
 
 std::shared_ptr<Entity> EntityManager::create_entity_in_group(const std::string & group_name,
                                                               const std::string & entity_name) {
-    auto entity = std::make_shared<Entity>(entity_name);
+    auto entity = make_entity(entity_name);
     auto entity_group = get_entity_group(group_name);
     if (entity_group != nullptr) {
-        entity_group->entities->emplace_back(entity);
+        entity_group->add(entity);
         return entity;
     }
     return nullptr;
@@ -174,34 +429,39 @@ std::shared_ptr<Entity> EntityManager::create_entity_in_group(const std::string
 
 void EntityManager::remove_entity(const std::string & entity_group_name, const std::string & entity_id) {
     auto entity_group = get_entity_group(entity_group_name);
+    if (entity_group == nullptr) return;
 
-    if (entity_group != nullptr) {
-        auto entity_to_remove =
-            std::find_if(entity_group->entities->begin(), entity_group->entities->end(),
-                         [&](std::shared_ptr<Entity> e) { return (e->get_id() == entity_id) ? true : false; });
+    auto entity_to_remove = entity_group->remove(entity_id);
+    if (entity_to_remove == nullptr) return;
 
-        if (entity_to_remove != entity_group->entities->end()) {
-            const std::string full_name = std::format("{}-{}", (*entity_to_remove)->get_name(), (*entity_to_remove)->get_id());
+    const std::string full_name = std::format("{}-{}", entity_to_remove->get_name(), entity_to_remove->get_id());
 
-            // println("Removing entity: {}", full_name);
+    // println("Removing entity: {}", full_name);
 
-            sol::table entity_group_table = lua_entities[entity_group_name];
-            entity_group_table.set(full_name, sol::nil);
+    sol::table entity_group_table = lua_entities[entity_group_name];
+    entity_group_table.set(full_name, sol::nil);
 
-            // println("Checking entity is valid: {}", entity_group_table[full_name].valid());
+    // println("Checking entity is valid: {}", entity_group_table[full_name].valid());
 
-            entity_group->entities->erase(entity_to_remove);
-        }
-    }
+    if (const auto position = get_entity_position(*entity_to_remove)) index_remove(*position, entity_to_remove.get());
+    native.remove(entity_to_remove.get());
+    for (auto & [key, view] : query_views) view.erase(entity_to_remove.get());
+    component_snapshots.erase(entity_to_remove.get());
 }
 
-std::shared_ptr<EntityGroup> EntityManager::get_entity_group(const std::string & group_name) const {
-    const auto it = std::find_if(entity_groups.begin(), entity_groups.end(),
-                                 [&](const std::shared_ptr<EntityGroup> & eg) { return eg->name == group_name; });
+void EntityManager::clear_entity_group(const std::string & entity_group_name) {
+    auto entity_group = get_entity_group(entity_group_name);
+    if (entity_group == nullptr) return;
 
-    if (it == entity_groups.end())
-        return nullptr;
-    return *it;
+    std::vector<std::string> ids;
+    ids.reserve(entity_group->entities->size());
+    for (const auto & e : *entity_group->entities) ids.push_back(e->get_id());
+    for (const auto & id : ids) remove_entity(entity_group_name, id);
+}
+
+std::shared_ptr<EntityGroup> EntityManager::get_entity_group(const std::string & group_name) const {
+    auto it = entity_groups_by_name.find(group_name);
+    return it != entity_groups_by_name.end() ? it->second : nullptr;
 }
 
 std::shared_ptr<std::vector<std::shared_ptr<Entity>>>
@@ -221,16 +481,19 @@ std::string EntityManager::get_entity_id_by_name(const std::string & group_name,
 
 std::shared_ptr<Entity> EntityManager::get_entity_by_name(const std::string & entity_group,
                                                           const std::string & entity_name) const {
-    return find_entity(entity_group, [&](const std::shared_ptr<Entity> & e) { return e->get_name() == entity_name; });
+    auto group = get_entity_group(entity_group);
+    return group != nullptr ? group->find_by_name(entity_name) : nullptr;
 }
 
 std::shared_ptr<Entity> EntityManager::get_entity_by_id(const std::string & entity_group,
                                                         const std::string & entity_id) const {
-    return find_entity(entity_group, [&](const std::shared_ptr<Entity> & e) { return e->get_id() == entity_id; });
+    auto group = get_entity_group(entity_group);
+    return group != nullptr ? group->find_by_id(entity_id) : nullptr;
 }
 
 std::shared_ptr<std::vector<std::shared_ptr<Entity>>>
-EntityManager::find_entities_in_group(const std::string & entity_group, std::function<bool(std::shared_ptr<Entity>)> predicate) const {
+EntityManager::find_entities_in_group(const std::string & entity_group,
+                                      std::function<bool(const std::shared_ptr<Entity> &)> predicate) const {
     auto entity_group_ptr = get_entity_group(entity_group);
     auto entities = std::make_shared<std::vector<std::shared_ptr<Entity>>>();
 
@@ -245,13 +508,13 @@ EntityManager::find_entities_in_group(const std::string & entity_group, std::fun
     return nullptr;
 }
 
-std::shared_ptr<Entity> EntityManager::find_entity(const std::string & entity_group,
-                                                   std::function<bool(std::shared_ptr<Entity>)> predicate) const {
+std::shared_ptr<Entity>
+EntityManager::find_entity(const std::string & entity_group,
+                           std::function<bool(const std::shared_ptr<Entity> &)> predicate) const {
     auto entity_group_ptr = get_entity_group(entity_group);
 
     if (entity_group_ptr != nullptr) {
-        auto entity = std::find_if(entity_group_ptr->entities->begin(), entity_group_ptr->entities->end(),
-                                   [&](const std::shared_ptr<Entity> & e) { return predicate(e); });
+        auto entity = std::find_if(entity_group_ptr->entities->begin(), entity_group_ptr->entities->end(), predicate);
 
         if (entity != entity_group_ptr->entities->end()) { return *entity; }
     }
@@ -268,6 +531,12 @@ sol::table EntityManager::get_lua_entity(const std::string & entity_group, const
         return result;
     }
 
+    if (auto e = get_entity_by_name(entity_group, entity_name)) {
+        sol::optional<sol::table> entity = entities[std::format("{}-{}", e->get_name(), e->get_id())];
+        if (entity) return *entity;
+    }
+
+    // Not an exact name, fall back to matching it as a prefix of the entity's full name
     entities.for_each([&](const sol::object & key, const sol::table & value) {
         if (key.is<std::string>()) {
             std::string key_str = key.as<std::string>();
@@ -282,6 +551,13 @@ sol::table EntityManager::get_lua_entity(const std::string & entity_group, const
     return result;
 }
 
+sol::table EntityManager::get_lua_entity_table(const std::string & entity_group, const Entity & e) const {
+    sol::optional<sol::table> entities = lua_entities[entity_group];
+    if (!entities) return sol::lua_nil;
+    sol::optional<sol::table> entity = (*entities)[std::format("{}-{}", e.get_name(), e.get_id())];
+    return entity ? *entity : sol::table(sol::lua_nil);
+}
+
 void EntityManager::remove_lua_component(const std::string & entity_group, const std::string & entity_name,
                                          const std::string & component_name) {
     auto entity = get_lua_entity(entity_group, entity_name);
@@ -291,6 +567,7 @@ void EntityManager::remove_lua_component(const std::string & entity_group, const
             components[component_name] = sol::nil;
             // println("removed component {} from entity {}", component_name, entity_name);
         }
+        if (auto e = get_entity_by_name(entity_group, entity_name)) refresh_components(entity_group, e);
     }
 }
 
@@ -299,7 +576,7 @@ bool EntityManager::lua_entities_for_each(std::function<bool(sol::table)> predic
 
     for (const auto & eg : entity_groups) {
         for (const auto & e : *eg->entities) {
-            auto lua_component = e->find_first_component_by_type<LuaComponent>();
+            auto * lua_component = e->get_component<LuaComponent>();
             if (lua_component != nullptr) {
                 auto lua_components_table = lua_component->get_properties();
                 // FIXME: do we stop iterating if result is false?
@@ -311,62 +588,26 @@ bool EntityManager::lua_entities_for_each(std::function<bool(sol::table)> predic
     return result;
 }
 
-bool EntityManager::lua_is_point_unique(const Point & point) const {
-    auto result = true;
-
-    for (const auto & eg : entity_groups) {
-        for (const auto & e : *eg->entities) {
-            auto lua_component = e->find_first_component_by_type<LuaComponent>();
-
-            if (lua_component != nullptr) {
-                auto lua_components_table = lua_component->get_properties();
-
-                if (lua_components_table.valid()) {
-                    auto position_component = lua_components_table["position_component"];
-                    if (position_component.valid()) {
-                        int x = position_component["x"];
-                        int y = position_component["y"];
-
-                        if (x == point.x && y == point.y) {
-                            result = false;
-                            break;
-                        }
-                    }
-                }
-            }
-        }
-    }
-
-    return result;
-}
+bool EntityManager::lua_is_point_unique(const Point & point) const { return spatial_index.at(point) == nullptr; }
 
 void EntityManager::lua_for_each_overlapping_point(const std::string & entity_name, int x, int y,
                                                    sol::function point_callback) {
-    for (const auto & eg : entity_groups) {
-        for (const auto & e : *eg->entities) {
-            auto lua_component = e->find_first_component_by_type<LuaComponent>();
-
-            if (e->get_name() != entity_name && lua_component != nullptr) {
-                auto lua_components_table = lua_component->get_properties();
-
-                if (lua_components_table.valid()) {
-                    auto position_component = lua_components_table["position_component"];
-                    if (position_component.valid()) {
-                        int pc_x = position_component["x"];
-                        int pc_y = position_component["y"];
-
-                        if (pc_x == x && pc_y == y) {
-                            // println("found overlapping point: Player({}, {}) == Entity({}, {})", x, y, pc_x, pc_y);
-                            auto point_callback_result = point_callback(
-                                std::format("{}-{}", e->get_name(), e->get_id()), e->get_name(), lua_components_table);
-                            if (!point_callback_result.valid()) {
-                                sol::error err = point_callback_result;
-                                println("Lua script error: {}", err.what());
-                            }
-                        }
-                    }
-                }
-            }
+    const auto * entries = spatial_index.at({x, y});
+    if (!entries) return;
+
+    // Take a copy, the callback is free to add, move or remove entities
+    const std::vector<SpatialIndex::Entry> overlapping = *entries;
+    for (const auto & [e, group_name] : overlapping) {
+        if (e->get_name() == entity_name) continue;
+        auto * lua_component = e->get_component<LuaComponent>();
+        if (lua_component == nullptr) continue;
+
+        // println("found overlapping point: Player({}, {}) == Entity({}, {})", x, y, x, y);
+        auto point_callback_result = point_callback(std::format("{}-{}", e->get_name(), e->get_id()), e->get_name(),
+                                                    lua_component->get_properties());
+        if (!point_callback_result.valid()) {
+            sol::error err = point_callback_result;
+            println("Lua script error: {}", err.what());
         }
     }
 }
@@ -374,172 +615,883 @@ void EntityManager::lua_for_each_overlapping_point(const std::string & entity_na
 sol::table EntityManager::get_lua_blocked_points(const std::string & entity_group, int x, int y,
                                                  const std::string & direction, sol::this_state s) {
     sol::state_view lua(s);
-    auto eg = get_entity_group(entity_group);
     sol::table result = lua.create_table();
 
-    for (const auto & e : *eg->entities) {
-        auto lua_component = e->find_first_component_by_type<LuaComponent>();
-
-        if (lua_component != nullptr) {
-            auto lua_components_table = lua_component->get_properties();
-
-            if (lua_components_table.valid()) {
-                auto position_component = lua_components_table["position_component"];
-                if (position_component.valid()) {
-                    bool is_blocked = false;
-
-                    int entity_x = position_component["x"];
-                    int entity_y = position_component["y"];
-
-                    int up_position_y = y - 1;
-                    int down_position_y = y + 1;
-                    int left_position_x = x - 1;
-                    int right_position_x = x + 1;
-
-                    // UP
-                    if (direction == "up" && entity_x == x && up_position_y == entity_y) {
-                        is_blocked = true;
-                    }
-                    // DOWN
-                    else if (direction == "down" && entity_x == x && entity_y == down_position_y) {
-                        is_blocked = true;
-                    }
-                    // LEFT
-                    else if (direction == "left" && entity_x == left_position_x && entity_y == y) {
-                        is_blocked = true;
-                    }
-                    // RIGHT
-                    else if (direction == "right" && entity_x == right_position_x && entity_y == y) {
-                        is_blocked = true;
-                    }
-
-                    if (is_blocked) {
-                        // println("found overlapping point: Player({}, {}) == Entity({}, {})", x, y, entity_x, entity_y);
-
-                        result.set("entity_name", e->get_name());
-                        result.set("entity_full_name", std::format("{}-{}", e->get_name(), e->get_id()));
-                        result.set("entity_position", lua.create_table_with("x", entity_x, "y", entity_y));
-                        result.set("direction", direction);
-                        break;
-                    }
-                }
-            }
+    Point target{x, y};
+    if (direction == "up") --target.y;
+    else if (direction == "down") ++target.y;
+    else if (direction == "left") --target.x;
+    else if (direction == "right") ++target.x;
+    else return result;
+
+    if (const auto * entries = spatial_index.at(target)) {
+        for (const auto & [e, group_name] : *entries) {
+            if (group_name != entity_group) continue;
+
+            // println("found overlapping point: Player({}, {}) == Entity({}, {})", x, y, target.x, target.y);
+            result.set("entity_name", e->get_name());
+            result.set("entity_full_name", std::format("{}-{}", e->get_name(), e->get_id()));
+            result.set("entity_position", lua.create_table_with("x", target.x, "y", target.y));
+            result.set("direction", direction);
+            break;
         }
     }
 
     return result;
 }
 
-sol::table EntityManager::get_lua_entities_in_viewport(std::function<bool(int x, int y)> predicate, sol::this_state s) {
-    // loop through all of the entity groups and find the entities that are in the viewport
-    // return a table of entities that are in the viewport
+sol::table EntityManager::get_lua_entities_in_viewport(const Point & top_left, const Point & bottom_right,
+                                                       sol::this_state s) {
+    if (viewport_cache.valid && viewport_cache.top_left == top_left && viewport_cache.bottom_right == bottom_right)
+        return viewport_cache.entities;
+
+    const Profiler::Scope scope("EntityManager::get_lua_entities_in_viewport");
+
+    // find the entities that are in the viewport and return a table of them
     sol::state_view lua(s);
     sol::table result = lua.create_table();
 
-    for (const auto & eg : entity_groups) {
-        for (const auto & e : *eg->entities) {
-            auto lua_component = e->find_first_component_by_type<LuaComponent>();
-
-            if (lua_component != nullptr) {
-                auto lua_components_table = lua_component->get_properties();
+    spatial_index.for_each_in_rect(top_left, bottom_right, [&](const Point &, const SpatialIndex::Entry & entry) {
+        const auto & e = entry.entity;
+        const auto fn = std::format("{}-{}", e->get_name(), e->get_id());
+        result.set(fn, lua.create_table_with("group_name", entry.group_name, "name", e->get_name(), "full_name", fn));
+    });
 
-                if (lua_components_table.valid()) {
-                    auto position_component = lua_components_table["position_component"];
-                    if (position_component.valid()) {
-                        auto x = position_component["x"];
-                        auto y = position_component["y"];
+    viewport_cache = {.top_left = top_left, .bottom_right = bottom_right, .entities = result, .valid = true};
+    return result;
+}
 
-                        if (predicate(x, y)) {
-                            const auto fn = std::format("{}-{}", e->get_name(), e->get_id());
-                            result.set(fn, lua.create_table_with("group_name", eg->name, "name", e->get_name(), "full_name", fn));
-                        }
-                    }
-                }
-            }
-        }
+bool EntityManager::set_entity_position(const std::string & entity_group, const std::string & entity_id, int x, int y) {
+    auto e = get_entity_by_id(entity_group, entity_id);
+    if (e == nullptr) return false;
+    if (native.positions.slot(e.get())) {
+        move_entity(*e, {x, y});
+        return true;
     }
 
-    return result;
+    auto * lua_component = e->get_component<LuaComponent>();
+    if (lua_component == nullptr) return false;
+    auto properties = lua_component->get_properties();
+    sol::state_view lua(properties.lua_state());
+    properties.set("position_component", lua.create_table_with("x", x, "y", y));
+    refresh_components(entity_group, e);
+    return true;
 }
 
-#pragma mark LuaComponent
+void EntityManager::bind_native_components(const std::string & entity_group, const std::shared_ptr<Entity> & e) {
+    const auto old_position = get_entity_position(*e);
+    auto * lua_component = e->get_component<LuaComponent>();
+    const sol::table properties = lua_component != nullptr ? lua_component->get_properties() : sol::table{};
+    const auto component = [&](const char * name) -> sol::optional<sol::table> {
+        if (!properties.valid()) return sol::nullopt;
+        return properties.get<sol::optional<sol::table>>(name);
+    };
 
-/* static */
-sol::table LuaComponent::copy_table(const sol::table & original, sol::this_state s) {
-    sol::state_view lua(original.lua_state());
-    sol::table copy = lua.create_table();
+    if (auto position = component("position_component"); !position) {
+        native.positions.remove(e.get());
+        native.blocking.remove(e.get());
+    } else if (!is_bound(*position, *e)) {
+        // Plain gets rather than raw ones, so values a prototype instance inherits are picked up as well
+        const auto x = position->get<sol::optional<int>>("x");
+        const auto y = position->get<sol::optional<int>>("y");
+        if (x && y) {
+            native.positions.set(e.get(), *x, *y);
+            native.blocking.set(e.get(), uint8_t(position->get<sol::optional<bool>>("blocking").value_or(false)));
+            position->raw_set("x", sol::lua_nil, "y", sol::lua_nil, "blocking", sol::lua_nil);
+            install_native_proxy(*position, NativeComponent::Position, e);
+        } else {
+            native.positions.remove(e.get());
+            native.blocking.remove(e.get());
+        }
+    }
 
-    original.for_each([&](const sol::object & key, const sol::object & value) {
-        if (value.is<sol::table>()) {
-            copy[key] = copy_table(value.as<sol::table>(), s);
+    if (auto stats = component("stats_component"); !stats) {
+        native.health.remove(e.get());
+    } else if (!is_bound(*stats, *e)) {
+        const auto health = stats->get<sol::optional<double>>("health");
+        // max_health is optional, NaN stands in for it being nil
+        const auto max_health = stats->get<sol::optional<double>>("max_health");
+        if (health) {
+            const auto slot = native.health.slot(e.get());
+            const double old_health = slot ? native.health.column<0>()[*slot] : *health;
+            native.health.set(e.get(), *health, max_health.value_or(std::numeric_limits<double>::quiet_NaN()));
+            stats->raw_set("health", sol::lua_nil, "max_health", sol::lua_nil);
+            install_native_proxy(*stats, NativeComponent::Stats, e);
+            // A replacement stats component can kill the entity as surely as a write to its health
+            health_changed(*e, old_health, *health);
         } else {
-            copy[key] = value;
+            native.health.remove(e.get());
         }
-    });
+    }
 
-    return copy;
-}
+    if (auto sprite = component("sprite_component"); !sprite) {
+        native.sprites.remove(e.get());
+    } else if (!is_bound(*sprite, *e)) {
+        if (const auto sprite_id = sprite->get<sol::optional<int>>("sprite_id")) {
+            native.sprites.set(e.get(), *sprite_id);
+            sprite->raw_set("sprite_id", sol::lua_nil);
+            install_native_proxy(*sprite, NativeComponent::Sprite, e);
+        } else {
+            native.sprites.remove(e.get());
+        }
+    }
 
-#pragma mark SpriteSheet
+    const auto new_position = get_entity_position(*e);
+    if (old_position && new_position) {
+        if (*old_position != *new_position) index_move(*old_position, *new_position, e.get());
+    } else if (old_position) {
+        index_remove(*old_position, e.get());
+    } else if (new_position) {
+        index_insert(*new_position, e, entity_group);
+    }
+}
 
-SpriteSheet::SpriteSheet(SDL_Renderer * renderer, const std::string & n, const std::string & p, int sw, int sh, int sf) {
-    path = p;
-    name = n;
-    sprite_width = sw;
-    sprite_height = sh;
+/* static */
+std::optional<EntityManager::NativeField> EntityManager::native_field(NativeComponent component, std::string_view key) {
+    switch (component) {
+    case NativeComponent::Position:
+        if (key == "x") return NativeField::PositionX;
+        if (key == "y") return NativeField::PositionY;
+        if (key == "blocking") return NativeField::Blocking;
+        break;
+    case NativeComponent::Stats:
+        if (key == "health") return NativeField::Health;
+        if (key == "max_health") return NativeField::MaxHealth;
+        break;
+    case NativeComponent::Sprite:
+        if (key == "sprite_id") return NativeField::SpriteId;
+        break;
+    }
+    return std::nullopt;
+}
 
-    if (sf <= 0) sf = 1;
+/* static */
+std::span<const std::string_view> EntityManager::native_field_names(NativeComponent component) {
+    static constexpr std::string_view position[] = {"x", "y", "blocking"};
+    static constexpr std::string_view stats[] = {"health", "max_health"};
+    static constexpr std::string_view sprite[] = {"sprite_id"};
+    switch (component) {
+    case NativeComponent::Position: return position;
+    case NativeComponent::Stats: return stats;
+    case NativeComponent::Sprite: return sprite;
+    }
+    return {};
+}
 
-    scale_factor = sf;
+sol::object EntityManager::read_native_field(const Entity & e, NativeField field, sol::this_state s) const {
+    const auto read = [&](const auto & pool, auto column) -> sol::object {
+        const auto slot = pool.slot(&e);
+        if (!slot) return sol::lua_nil;
+        return sol::make_object(s, pool.template column<decltype(column)::value>()[*slot]);
+    };
+    switch (field) {
+    case NativeField::PositionX: return read(native.positions, std::integral_constant<size_t, 0>{});
+    case NativeField::PositionY: return read(native.positions, std::integral_constant<size_t, 1>{});
+    case NativeField::Blocking: {
+        const auto slot = native.blocking.slot(&e);
+        return slot ? sol::make_object(s, native.blocking.column<0>()[*slot] != 0) : sol::object(sol::lua_nil);
+    }
+    case NativeField::Health:
+    case NativeField::MaxHealth: {
+        const auto slot = native.health.slot(&e);
+        if (!slot) return sol::lua_nil;
+        const double value =
+            field == NativeField::Health ? native.health.column<0>()[*slot] : native.health.column<1>()[*slot];
+        if (std::isnan(value)) return sol::lua_nil;
+        // Whole numbers go back as integers, as Lua stored them, so eg tostring doesn't start printing "10.0"
+        if (std::floor(value) == value && std::abs(value) <= double(INT_MAX))
+            return sol::make_object(s, lua_Integer(value));
+        return sol::make_object(s, value);
+    }
+    case NativeField::SpriteId: return read(native.sprites, std::integral_constant<size_t, 0>{});
+    }
+    return sol::lua_nil;
+}
 
-    // println("loading spritesheet: {}", path);
-    // println("sprite width: {} | sprite height: {}", sprite_width, sprite_height);
-    // println("scale factor: {}", scale_factor);
+// Map coordinates and sprite ids are ints, so anything else is a script bug rather than something to round away
+static int native_int(std::string_view key, const sol::object & value) {
+    if (value.get_type() == sol::type::number) {
+        const double number = value.as<double>();
+        if (std::floor(number) == number && number >= double(INT_MIN) && number <= double(INT_MAX)) return int(number);
+    }
+    throw std::runtime_error(std::format("'{}' must be a whole number between {} and {}", key, INT_MIN, INT_MAX));
+}
 
-    UPtr<SDL_Surface> tileset{IMG_Load(p.c_str())};
-    check_sdl_ptr_or_throw(tileset, "Unable to load tileset");
-    spritesheet_texture.reset(SDL_CreateTextureFromSurface(renderer, tileset.get()));
-    check_sdl_ptr_or_throw(spritesheet_texture, "Unable to create spritesheet_texture");
-    int total_sprites_on_sheet = tileset->w / sw * tileset->h / sh;
-    // println("total sprites on sheet: {}", total_sprites_on_sheet);
+static double native_number(std::string_view key, const sol::object & value) {
+    if (value.get_type() == sol::type::number && !std::isnan(value.as<double>())) return value.as<double>();
+    throw std::runtime_error(std::format("'{}' must be a number", key));
+}
 
-    SDL_GetTextureColorMod(spritesheet_texture.get(), &o_red, &o_green, &o_blue);
+bool EntityManager::write_native_field(sol::table component, NativeComponent kind, std::string_view key,
+                                       const Entity & e, const sol::object & value) {
+    const auto field = native_field(kind, key);
+    if (!field) return false;
+    const bool is_nil = value.get_type() == sol::type::lua_nil;
+    const auto unbind = [&] {
+        unbind_native_component(component, kind, e);
+        component.raw_set(key, sol::lua_nil);
+    };
 
-    for (int y = 0; y < total_sprites_on_sheet / (sw + sh); ++y) {
-        for (int x = 0; x < total_sprites_on_sheet / (sw + sh); ++x) {
-            sprites.push_back({x * sw, y * sh, sw, sh});
+    switch (*field) {
+    case NativeField::PositionX:
+    case NativeField::PositionY: {
+        const int number = is_nil ? 0 : native_int(key, value);
+        auto position = get_entity_position(e);
+        if (!position) return false;
+        if (is_nil) {
+            unbind();
+            return true;
+        }
+        (*field == NativeField::PositionX ? position->x : position->y) = number;
+        move_entity(e, *position);
+        return true;
+    }
+    case NativeField::Blocking: {
+        // nil is as good as false, as it is when the component is bound
+        if (!is_nil && value.get_type() != sol::type::boolean)
+            throw std::runtime_error(std::format("'{}' must be a boolean", key));
+        const auto slot = native.blocking.slot(&e);
+        if (!slot) return false;
+        native.blocking.column<0>()[*slot] = uint8_t(!is_nil && value.as<bool>());
+        return true;
+    }
+    case NativeField::Health:
+    case NativeField::MaxHealth: {
+        // max_health is optional, NaN stands in for it being nil
+        const double number = is_nil ? std::numeric_limits<double>::quiet_NaN() : native_number(key, value);
+        const auto slot = native.health.slot(&e);
+        if (!slot) return false;
+        if (*field == NativeField::MaxHealth) {
+            native.health.column<1>()[*slot] = number;
+        } else if (is_nil) {
+            unbind();
+        } else {
+            auto & health = native.health.column<0>()[*slot];
+            const double old_health = std::exchange(health, number);
+            health_changed(e, old_health, health);
+        }
+        return true;
+    }
+    case NativeField::SpriteId: {
+        const int number = is_nil ? 0 : native_int(key, value);
+        const auto slot = native.sprites.slot(&e);
+        if (!slot) return false;
+        if (is_nil) {
+            unbind();
+        } else {
+            native.sprites.column<0>()[*slot] = number;
         }
+        return true;
     }
+    }
+    return false;
+}
 
-    sprites.resize(total_sprites_on_sheet, {0, 0, 0, 0});
+void EntityManager::unbind_native_component(sol::table component, NativeComponent kind, const Entity & e) {
+    // The fields still set go back into the table, as they were before it was bound
+    const sol::this_state s{component.lua_state()};
+    for (const auto name : native_field_names(kind))
+        component.raw_set(name, read_native_field(e, *native_field(kind, name), s));
+
+    switch (kind) {
+    case NativeComponent::Position:
+        if (const auto position = get_entity_position(e)) index_remove(*position, &e);
+        native.positions.remove(&e);
+        native.blocking.remove(&e);
+        break;
+    case NativeComponent::Stats: native.health.remove(&e); break;
+    case NativeComponent::Sprite: native.sprites.remove(&e); break;
+    }
+    // The proxy stays installed but steps aside: is_bound no longer holds, so the next bind takes the table up again
+    component[sol::metatable_key].get<sol::table>().raw_set("__native_owner", sol::lua_nil);
 }
 
-void SpriteSheet::draw_sprite(SDL_Renderer * renderer, int sprite_id, int x, int y) const {
-    draw_sprite(renderer, sprite_id, x, y, scale_factor);
+void EntityManager::install_native_proxy(sol::table component, NativeComponent kind,
+                                         const std::shared_ptr<Entity> & e) {
+    sol::state_view lua(component.lua_state());
+    sol::table metatable = lua.create_table();
+
+    // The table's own metatable (the script's, or a prototype instance's) stays in effect behind the native fields: its
+    // other metamethods and markers (__prototype, say) are carried over and the native __index and __newindex fall
+    // back to its own. If the table was bound before, chain to what that binding fell back to.
+    sol::object fallback_index = sol::lua_nil, fallback_newindex = sol::lua_nil;
+    if (const sol::optional<sol::table> previous = component[sol::metatable_key]) {
+        const bool was_bound = previous->raw_get<sol::object>("__native_proxy").valid();
+        fallback_index = previous->raw_get<sol::object>(was_bound ? "__fallback_index" : "__index");
+        fallback_newindex = previous->raw_get<sol::object>(was_bound ? "__fallback_newindex" : "__newindex");
+        previous->for_each([&](const sol::object & key, const sol::object & value) {
+            metatable.raw_set(key, value);
+        });
+    }
+    metatable.raw_set("__fallback_index", fallback_index, "__fallback_newindex", fallback_newindex);
+    // Marks the table as bound, and to whom, so bind_native_components leaves it alone next time
+    metatable.raw_set("__native_proxy", true, "__native_owner", e->get_id());
+
+    // Both metamethods only fire for keys missing from the table itself, which the native fields always are. The weak
+    // pointer keeps a table that outlives its entity (held in a Lua local, say) from reaching into freed memory.
+    const std::weak_ptr<Entity> weak = e;
+    metatable.set_function("__index", [this, weak, kind, fallback_index](sol::table self, sol::object key,
+                                                                         sol::this_state s) -> sol::object {
+        const auto entity = weak.lock();
+        if (entity && key.get_type() == sol::type::string && is_bound(self, *entity)) {
+            if (const auto field = native_field(kind, key.as<std::string_view>()))
+                return read_native_field(*entity, *field, s);
+        }
+        if (fallback_index.get_type() == sol::type::table) return fallback_index.as<sol::table>().get<sol::object>(key);
+        if (fallback_index.get_type() == sol::type::function) {
+            sol::protected_function_result result = fallback_index.as<sol::protected_function>()(self, key);
+            if (result.valid()) return result.get<sol::object>();
+            sol::error err = result;
+            println("Lua script error: {}", err.what());
+        }
+        return sol::lua_nil;
+    });
+    // A bad value for a native field raises a Lua error in the script that wrote it. Once a field is set to nil the
+    // table holds its fields itself again, and writes to it are checked for a component the engine can bind
+    metatable.set_function("__newindex", [this, weak, kind, fallback_newindex](sol::table self, sol::object key,
+                                                                               sol::object value) {
+        const auto entity = weak.lock();
+        const bool bound = entity && is_bound(self, *entity);
+        if (bound && key.get_type() == sol::type::string &&
+            write_native_field(self, kind, key.as<std::string_view>(), *entity, value))
+            return;
+        if (fallback_newindex.get_type() == sol::type::table) {
+            fallback_newindex.as<sol::table>()[key] = value;
+        } else if (fallback_newindex.get_type() == sol::type::function) {
+            sol::protected_function_result result = fallback_newindex.as<sol::protected_function>()(self, key, value);
+            if (!result.valid()) {
+                sol::error err = result;
+                println("Lua script error: {}", err.what());
+            }
+        } else {
+            self.raw_set(key, value);
+        }
+        if (entity && !bound && key.get_type() == sol::type::string && native_field(kind, key.as<std::string_view>())) {
+            if (const auto entry = find_entry(*entity)) bind_native_components(entry->group_name, entry->entity);
+        }
+    });
+    // pairs walks the table's own fields and the native ones, as if they were still stored in it. It walks a copy, so
+    // fields assigned on the way aren't seen.
+    metatable.set_function("__pairs", [this, weak, kind](sol::table self, sol::this_state s) {
+        sol::state_view lua(s);
+        sol::table fields = lua.create_table();
+        self.for_each([&](const sol::object & key, const sol::object & value) { fields.raw_set(key, value); });
+        if (const auto entity = weak.lock(); entity && is_bound(self, *entity)) {
+            for (const auto name : native_field_names(kind))
+                if (auto value = read_native_field(*entity, *native_field(kind, name), s); value.valid())
+                    fields.raw_set(name, value);
+        }
+        return std::make_tuple(lua.get<sol::object>("next"), fields, sol::lua_nil);
+    });
+    component[sol::metatable_key] = metatable;
 }
 
-void SpriteSheet::draw_sprite(SDL_Renderer * renderer, int sprite_id, int x, int y, int scale_factor) const {
-    if (sprite_id < 0 || size_t(sprite_id) >= sprites.size()) {
-        println("sprite id out of range: {}", sprite_id);
-        return;
+/* static */
+bool EntityManager::is_bound(const sol::table & component, const Entity & e) {
+    const sol::optional<sol::table> metatable = component[sol::metatable_key];
+    if (!metatable) return false;
+    const auto owner = metatable->raw_get<sol::optional<std::string>>("__native_owner");
+    return owner && *owner == e.get_id();
+}
+
+void EntityManager::move_entity(const Entity & e, const Point & to) {
+    const auto slot = native.positions.slot(&e);
+    if (!slot) return;
+    auto & xs = native.positions.column<0>();
+    auto & ys = native.positions.column<1>();
+    const Point from{xs[*slot], ys[*slot]};
+    if (from == to) return;
+    xs[*slot] = to.x;
+    ys[*slot] = to.y;
+    index_move(from, to, &e);
+}
+
+bool EntityManager::is_blocking_at(const Point & p) const {
+    const auto * entries = spatial_index.at(p);
+    if (entries == nullptr) return false;
+    for (const auto & entry : *entries) {
+        const auto slot = native.blocking.slot(entry.entity.get());
+        if (slot && native.blocking.column<0>()[*slot]) return true;
     }
+    return false;
+}
 
-    int width = sprite_width;
-    int height = sprite_height;
+sol::table EntityManager::instantiate_prototype(const sol::table & prototype,
+                                               const sol::optional<sol::table> & overrides, sol::this_state s) {
+    sol::state_view lua(s);
+    sol::table components = lua.create_table();
 
-    if (scale_factor > 0) {
-        width = sprite_width * scale_factor;
-        height = sprite_height * scale_factor;
+    prototype.for_each([&](const sol::object & key, const sol::object & value) {
+        if (value.get_type() != sol::type::table) {
+            components.raw_set(key, value);
+            return;
+        }
+        // Every instance of a prototype component shares one metatable
+        const auto prototype_component = value.as<sol::table>();
+        auto metatable = prototype_metatables.raw_get<sol::optional<sol::table>>(prototype_component);
+        if (!metatable) {
+            metatable = lua.create_table_with("__index", prototype_component, "__prototype", prototype_component);
+            prototype_metatables.raw_set(prototype_component, *metatable);
+        }
+        sol::table instance = lua.create_table();
+        instance[sol::metatable_key] = *metatable;
+        components.raw_set(key, instance);
+    });
+
+    if (overrides) {
+        overrides->for_each([&](const sol::object & key, const sol::object & value) {
+            auto instance = components.raw_get<sol::optional<sol::table>>(key);
+            if (!instance || value.get_type() != sol::type::table) {
+                components.raw_set(key, value);
+                return;
+            }
+            value.as<sol::table>().for_each(
+                [&](const sol::object & k, const sol::object & v) { instance->raw_set(k, v); });
+        });
     }
 
-    const SDL_Rect dest{.x = x, .y = y, .w = width, .h = height};
-    auto & sprite_rect = sprites[sprite_id];
-    SDL_RenderCopy(renderer, spritesheet_texture.get(), &sprite_rect, &dest);
+    return components;
 }
 
-void SpriteSheet::draw_sprite_sheet(SDL_Renderer * renderer, int x, int y) const {
-    int col = 0;
-    int row_height = 0;
+/* static */
+sol::table EntityManager::get_component_prototype(const sol::table & component) {
+    const sol::optional<sol::table> metatable = component[sol::metatable_key];
+    if (!metatable) return sol::lua_nil;
+    auto prototype = metatable->raw_get<sol::optional<sol::table>>("__prototype");
+    return prototype ? *prototype : sol::table(sol::lua_nil);
+}
+
+sol::table EntityManager::snapshot_components(const Entity & e, sol::this_state s) const {
+    auto * lua_component = e.get_component<LuaComponent>();
+    if (lua_component == nullptr) return sol::lua_nil;
+    const sol::table properties = lua_component->get_properties();
+    sol::table copy = copy_table(properties, s);
+
+    // copy_table only sees a prototype instance's own fields, fill in the ones it still inherits
+    properties.for_each([&](const sol::object & key, const sol::object & value) {
+        if (value.get_type() != sol::type::table) return;
+        const auto prototype = get_component_prototype(value.as<sol::table>());
+        if (!prototype.valid()) return;
+        auto component_copy = copy.raw_get<sol::optional<sol::table>>(key);
+        if (!component_copy) return;
+        prototype.for_each([&](const sol::object & k, const sol::object & v) {
+            if (component_copy->raw_get<sol::object>(k).get_type() != sol::type::lua_nil) return;
+            component_copy->raw_set(k, v.get_type() == sol::type::table ? copy_table(v.as<sol::table>(), s) : v);
+        });
+    });
+
+    const auto restore = [&](const char * component, const char * key, sol::object value) {
+        if (!value.valid() || value.get_type() == sol::type::lua_nil) return;
+        if (auto table = copy.get<sol::optional<sol::table>>(component)) table->raw_set(key, value);
+    };
+    restore("position_component", "x", read_native_field(e, NativeField::PositionX, s));
+    restore("position_component", "y", read_native_field(e, NativeField::PositionY, s));
+    restore("position_component", "blocking", read_native_field(e, NativeField::Blocking, s));
+    restore("stats_component", "health", read_native_field(e, NativeField::Health, s));
+    restore("stats_component", "max_health", read_native_field(e, NativeField::MaxHealth, s));
+    restore("sprite_component", "sprite_id", read_native_field(e, NativeField::SpriteId, s));
+    return copy;
+}
+
+void EntityManager::install_component_hook(const std::string & entity_group, const std::shared_ptr<Entity> & e) {
+    auto * lua_component = e->get_component<LuaComponent>();
+    if (lua_component == nullptr) return;
+    sol::table components = lua_component->get_properties();
+    sol::state_view lua(components.lua_state());
+    sol::table metatable = lua.create_table();
+
+    // __newindex only fires for keys the table doesn't have, ie a component being added (player.components.x = {...}),
+    // so that one is picked up straight away. Replacing or removing one is left to sync_components. The group check
+    // keeps a table that outlives its entity's removal from putting it back.
+    const std::weak_ptr<Entity> weak = e;
+    metatable.set_function("__newindex", [this, weak, entity_group](sol::table self, sol::object key,
+                                                                    sol::object value) {
+        self.raw_set(key, value);
+        const auto entity = weak.lock();
+        if (!entity || get_entity_by_id(entity_group, entity->get_id()) != entity) return;
+        refresh_components(entity_group, entity);
+    });
+    components[sol::metatable_key] = metatable;
+}
+
+void EntityManager::refresh_components(const std::string & entity_group, const std::shared_ptr<Entity> & e) {
+    bind_native_components(entity_group, e);
+    update_query_views(entity_group, e);
+
+    auto & snapshot = component_snapshots[e.get()];
+    snapshot.clear();
+    auto * lua_component = e->get_component<LuaComponent>();
+    if (lua_component == nullptr) return;
+    lua_component->get_properties().for_each([&](const sol::object & key, const sol::object & value) {
+        if (key.get_type() == sol::type::string && value.get_type() == sol::type::table)
+            snapshot.emplace_back(key.as<std::string>(), value.pointer());
+    });
+}
+
+void EntityManager::sync_components() {
+    const Profiler::Scope scope("EntityManager::sync_components");
+    for (const auto & group : entity_groups) {
+        for (const auto & e : *group->entities) {
+            auto * lua_component = e->get_component<LuaComponent>();
+            if (lua_component == nullptr) continue;
+            const auto found = component_snapshots.find(e.get());
+            const ComponentSnapshot * snapshot = found != component_snapshots.end() ? &found->second : nullptr;
+
+            // Same component tables under the same names as last time, in any order, means nothing to do
+            size_t seen = 0;
+            bool changed = snapshot == nullptr;
+            lua_component->get_properties().for_each([&](const sol::object & key, const sol::object & value) {
+                if (changed || key.get_type() != sol::type::string || value.get_type() != sol::type::table) return;
+                const auto name = key.as<std::string_view>();
+                const void * table = value.pointer();
+                changed = std::ranges::none_of(*snapshot, [&](const auto & entry) {
+                    return entry.first == name && entry.second == table;
+                });
+                ++seen;
+            });
+            if (changed || seen != snapshot->size()) refresh_components(group->name, e);
+        }
+    }
+}
+
+void EntityManager::update_query_views(const std::string & entity_group, const std::shared_ptr<Entity> & e) {
+    for (auto & [key, view] : query_views) {
+        const bool member = view.slots.contains(e.get());
+        if (view.matches(entity_group, *e) == member) continue;
+        if (member) view.erase(e.get());
+        else if (auto entity_table = get_lua_entity_table(entity_group, *e); entity_table.valid())
+            view.insert(e.get(), entity_table);
+    }
+}
+
+sol::table EntityManager::query(std::vector<std::string> components, const std::string & entity_group,
+                                sol::this_state s) {
+    std::sort(components.begin(), components.end());
+    components.erase(std::unique(components.begin(), components.end()), components.end());
+    std::string key = entity_group;
+    for (const auto & component : components) key += '|' + component;
+
+    // Catches components replaced or removed by plain assignment since the last sync, so the view is current
+    sync_components();
+
+    auto [it, inserted] = query_views.try_emplace(key);
+    auto & view = it->second;
+    if (!inserted) return view.entities;
+
+    // First time this query is asked: build the view with one scan, from here on it's maintained incrementally
+    sol::state_view lua(s);
+    view.entity_group = entity_group;
+    view.components = std::move(components);
+    view.entities = lua.create_table();
+    for (const auto & eg : entity_groups) {
+        if (!entity_group.empty() && eg->name != entity_group) continue;
+        for (const auto & e : *eg->entities) {
+            if (!view.matches(eg->name, *e)) continue;
+            if (auto entity_table = get_lua_entity_table(eg->name, *e); entity_table.valid())
+                view.insert(e.get(), entity_table);
+        }
+    }
+    return view.entities;
+}
+
+bool EntityManager::QueryView::matches(const std::string & group_name, const Entity & e) const {
+    if (!entity_group.empty() && entity_group != group_name) return false;
+    auto * lua_component = e.get_component<LuaComponent>();
+    if (lua_component == nullptr) return false;
+    const auto properties = lua_component->get_properties();
+    return std::ranges::all_of(components, [&](const std::string & component) {
+        return properties.raw_get<sol::object>(component).get_type() == sol::type::table;
+    });
+}
+
+void EntityManager::QueryView::insert(const Entity * e, const sol::table & entity_table) {
+    if (!slots.try_emplace(e, owners.size()).second) return;
+    owners.push_back(e);
+    entities.raw_set(owners.size(), entity_table);
+}
+
+void EntityManager::QueryView::erase(const Entity * e) {
+    const auto it = slots.find(e);
+    if (it == slots.end()) return;
+    const size_t slot = it->second;
+    const size_t last = owners.size() - 1;
+    if (slot != last) {
+        owners[slot] = owners[last];
+        slots[owners[slot]] = slot;
+        entities.raw_set(slot + 1, entities.raw_get<sol::object>(last + 1));
+    }
+    entities.raw_set(last + 1, sol::lua_nil);
+    owners.pop_back();
+    slots.erase(e);
+}
+
+void EntityManager::index_insert(const Point & p, const std::shared_ptr<Entity> & e, const std::string & group_name) {
+    spatial_index.insert(p, e, group_name);
+    if (viewport_cache.contains(p)) viewport_cache.valid = false;
+}
+
+void EntityManager::index_remove(const Point & p, const Entity * e) {
+    spatial_index.remove(p, e);
+    if (viewport_cache.contains(p)) viewport_cache.valid = false;
+}
+
+void EntityManager::index_move(const Point & from, const Point & to, const Entity * e) {
+    spatial_index.move(from, to, e);
+    if (viewport_cache.contains(from) != viewport_cache.contains(to)) viewport_cache.valid = false;
+
+    if (!events.is_wanted("move") && !events.is_wanted("collide")) return;
+    const auto * entries = spatial_index.at(to);
+    if (entries == nullptr || entries->back().entity.get() != e) return; // it wasn't indexed at from
+    const auto & moved = entries->back(); // the index appends what moves in
+    events.publish({.type = "move", .entity = moved, .from = from, .to = to});
+    for (const auto & other : *entries)
+        if (other.entity.get() != e) events.publish({.type = "collide", .entity = moved, .other = other, .to = to});
+}
+
+void EntityManager::health_changed(const Entity & e, double from, double to) {
+    if (from > 0 && to <= 0 && events.is_wanted("death"))
+        if (auto entry = find_entry(e)) events.publish({.type = "death", .entity = std::move(*entry)});
+}
+
+std::optional<SpatialIndex::Entry> EntityManager::find_entry(const Entity & e) const {
+    for (const auto & group : entity_groups)
+        if (auto found = group->find_by_id(e.get_id()); found.get() == &e)
+            return SpatialIndex::Entry{.entity = found, .group_name = group->name};
+    return std::nullopt;
+}
+
+sol::table EntityManager::event_to_lua(const GameEvent & event, sol::this_state s) const {
+    sol::state_view lua(s);
+    sol::table result = lua.create_table();
+    result["type"] = event.type;
+    const auto add_entity = [&](const SpatialIndex::Entry & entry, const std::string & prefix) {
+        if (!entry.entity) return;
+        const auto full_name = std::format("{}-{}", entry.entity->get_name(), entry.entity->get_id());
+        result[prefix + "group"] = entry.group_name;
+        result[prefix + "id"] = entry.entity->get_id();
+        result[prefix + "name"] = entry.entity->get_name();
+        result[prefix + "full_name"] = full_name;
+        result[prefix.empty() ? std::string("entity") : "other"] =
+            get_lua_entity_table(entry.group_name, *entry.entity);
+    };
+    add_entity(event.entity, "");
+    add_entity(event.other, "other_");
+    if (event.type == "death") {
+        if (const auto position = event.entity.entity ? get_entity_position(*event.entity.entity) : std::nullopt) {
+            result["x"] = position->x;
+            result["y"] = position->y;
+        }
+    } else {
+        result["x"] = event.to.x;
+        result["y"] = event.to.y;
+        if (event.type == "move") {
+            result["from_x"] = event.from.x;
+            result["from_y"] = event.from.y;
+        }
+    }
+    return result;
+}
+
+#pragma mark EntityGroup
+
+void EntityGroup::add(const std::shared_ptr<Entity> & e) {
+    auto [it, inserted] = slot_by_id.try_emplace(e->get_id());
+    if (!inserted) throw std::runtime_error(std::format("Entity id \"{}\" already in group \"{}\"", e->get_id(), name));
+    auto & ids = ids_by_name[e->get_name()];
+    it->second = Slot{.index = entities->size(), .name_it = ids.insert(ids.end(), e->get_id())};
+    entities->push_back(e);
+}
+
+std::shared_ptr<Entity> EntityGroup::remove(const std::string & entity_id) {
+    auto it = slot_by_id.find(entity_id);
+    if (it == slot_by_id.end()) return nullptr;
+
+    const auto [slot, name_it] = it->second;
+    slot_by_id.erase(it);
+    auto removed = std::move((*entities)[slot]);
+    if (slot + 1u != entities->size()) {
+        (*entities)[slot] = std::move(entities->back());
+        slot_by_id[(*entities)[slot]->get_id()].index = slot;
+    }
+    entities->pop_back();
+
+    if (auto names_it = ids_by_name.find(removed->get_name()); names_it != ids_by_name.end()) {
+        names_it->second.erase(name_it);
+        if (names_it->second.empty()) ids_by_name.erase(names_it);
+    }
+
+    return removed;
+}
+
+#pragma mark SpatialIndex
+
+void SpatialIndex::insert(const Point & p, const std::shared_ptr<Entity> & e, const std::string & group_name) {
+    cells[key(p)].push_back(Entry{.entity = e, .group_name = group_name});
+    ++count;
+    changed(p);
+}
+
+void SpatialIndex::remove(const Point & p, const Entity * e) {
+    auto it = cells.find(key(p));
+    if (it == cells.end()) return;
+    auto & entries = it->second;
+    auto entry = std::find_if(entries.begin(), entries.end(), [e](const Entry & en) { return en.entity.get() == e; });
+    if (entry == entries.end()) return;
+    if (entry != entries.end() - 1) *entry = std::move(entries.back());
+    entries.pop_back();
+    --count;
+    if (entries.empty()) cells.erase(it);
+    changed(p);
+}
+
+void SpatialIndex::move(const Point & from, const Point & to, const Entity * e) {
+    auto it = cells.find(key(from));
+    if (it == cells.end()) return;
+    auto & entries = it->second;
+    auto entry = std::find_if(entries.begin(), entries.end(), [e](const Entry & en) { return en.entity.get() == e; });
+    if (entry == entries.end()) return;
+    Entry moved = std::move(*entry);
+    if (entry != entries.end() - 1) *entry = std::move(entries.back());
+    entries.pop_back();
+    if (entries.empty()) cells.erase(it);
+    cells[key(to)].push_back(std::move(moved));
+    changed(from);
+    changed(to);
+}
+
+#pragma mark EventBus
+
+void EventBus::dispatch(sol::this_state s, const std::function<sol::table(const GameEvent &)> & to_lua) {
+    sol::state_view lua(s);
+    for (int round = 0; round < max_rounds && !queue.empty(); ++round) {
+        // Subscribers publishing while we go through these land in the queue for the next round
+        const auto events = std::exchange(queue, {});
+        // One array per type, shared by its subscribers, and types in the order their first event was published
+        std::vector<std::pair<std::string, sol::table>> batches;
+        for (const auto & event : events) {
+            auto it = std::ranges::find(batches, event.type, &std::pair<std::string, sol::table>::first);
+            if (it == batches.end()) it = batches.insert(it, {event.type, lua.create_table()});
+            it->second.add(event.data.valid() ? event.data : to_lua(event));
+        }
+        Profiler::get().count("events_dispatched", int64_t(events.size()));
+
+        for (const auto & [type, batch] : batches) {
+            // A copy, subscribers may subscribe more
+            const auto callbacks = subscribers[type];
+            for (const auto & callback : callbacks) {
+                auto result = callback(batch);
+                if (!result.valid()) {
+                    sol::error err = result;
+                    println("Lua script error in a '{}' event subscriber: {}", type, err.what());
+                }
+            }
+        }
+    }
+}
+
+#pragma mark LuaComponent
+
+/* static */
+sol::table LuaComponent::copy_table(const sol::table & original, sol::this_state s) {
+    sol::state_view lua(original.lua_state());
+    sol::table copy = lua.create_table();
+
+    original.for_each([&](const sol::object & key, const sol::object & value) {
+        if (value.is<sol::table>()) {
+            copy[key] = copy_table(value.as<sol::table>(), s);
+        } else {
+            copy[key] = value;
+        }
+    });
+
+    return copy;
+}
+
+#pragma mark SpriteSheet
+
+SpriteSheet::SpriteSheet(SDL_Renderer * renderer, const std::string & n, const std::string & p, SDL_Surface * tileset,
+                         int sw, int sh, int sf) {
+    path = p;
+    name = n;
+    sprite_width = sw;
+    sprite_height = sh;
+
+    if (sf <= 0) sf = 1;
+
+    scale_factor = sf;
+
+    // println("loading spritesheet: {}", path);
+    // println("sprite width: {} | sprite height: {}", sprite_width, sprite_height);
+    // println("scale factor: {}", scale_factor);
+
+    // Headless engines have no renderer; the sheet still knows its sprites, it just can't draw them
+    if (renderer) {
+        spritesheet_texture.reset(SDL_CreateTextureFromSurface(renderer, tileset), detail::Deleter{});
+        check_sdl_ptr_or_throw(spritesheet_texture, "Unable to create spritesheet_texture");
+        Profiler::get().count("sdl_textures_created");
+    }
+    int total_sprites_on_sheet = tileset->w / sw * tileset->h / sh;
+    // println("total sprites on sheet: {}", total_sprites_on_sheet);
+
+    texture_size = {tileset->w, tileset->h};
+
+    for (int y = 0; y < total_sprites_on_sheet / (sw + sh); ++y) {
+        for (int x = 0; x < total_sprites_on_sheet / (sw + sh); ++x) {
+            sprites.push_back({x * sw, y * sh, sw, sh});
+        }
+    }
+
+    sprites.resize(total_sprites_on_sheet, {0, 0, 0, 0});
+}
+
+void SpriteSheet::draw_sprite(SDL_Renderer * renderer, int sprite_id, int x, int y) const {
+    draw_sprite(renderer, sprite_id, x, y, scale_factor);
+}
+
+void SpriteSheet::draw_sprite(SDL_Renderer * renderer, int sprite_id, int x, int y, int scale_factor) const {
+    if (sprite_id < 0 || size_t(sprite_id) >= sprites.size()) {
+        println("sprite id out of range: {}", sprite_id);
+        return;
+    }
+
+    int width = sprite_width;
+    int height = sprite_height;
+
+    if (scale_factor > 0) {
+        width = sprite_width * scale_factor;
+        height = sprite_height * scale_factor;
+    }
+
+    const SDL_Rect dest{.x = x, .y = y, .w = width, .h = height};
+    auto & sprite_rect = sprites[sprite_id];
+    SDL_RenderCopy(renderer, spritesheet_texture.get(), &sprite_rect, &dest);
+}
+
+void SpriteSheet::batch_sprite(SpriteBatch & batch, int sprite_id, int x, int y, int scale_factor,
+                               std::optional<SDL_Color> tint) const {
+    if (sprite_id < 0 || size_t(sprite_id) >= sprites.size()) {
+        println("sprite id out of range: {}", sprite_id);
+        return;
+    }
+    if (scale_factor <= 0) scale_factor = 1;
+
+    const SDL_Rect dest{.x = x, .y = y, .w = sprite_width * scale_factor, .h = sprite_height * scale_factor};
+    batch.add(spritesheet_texture.get(), texture_size, sprites[sprite_id], dest, tint.value_or(highlight_color));
+}
+
+void SpriteSheet::move_to_atlas(std::shared_ptr<SDL_Texture> atlas, const Size & atlas_size,
+                                const SDL_Rect & region) {
+    for (auto & sprite : sprites) {
+        sprite.x += region.x;
+        sprite.y += region.y;
+    }
+    spritesheet_texture = std::move(atlas);
+    texture_size = atlas_size;
+}
+
+void SpriteSheet::draw_sprite_sheet(SDL_Renderer * renderer, int x, int y) const {
+    int col = 0;
+    int row_height = 0;
 
     // println("scale_factor: {}", scale_factor);
     assert(sprites.size() <= size_t(std::numeric_limits<int>::max()));
@@ -586,71 +1538,226 @@ Point SpriteSheet::map_to_world(const int x, const int y, const Dimension & dime
     };
 }
 
-#pragma mark Map
+#pragma mark SpriteBatch
+
+void SpriteBatch::add(SDL_Texture * texture, const Size & texture_size, const SDL_Rect & source,
+                      const SDL_Rect & destination, SDL_Color tint) {
+    if (texture == nullptr) return;
+    if (runs.empty() || runs.back().texture != texture)
+        runs.push_back({.texture = texture, .first_vertex = vertices.size(), .first_index = indices.size()});
+
+    const float x0 = float(destination.x), y0 = float(destination.y);
+    const float x1 = float(destination.x + destination.w), y1 = float(destination.y + destination.h);
+    const float u0 = float(source.x) / float(texture_size.width), v0 = float(source.y) / float(texture_size.height);
+    const float u1 = float(source.x + source.w) / float(texture_size.width);
+    const float v1 = float(source.y + source.h) / float(texture_size.height);
+
+    const int base = int(vertices.size() - runs.back().first_vertex);
+    vertices.push_back({{x0, y0}, tint, {u0, v0}});
+    vertices.push_back({{x1, y0}, tint, {u1, v0}});
+    vertices.push_back({{x0, y1}, tint, {u0, v1}});
+    vertices.push_back({{x1, y1}, tint, {u1, v1}});
+    for (const int i : {0, 1, 2, 2, 1, 3}) indices.push_back(base + i);
+}
 
-void Map::draw_map(SDL_Renderer * renderer, const Dimension & dimensions,
-                   const std::shared_ptr<SpriteSheet> & sprite_sheet,
-                   const std::function<void(int, int, int, int, int, int, int)> & draw_hook) {
-    int scale_factor = sprite_sheet->get_scale_factor();
-    int sprite_width = sprite_sheet->get_sprite_width();
-    int sprite_height = sprite_sheet->get_sprite_height();
+void SpriteBatch::flush(SDL_Renderer * renderer) {
+    if (runs.empty()) return;
+    for (size_t i = 0; i < runs.size(); ++i) {
+        const auto & run = runs[i];
+        const size_t end_vertex = i + 1 < runs.size() ? runs[i + 1].first_vertex : vertices.size();
+        const size_t end_index = i + 1 < runs.size() ? runs[i + 1].first_index : indices.size();
+        SDL_RenderGeometry(renderer, run.texture, vertices.data() + run.first_vertex,
+                           int(end_vertex - run.first_vertex), indices.data() + run.first_index,
+                           int(end_index - run.first_index));
+    }
+    Profiler::get().count("sprite_batch_draw_calls", int64_t(runs.size()));
+    Profiler::get().count("sprites_batched", int64_t(vertices.size() / 4));
+    vertices.clear();
+    indices.clear();
+    runs.clear();
+}
 
-    int texture_width = dimensions.size.width * (sprite_width * scale_factor);
-    int texture_height = dimensions.size.height * (sprite_height * scale_factor);
+#pragma mark TextureAtlas
+
+std::optional<std::vector<SDL_Rect>> TextureAtlas::pack(const std::vector<Size> & sizes, const Size & max_size,
+                                                        Size & atlas_size) {
+    std::vector<size_t> order(sizes.size());
+    std::iota(order.begin(), order.end(), size_t{0});
+    std::ranges::stable_sort(order, std::greater{}, [&](size_t i) { return sizes[i].height; });
+
+    std::vector<SDL_Rect> places(sizes.size());
+    atlas_size = {};
+    int shelf_x = 0, shelf_y = 0, shelf_height = 0;
+    for (const size_t i : order) {
+        const int w = sizes[i].width + padding, h = sizes[i].height + padding;
+        if (w > max_size.width) return std::nullopt;
+        if (shelf_x + w > max_size.width) {
+            shelf_y += shelf_height;
+            shelf_x = shelf_height = 0;
+        }
+        if (shelf_y + h > max_size.height) return std::nullopt;
+        places[i] = {.x = shelf_x, .y = shelf_y, .w = sizes[i].width, .h = sizes[i].height};
+        shelf_x += w;
+        shelf_height = std::max(shelf_height, h);
+        atlas_size.width = std::max(atlas_size.width, shelf_x);
+        atlas_size.height = std::max(atlas_size.height, shelf_y + shelf_height);
+    }
+    return places;
+}
 
-    if (current_map_segment_dimension != dimensions) {
-        current_map_segment_dimension = dimensions;
+std::shared_ptr<SDL_Texture> TextureAtlas::create(SDL_Renderer * renderer, const std::vector<SDL_Surface *> & surfaces,
+                                                  const std::vector<SDL_Rect> & places, const Size & atlas_size) {
+    UPtr<SDL_Surface> atlas{
+        SDL_CreateRGBSurfaceWithFormat(0, atlas_size.width, atlas_size.height, 32, SDL_PIXELFORMAT_RGBA32)};
+    check_sdl_ptr_or_throw(atlas, "Unable to create the texture atlas surface");
+    SDL_FillRect(atlas.get(), nullptr, SDL_MapRGBA(atlas->format, 0, 0, 0, 0));
+    for (size_t i = 0; i < surfaces.size(); ++i) {
+        // Copy alpha and any color key through as they are, rather than blending onto the transparent atlas
+        SDL_SetSurfaceBlendMode(surfaces[i], SDL_BLENDMODE_NONE);
+        UPtr<SDL_Surface> converted{SDL_ConvertSurfaceFormat(surfaces[i], SDL_PIXELFORMAT_RGBA32, 0)};
+        check_sdl_ptr_or_throw(converted, "Unable to convert a surface for the texture atlas");
+        SDL_SetSurfaceBlendMode(converted.get(), SDL_BLENDMODE_NONE);
+        SDL_Rect place = places[i];
+        SDL_BlitSurface(converted.get(), nullptr, atlas.get(), &place);
+    }
 
-        current_map_segment_texture.reset(SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
-                                                            texture_width, texture_height));
-        check_sdl_ptr_or_throw(current_map_segment_texture, "Unable to create current_map_segment_texture");
-        SDL_SetRenderTarget(renderer, current_map_segment_texture.get());
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-        SDL_RenderClear(renderer);
+    std::shared_ptr<SDL_Texture> texture{SDL_CreateTextureFromSurface(renderer, atlas.get()), detail::Deleter{}};
+    check_sdl_ptr_or_throw(texture, "Unable to create the texture atlas");
+    Profiler::get().count("sdl_textures_created");
+    SDL_SetTextureBlendMode(texture.get(), SDL_BLENDMODE_BLEND);
+    return texture;
+}
+
+#pragma mark Map
+
+void Map::draw_map(SDL_Renderer * renderer, const Dimension & dimensions,
+                   const std::shared_ptr<SpriteSheet> & sprite_sheet,
+                   const std::function<void(int, int, int, int, int, int, int)> & draw_hook,
+                   const std::function<void()> & flush) {
+    const Profiler::Scope scope("Map::draw_map");
+    const int scale_factor = sprite_sheet->get_scale_factor();
+    draw_cached(
+        renderer, dimensions, TileCache::Content::Hook, *sprite_sheet,
+        [&](int x, int y, int dx, int dy) {
+            // rows, cols = map Y, X
+            // dx, dy = position in the tile cache
+            if (draw_hook != nullptr) draw_hook(y, x, dx, dy, (*map)(y, x), (*light_map)(y, x), scale_factor);
+        },
+        flush);
+}
 
-        for (int rows = dimensions.point.y; rows < dimensions.size.height; ++rows) {
-            for (int cols = dimensions.point.x; cols < dimensions.size.width; ++cols) {
-                int dx = (cols * sprite_width * scale_factor) - (dimensions.point.x * sprite_width * scale_factor);
-                int dy = (rows * sprite_height * scale_factor) - (dimensions.point.y * sprite_height * scale_factor);
+void Map::draw_cached(SDL_Renderer * renderer, const Dimension & dimensions, TileCache::Content content,
+                      const SpriteSheet & sprite_sheet, const std::function<void(int, int, int, int)> & draw_tile,
+                      const std::function<void()> & flush) {
+    // The viewport's cells, clipped to the map
+    const int view_x = std::max(dimensions.point.x, 0), view_y = std::max(dimensions.point.y, 0);
+    const int view_cols = std::min(dimensions.size.width, width) - view_x;
+    const int view_rows = std::min(dimensions.size.height, height) - view_y;
+    if (view_cols <= 0 || view_rows <= 0) return;
+
+    auto & cache = tile_cache;
+    const int tile_width = sprite_sheet.get_sprite_width() * sprite_sheet.get_scale_factor();
+    const int tile_height = sprite_sheet.get_sprite_height() * sprite_sheet.get_scale_factor();
+    const Size tiles{.width = std::min(view_cols + 2 * TileCache::margin, width),
+                     .height = std::min(view_rows + 2 * TileCache::margin, height)};
+    if (!cache.texture || cache.content != content || cache.sprite_sheet != &sprite_sheet ||
+        cache.tile_width != tile_width || cache.tile_height != tile_height || cache.tiles != tiles) {
+        cache.texture.reset(SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+                                              tiles.width * tile_width, tiles.height * tile_height));
+        check_sdl_ptr_or_throw(cache.texture, "Unable to create the map tile cache texture");
+        Profiler::get().count("sdl_textures_created");
+        SDL_SetTextureBlendMode(cache.texture.get(), SDL_BLENDMODE_BLEND);
+        cache.content = content;
+        cache.sprite_sheet = &sprite_sheet;
+        cache.tile_width = tile_width;
+        cache.tile_height = tile_height;
+        cache.tiles = tiles;
+        cache.drawn = false;
+    }
 
-                int cell_id = (*map)(rows, cols);
+    // Only move the region when the viewport leaves it, and then as little as it takes to contain it again
+    Point origin = cache.drawn ? cache.origin : Point{view_x - TileCache::margin, view_y - TileCache::margin};
+    origin.x = std::clamp(std::clamp(origin.x, view_x + view_cols - tiles.width, view_x), 0, width - tiles.width);
+    origin.y = std::clamp(std::clamp(origin.y, view_y + view_rows - tiles.height, view_y), 0, height - tiles.height);
 
-                if (draw_hook != nullptr) {
-                    // rows, cols = map Y, X
-                    // dx, dy = world X, Y
-                    auto light_cell = (*light_map)(rows, cols);
-                    // println("light cell: {}", light_cell);
-                    draw_hook(rows, cols, dx, dy, cell_id, light_cell, scale_factor);
-                }
-            }
+    const auto was_cached = [&](int x, int y) {
+        return cache.drawn && x >= cache.origin.x && x < cache.origin.x + tiles.width && y >= cache.origin.y &&
+               y < cache.origin.y + tiles.height;
+    };
+    const auto slot_x = [&](int x) { return x % tiles.width; }; // cells are never negative here
+    const auto slot_y = [&](int y) { return y % tiles.height; };
+
+    SDL_SetRenderTarget(renderer, cache.texture.get());
+    int64_t redrawn = 0;
+    for (int y = origin.y; y < origin.y + tiles.height; ++y) {
+        uint8_t * const dirty_row = dirty.row(y).data();
+        for (int x = origin.x; x < origin.x + tiles.width; ++x) {
+            if (!dirty_row[x] && was_cached(x, y)) continue;
+            dirty_row[x] = 0;
+
+            const SDL_Rect slot{.x = slot_x(x) * tile_width, .y = slot_y(y) * tile_height, .w = tile_width,
+                                .h = tile_height};
+            // Overwrite rather than blend, so the slot ends up transparent
+            SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+            SDL_RenderFillRect(renderer, &slot);
+            SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+            draw_tile(x, y, slot.x, slot.y);
+            ++redrawn;
         }
     }
-
+    if (flush) flush();
     SDL_SetRenderTarget(renderer, NULL);
-    const SDL_Rect destination{.x = 0, .y = 0, .w = texture_width, .h = texture_height};
-    SDL_RenderCopy(renderer, current_map_segment_texture.get(), NULL, &destination);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    cache.origin = origin;
+    cache.drawn = true;
+    Profiler::get().count("map_tiles_redrawn", redrawn);
+
+    // The viewport wraps around the cache's edges at most once each way, so it comes out in up to four pieces
+    const auto split = [](int slot, int count, int period) {
+        const int first = std::min(count, period - slot);
+        return std::array<std::pair<int, int>, 2>{{{slot, first}, {0, count - first}}}; // (slot, count) pairs
+    };
+    const int screen_x = (view_x - dimensions.point.x) * tile_width;
+    const int screen_y = (view_y - dimensions.point.y) * tile_height;
+    int dest_y = screen_y;
+    for (const auto & [row, rows] : split(slot_y(view_y), view_rows, tiles.height)) {
+        if (rows == 0) continue;
+        int dest_x = screen_x;
+        for (const auto & [col, cols] : split(slot_x(view_x), view_cols, tiles.width)) {
+            if (cols == 0) continue;
+            const SDL_Rect source{.x = col * tile_width, .y = row * tile_height, .w = cols * tile_width,
+                                  .h = rows * tile_height};
+            const SDL_Rect destination{.x = dest_x, .y = dest_y, .w = source.w, .h = source.h};
+            SDL_RenderCopy(renderer, cache.texture.get(), &source, &destination);
+            dest_x += source.w;
+        }
+        dest_y += rows * tile_height;
+    }
 }
 
 void Map::draw_map(SDL_Renderer * renderer, const Dimension & dimensions, int dest_x, int dest_y, int a,
-                   const std::function<void(int, int, int)> & draw_hook) {
+                   const std::function<void(int, int, int)> & draw_hook, const std::function<void()> & flush) {
+    const Profiler::Scope scope("Map::draw_map (full)");
     if (current_full_map_dimension != dimensions) {
         current_full_map_dimension = dimensions;
 
         current_full_map_texture.reset(SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, width, height));
         check_sdl_ptr_or_throw(current_full_map_texture, "Unable to create current_full_map_texture");
+        Profiler::get().count("sdl_textures_created");
         SDL_SetTextureBlendMode(current_full_map_texture.get(), SDL_BLENDMODE_BLEND);
         SDL_SetRenderTarget(renderer, current_full_map_texture.get());
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
         SDL_SetTextureAlphaMod(current_full_map_texture.get(), a);
         SDL_RenderClear(renderer);
 
-        for (int rows = 0; rows < height; ++rows) {
-            for (int cols = 0; cols < width; ++cols) {
-                const int cell_id = (*map)(rows, cols);
-
-                if (draw_hook) draw_hook(rows, cols, cell_id);
+        if (draw_hook) {
+            for (int rows = 0; rows < height; ++rows) {
+                const int * const map_row = map->row(rows).data();
+                for (int cols = 0; cols < width; ++cols) draw_hook(rows, cols, map_row[cols]);
             }
         }
+        if (flush) flush();
     }
 
     SDL_SetRenderTarget(renderer, NULL);
@@ -659,46 +1766,141 @@ void Map::draw_map(SDL_Renderer * renderer, const Dimension & dimensions, int de
     SDL_RenderCopy(renderer, current_full_map_texture.get(), NULL, &destination);
 }
 
+void Map::draw_map_tiles(SDL_Renderer * renderer, const Dimension & dimensions, SpriteSheet & sprite_sheet) {
+    const int scale_factor = sprite_sheet.get_scale_factor();
+    const auto & sprite_for_cell = tile_rules.sprite_for_cell;
+    const auto & tint_for_light = tile_rules.tint_for_light;
+    const Point & focus = dimensions.supplemental_point;
+
+    // The focus is drawn lit whatever its light value, so the cell it left and the one it is on have changed
+    if (focus != tile_cache.focus) {
+        mark_dirty(tile_cache.focus);
+        mark_dirty(focus);
+        tile_cache.focus = focus;
+    }
+
+    draw_cached(
+        renderer, dimensions, TileCache::Content::Tiles, sprite_sheet,
+        [&](int x, int y, int dx, int dy) {
+            const int cell_id = (*map)(y, x);
+            if (cell_id < 0 || size_t(cell_id) >= sprite_for_cell.size() || sprite_for_cell[cell_id] < 0) return;
+
+            std::optional<SDL_Color> tint;
+            if (x == focus.x && y == focus.y) tint = SDL_Color{255, 255, 255, 255};
+            else if (const int light = (*light_map)(y, x); light >= 0 && size_t(light) < tint_for_light.size())
+                tint = tint_for_light[light];
+            if (!tint) return;
+
+            sprite_sheet.batch_sprite(sprite_for_cell[cell_id], dx, dy, scale_factor, *tint);
+        },
+        [&] { sprite_sheet.flush_batch(renderer); });
+}
+
 void Map::calculate_field_of_view(const Dimension & dimensions) {
-    light_map = std::make_shared<Matrix>(height, width, 0);
+    Matrix & lm = *light_map;
+
+    // Whatever was visible last time is now merely explored. Only the previous field of view can hold visible cells,
+    // so that is all we need to touch. They are parked on LIGHT_WAS_VISIBLE while casting: cells that come out visible
+    // again haven't changed and needn't be redrawn, and whatever is still parked afterwards is demoted.
+    const auto previous_region = fov_region;
+    if (previous_region) {
+        const auto & [top_left, bottom_right] = *previous_region;
+        for (int y = top_left.y; y <= bottom_right.y; ++y) {
+            int * const light_row = lm.row(y).data();
+            for (int x = top_left.x; x <= bottom_right.x; ++x)
+                if (light_row[x] == LIGHT_VISIBLE) light_row[x] = LIGHT_WAS_VISIBLE;
+        }
+        fov_region.reset();
+    }
+    const auto demote_leftovers = [&] {
+        if (!previous_region) return;
+        const auto & [top_left, bottom_right] = *previous_region;
+        for (int y = top_left.y; y <= bottom_right.y; ++y) {
+            int * const light_row = lm.row(y).data();
+            uint8_t * const dirty_row = dirty.row(y).data();
+            for (int x = top_left.x; x <= bottom_right.x; ++x)
+                if (light_row[x] == LIGHT_WAS_VISIBLE) {
+                    light_row[x] = LIGHT_EXPLORED;
+                    dirty_row[x] = 1;
+                }
+        }
+    };
 
-    // Iterate through all angles in the 360-degree field of view
-    for (int angle = 0; angle < 360; angle += 1) {
-        float radians = angle * 0.01745329f; // Conversion factor from degrees to radians
-        float dx = std::cos(radians);
-        float dy = std::sin(radians);
+    const int cx = dimensions.supplemental_point.x;
+    const int cy = dimensions.supplemental_point.y;
+    if (cx < 0 || cy < 0 || cx >= width || cy >= height) {
+        demote_leftovers();
+        return;
+    }
 
-        float newX = dimensions.supplemental_point.x + dx;
-        float newY = dimensions.supplemental_point.y + dy;
+    light_up(cx, cy);
 
-        // Keep expanding in the current direction until reaching a wall or map boundary
-        while (newX >= 0 && newX < width && newY >= 0 && newY < height) {
-            // Mark the cell as visible
-            (*light_map)((int)newY, (int)newX) = 1;
+    // Octant transforms: map (col, row) in octant space to (dx, dy) offsets on the map
+    static constexpr int mult[4][8] = {{1, 0, 0, -1, -1, 0, 0, 1},
+                                       {0, 1, -1, 0, 0, -1, 1, 0},
+                                       {0, 1, 1, 0, 0, -1, -1, 0},
+                                       {1, 0, 0, 1, -1, 0, 0, -1}};
+    for (int octant = 0; octant < 8; ++octant)
+        cast_light(cx, cy, 1, 1.0f, 0.0f, mult[0][octant], mult[1][octant], mult[2][octant], mult[3][octant]);
+    demote_leftovers();
 
-            // Stop expanding if a wall is encountered
-            if ((*map)((int)newY, (int)newX) == 0) break;
+    fov_region = {Point{std::max(cx - fov_radius, 0), std::max(cy - fov_radius, 0)},
+                  Point{std::min(cx + fov_radius, width - 1), std::min(cy + fov_radius, height - 1)}};
+}
 
-            // Move to the next cell in the current direction
-            newX += dx;
-            newY += dy;
+void Map::cast_light(const int cx, const int cy, const int row, float start_slope, const float end_slope, const int xx,
+                     const int xy, const int yx, const int yy) {
+    if (start_slope < end_slope) return;
+
+    const Matrix & m = *map;
+    const int radius_squared = fov_radius * fov_radius;
+    const auto is_opaque = [&](int x, int y) { return x < 0 || y < 0 || x >= width || y >= height || m(y, x) == 0; };
+
+    float next_start_slope = start_slope;
+    for (int j = row; j <= fov_radius; ++j) {
+        bool blocked = false;
+        const int dy = -j;
+        for (int dx = -j; dx <= 0; ++dx) {
+            const float left_slope = (dx - 0.5f) / (dy + 0.5f);
+            const float right_slope = (dx + 0.5f) / (dy - 0.5f);
+            if (start_slope < right_slope) continue;
+            if (end_slope > left_slope) break;
+
+            const int x = cx + dx * xx + dy * xy;
+            const int y = cy + dx * yx + dy * yy;
+            if (dx * dx + dy * dy <= radius_squared && x >= 0 && y >= 0 && x < width && y < height) light_up(x, y);
+
+            if (blocked) {
+                if (is_opaque(x, y)) {
+                    next_start_slope = right_slope;
+                } else {
+                    blocked = false;
+                    start_slope = next_start_slope;
+                }
+            } else if (is_opaque(x, y) && j < fov_radius) {
+                // Hit a wall: scan the part of the next row that is still visible, then continue past the wall
+                blocked = true;
+                cast_light(cx, cy, j + 1, start_slope, left_slope, xx, xy, yx, yy);
+                next_start_slope = right_slope;
+            }
         }
+        if (blocked) break;
     }
 }
 
-Point Map::get_random_point(const std::set<int> & off_limit_sprites_ids) const {
+Point Map::get_random_point(const std::set<int> & off_limit_sprites_ids, RandomStream & rng) const {
     if (width <= 0 || height <= 0) { throw std::runtime_error("Empty map"); }
 
     if (off_limit_sprites_ids.empty()) {
-        return Point{.x = generate_random_int(0, width - 1), .y = generate_random_int(0, height - 1)};
+        return Point{.x = int(rng.uniform_int(0, width - 1)), .y = int(rng.uniform_int(0, height - 1))};
     }
 
     size_t maxAttempts = static_cast<size_t>(height) * static_cast<size_t>(width);
     size_t attempts = 0u;
 
     while (attempts++ < maxAttempts) {
-        int row = generate_random_int(0, height - 1);
-        int col = generate_random_int(0, width - 1);
+        int row = int(rng.uniform_int(0, height - 1));
+        int col = int(rng.uniform_int(0, width - 1));
 
         if ( ! off_limit_sprites_ids.contains((*map)(row, col))) {
             // println("Found random point: ({},{}) = {}", row, col, (*map)(row, col));
@@ -709,6 +1911,193 @@ Point Map::get_random_point(const std::set<int> & off_limit_sprites_ids) const {
     throw std::runtime_error("Unable to find a random point in map");
 }
 
+#pragma mark ChunkedMap
+
+void ChunkedMap::update_residency(const Point & center, int radius, ThreadPool & pool) {
+    radius = std::max(radius, 0);
+    const int center_x = chunk_coord(center.x);
+    const int center_y = chunk_coord(center.y);
+
+    for (auto it = resident.begin(); it != resident.end();) {
+        const int chunk_x = int(int32_t(it->first >> 32));
+        const int chunk_y = int(int32_t(uint32_t(it->first)));
+        if (std::abs(chunk_x - center_x) <= radius + 1 && std::abs(chunk_y - center_y) <= radius + 1) {
+            ++it;
+            continue;
+        }
+        if (it->second->modified) {
+            // run length encode as (value, count) pairs; walls and floors come in long runs
+            auto & blob = stored[it->first];
+            blob.clear();
+            const Cells & cells = it->second->cells;
+            for (size_t i = 0; i < cells.size();) {
+                size_t run = 1;
+                while (i + run < cells.size() && run < 255 && cells[i + run] == cells[i]) ++run;
+                blob.push_back(cells[i]);
+                blob.push_back(uint8_t(run));
+                i += run;
+            }
+        }
+        it = resident.erase(it);
+    }
+
+    std::vector<std::pair<uint64_t, Chunk *>> missing;
+    for (int chunk_y = center_y - radius; chunk_y <= center_y + radius; ++chunk_y) {
+        for (int chunk_x = center_x - radius; chunk_x <= center_x + radius; ++chunk_x) {
+            const uint64_t k = key(chunk_x, chunk_y);
+            if (resident.contains(k)) continue;
+            auto & chunk = resident[k];
+            chunk = std::make_unique<Chunk>();
+            if (auto blob = stored.find(k); blob != stored.end()) {
+                size_t i = 0;
+                for (size_t b = 0; b + 1 < blob->second.size(); b += 2)
+                    for (int n = 0; n < blob->second[b + 1] && i < chunk->cells.size(); ++n)
+                        chunk->cells[i++] = blob->second[b];
+                chunk->modified = true;
+                stored.erase(blob);
+            } else {
+                missing.emplace_back(k, chunk.get());
+            }
+        }
+    }
+
+    pool.parallel_for(0, missing.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const auto [k, chunk] = missing[i];
+            generate(int(int32_t(k >> 32)), int(int32_t(uint32_t(k))), chunk->cells);
+        }
+    });
+    for (const auto & [k, chunk] : missing) summaries[k] = summarize(chunk->cells);
+}
+
+void ChunkedMap::generate(int chunk_x, int chunk_y, Cells & cells) const {
+    // After n passes a cell depends on everything up to n cells away, so an n cell margin makes the chunk exact
+    const int margin = std::max(params.passes, 0);
+    const int size = CHUNK_SIZE + 2 * margin;
+    const int64_t origin_x = int64_t(chunk_x) * CHUNK_SIZE - margin;
+    const int64_t origin_y = int64_t(chunk_y) * CHUNK_SIZE - margin;
+
+    // 1 = wall while generating, as in perform_cellular_automaton
+    std::vector<uint8_t> cur(size_t(size) * size), next(size_t(size) * size);
+    for (int r = 0; r < size; ++r) {
+        for (int c = 0; c < size; ++c) {
+            // hashed from world coordinates so a cell starts out the same whichever chunk generates it
+            uint64_t state = seed ^ (uint64_t(origin_x + c) * 0x9E3779B97F4A7C15ull) ^
+                             (uint64_t(origin_y + r) * 0xD1B54A32D192ED03ull);
+            cur[size_t(r) * size + c] = uint8_t(double(detail::splitmix64(state) >> 11) * 0x1.0p-53 < params.wall_fill);
+        }
+    }
+
+    std::vector<uint8_t> column_sums(size);
+    for (int p = 0; p < margin; ++p) {
+        // the band of cells still exact after this pass shrinks by one on every side
+        const int lo = p + 1, hi = size - p - 1;
+        for (int r = lo; r < hi; ++r) {
+            const uint8_t * const up = cur.data() + size_t(r - 1) * size;
+            const uint8_t * const mid = cur.data() + size_t(r) * size;
+            const uint8_t * const down = cur.data() + size_t(r + 1) * size;
+            for (int c = lo - 1; c <= hi; ++c) column_sums[c] = uint8_t(up[c] + mid[c] + down[c]);
+
+            uint8_t * const out_row = next.data() + size_t(r) * size;
+            for (int c = lo; c < hi; ++c)
+                out_row[c] = uint8_t(column_sums[c - 1] + column_sums[c] + column_sums[c + 1] > 4);
+        }
+        cur.swap(next);
+    }
+
+    // 0 = wall, 1 = floor
+    for (int r = 0; r < CHUNK_SIZE; ++r)
+        for (int c = 0; c < CHUNK_SIZE; ++c)
+            cells[size_t(r) * CHUNK_SIZE + c] = cur[size_t(r + margin) * size + c + margin] ? 0 : 1;
+}
+
+/* static */
+uint8_t ChunkedMap::summarize(const Cells & cells) {
+    size_t floors = 0;
+    for (const uint8_t cell : cells) floors += cell != 0;
+    return uint8_t(floors * 255 / cells.size());
+}
+
+const ChunkedMap::Chunk * ChunkedMap::find_chunk(const Point & p) const {
+    auto it = resident.find(key(chunk_coord(p.x), chunk_coord(p.y)));
+    return it != resident.end() ? it->second.get() : nullptr;
+}
+
+uint8_t ChunkedMap::get_cell(const Point & p) const {
+    const Chunk * chunk = find_chunk(p);
+    if (chunk == nullptr) return 0;
+    const int local_x = p.x - chunk_coord(p.x) * CHUNK_SIZE;
+    const int local_y = p.y - chunk_coord(p.y) * CHUNK_SIZE;
+    return chunk->cells[size_t(local_y) * CHUNK_SIZE + local_x];
+}
+
+bool ChunkedMap::set_cell(const Point & p, uint8_t value) {
+    auto it = resident.find(key(chunk_coord(p.x), chunk_coord(p.y)));
+    if (it == resident.end()) return false;
+    Chunk & chunk = *it->second;
+    const int local_x = p.x - chunk_coord(p.x) * CHUNK_SIZE;
+    const int local_y = p.y - chunk_coord(p.y) * CHUNK_SIZE;
+    chunk.cells[size_t(local_y) * CHUNK_SIZE + local_x] = value;
+    chunk.modified = true;
+    summaries[it->first] = summarize(chunk.cells);
+    return true;
+}
+
+std::optional<uint8_t> ChunkedMap::get_summary(int chunk_x, int chunk_y) const {
+    if (auto it = summaries.find(key(chunk_x, chunk_y)); it != summaries.end()) return it->second;
+    return std::nullopt;
+}
+
+void ChunkedMap::draw_tiles(SDL_Renderer * renderer, const Point & top_left, const Size & size,
+                            SpriteSheet & sprite_sheet) {
+    const int scale_factor = sprite_sheet.get_scale_factor();
+    const int tile_width = sprite_sheet.get_sprite_width() * scale_factor;
+    const int tile_height = sprite_sheet.get_sprite_height() * scale_factor;
+    const auto & sprite_for_cell = tile_rules.sprite_for_cell;
+    const auto & tint_for_light = tile_rules.tint_for_light;
+    // streamed worlds have no light map, everything drawn is lit as visible
+    const SDL_Color tint = size_t(Map::LIGHT_VISIBLE) < tint_for_light.size() && tint_for_light[Map::LIGHT_VISIBLE]
+                               ? *tint_for_light[Map::LIGHT_VISIBLE]
+                               : SDL_Color{255, 255, 255, 255};
+
+    for (int row = 0; row < size.height; ++row) {
+        const int y = top_left.y + row;
+        const int local_y = y - chunk_coord(y) * CHUNK_SIZE;
+        const Chunk * chunk = nullptr;
+        for (int col = 0; col < size.width; ++col) {
+            const int x = top_left.x + col;
+            // one chunk lookup per CHUNK_SIZE cells of the row rather than per cell
+            const int local_x = x - chunk_coord(x) * CHUNK_SIZE;
+            if (col == 0 || local_x == 0) chunk = find_chunk(Point{x, y});
+            if (chunk == nullptr) continue;
+
+            const int cell_id = chunk->cells[size_t(local_y) * CHUNK_SIZE + local_x];
+            if (size_t(cell_id) >= sprite_for_cell.size() || sprite_for_cell[cell_id] < 0) continue;
+            sprite_sheet.batch_sprite(sprite_for_cell[cell_id], col * tile_width, row * tile_height, scale_factor,
+                                      tint);
+        }
+    }
+
+    sprite_sheet.flush_batch(renderer);
+}
+
+void ChunkedMap::draw_minimap(SDL_Renderer * renderer, int dest_x, int dest_y, const Point & center, int radius,
+                              int pixel_size) {
+    const int center_x = chunk_coord(center.x);
+    const int center_y = chunk_coord(center.y);
+    for (int dy = -radius; dy <= radius; ++dy) {
+        for (int dx = -radius; dx <= radius; ++dx) {
+            const auto summary = get_summary(center_x + dx, center_y + dy);
+            if (!summary) continue;
+            const Uint8 shade = (dx == 0 && dy == 0) ? 255 : Uint8(40 + *summary * 160 / 255);
+            SDL_SetRenderDrawColor(renderer, shade, shade, shade, 255);
+            const SDL_Rect rect{.x = dest_x + (dx + radius) * pixel_size, .y = dest_y + (dy + radius) * pixel_size,
+                                .w = pixel_size, .h = pixel_size};
+            SDL_RenderFillRect(renderer, &rect);
+        }
+    }
+}
+
 #pragma mark AStar
 
 namespace AStar {
@@ -721,94 +2110,666 @@ namespace AStar {
         inline static constexpr int dx[4] = {-1, 1,  0, 0};
         inline static constexpr int dy[4] = { 0, 0, -1, 1};
 
-        // Define a typedef for the priority queue entry
-        using pq_entry = std::pair<int, std::pair<int, int>>;
+        inline int sign(int v) { return (v > 0) - (v < 0); }
     } // namespace
 
-std::vector<std::pair<int, int>> FindPath(const Matrix & grid, int start_row, int start_col, int goal_row, int goal_col) {
-    std::vector<std::pair<int, int>> path;
+void PathfinderContext::begin_search(size_t cell_count) {
+    if (stamp.size() < cell_count) {
+        stamp.resize(cell_count, 0);
+        cost.resize(cell_count);
+        parent.resize(cell_count);
+    }
+    // Bumping the generation invalidates every cell at once; only on wrap-around do the stamps need clearing.
+    if (++generation == 0) {
+        std::fill(stamp.begin(), stamp.end(), 0);
+        generation = 1;
+    }
+    open.clear();
+    path.clear();
+}
+
+bool PathfinderContext::passable(int x, int y) const {
+    return x >= 0 && y >= 0 && x < width && y < height && (*grid)(y, x) == passable_cell;
+}
+
+void PathfinderContext::relax(int index, int from, int g) {
+    if (g >= cost_at(index)) return;
+    stamp[index] = generation;
+    cost[index] = g;
+    parent[index] = from;
+    const int h = heuristic(index % width, index / width, goal.x, goal.y);
+    open.push_back({.f = g + h, .h = h, .g = g, .index = index});
+    std::push_heap(open.begin(), open.end(), std::greater<>{});
+}
+
+// Vertical jumps have no natural side branches; they stop at the goal or where a horizontal neighbour is forced,
+// i.e. open beside the new cell but blocked beside the cell we came from. Returns true if such a point exists.
+bool PathfinderContext::jump_vertical(int x, int y, int dy) const {
+    for (;;) {
+        y += dy;
+        if (!passable(x, y)) return false;
+        if (x == goal.x && y == goal.y) return true;
+        for (const int side : {-1, 1})
+            if (passable(x + side, y) && !passable(x + side, y - dy)) return true;
+    }
+}
+
+// Walks from (x, y) in direction (dx, dy) until reaching a jump point, returning its index, or -1 if the walk runs
+// into a wall first. Horizontal walks stop wherever a vertical walk from the current cell would find a jump point.
+int PathfinderContext::jump(int x, int y, int dx, int dy) const {
+    for (;;) {
+        x += dx;
+        y += dy;
+        if (!passable(x, y)) return -1;
+        if (x == goal.x && y == goal.y) return y * width + x;
+        if (dx != 0) {
+            if (jump_vertical(x, y, 1) || jump_vertical(x, y, -1)) return y * width + x;
+        } else {
+            for (const int side : {-1, 1})
+                if (passable(x + side, y) && !passable(x + side, y - dy)) return y * width + x;
+        }
+    }
+}
+
+void PathfinderContext::reconstruct(int goal_index) {
+    // Parents may be jump points several cells away, so fill in the straight runs between them.
+    int index = goal_index;
+    Point p{.x = index % width, .y = index / width};
+    path.push_back(p);
+    while (parent[index] != -1) {
+        index = parent[index];
+        const Point q{.x = index % width, .y = index / width};
+        const int sx = sign(q.x - p.x), sy = sign(q.y - p.y);
+        while (p.x != q.x || p.y != q.y) {
+            p.x += sx;
+            p.y += sy;
+            path.push_back(p);
+        }
+    }
+    std::reverse(path.begin(), path.end());
+}
+
+const std::vector<Point> & PathfinderContext::find_path(const Matrix & grid, Point start, Point goal, int passable_cell,
+                                                        Mode mode) {
+    this->grid = &grid;
+    this->width = static_cast<int>(grid.size2());
+    this->height = static_cast<int>(grid.size1());
+    this->passable_cell = passable_cell;
+    this->goal = goal;
+    begin_search(static_cast<size_t>(width) * static_cast<size_t>(height));
+
+    if (!passable(start.x, start.y) || !passable(goal.x, goal.y)) return path;
+
+    const int start_index = start.y * width + start.x;
+    relax(start_index, -1, 0);
+
+    while (!open.empty()) {
+        std::pop_heap(open.begin(), open.end(), std::greater<>{});
+        const OpenEntry current = open.back();
+        open.pop_back();
+        // stale entry, a cheaper route to this cell was pushed after it
+        if (current.g > cost[current.index]) continue;
+
+        const int x = current.index % width;
+        const int y = current.index / width;
+        if (x == goal.x && y == goal.y) {
+            reconstruct(current.index);
+            return path;
+        }
+
+        if (mode == Mode::AStar) {
+            for (int i = 0; i < 4; ++i) {
+                const int nx = x + dx[i];
+                const int ny = y + dy[i];
+                if (passable(nx, ny)) relax(ny * width + nx, current.index, current.g + 1);
+            }
+            continue;
+        }
+
+        // Jump point successors: all four directions from the start, otherwise pruned by the direction of travel.
+        const auto try_jump = [&](int jx, int jy) {
+            const int j = jump(x, y, jx, jy);
+            if (j == -1) return;
+            relax(j, current.index, current.g + heuristic(x, y, j % width, j / width));
+        };
+        const int p = parent[current.index];
+        if (p == -1) {
+            for (int i = 0; i < 4; ++i) try_jump(dx[i], dy[i]);
+        } else {
+            const int mx = sign(x - p % width);
+            const int my = sign(y - p / width);
+            if (mx != 0) {
+                try_jump(mx, 0);
+                try_jump(0, 1);
+                try_jump(0, -1);
+            } else {
+                try_jump(0, my);
+                for (const int side : {-1, 1})
+                    if (passable(x + side, y) && !passable(x + side, y - my)) try_jump(side, 0);
+            }
+        }
+    }
+    // no path
+    return path;
+}
+
+std::vector<std::pair<int, int>> FindPath(const Matrix & grid, int start_row, int start_col, int goal_row,
+                                          int goal_col) {
+    thread_local PathfinderContext context;
+    std::vector<std::pair<int, int>> path;
+    for (const auto & p : context.find_path(grid, Point{.x = start_col, .y = start_row},
+                                            Point{.x = goal_col, .y = goal_row}, 0))
+        path.emplace_back(p.y, p.x);
+    return path;
+}
+} // namespace AStar
+
+#pragma mark DistanceField
+
+void DistanceField::compute(const Matrix & grid, uint64_t grid_revision, Point origin, int passable_cell) {
+    source = &grid;
+    revision = grid_revision;
+    this->origin = origin;
+    width = static_cast<int>(grid.size2());
+    height = static_cast<int>(grid.size1());
+    distances.assign(static_cast<size_t>(width) * height, UNREACHABLE);
+    frontier.clear();
+
+    if (!grid.in_bounds(origin.y, origin.x)) return;
+    distances[static_cast<size_t>(origin.y) * width + origin.x] = 0;
+    frontier.push_back(origin.y * width + origin.x);
+
+    // frontier doubles as the BFS queue, head walks forward over it instead of popping
+    for (size_t head = 0; head < frontier.size(); ++head) {
+        const int index = frontier[head];
+        const int x = index % width;
+        const int y = index / width;
+        const int next = distances[index] + 1;
+        for (const Point n : {Point{x, y - 1}, Point{x, y + 1}, Point{x - 1, y}, Point{x + 1, y}}) {
+            if (n.x < 0 || n.y < 0 || n.x >= width || n.y >= height) continue;
+            const int n_index = n.y * width + n.x;
+            if (distances[n_index] != UNREACHABLE || grid(n.y, n.x) != passable_cell) continue;
+            distances[n_index] = next;
+            frontier.push_back(n_index);
+        }
+    }
+}
+
+#pragma mark RandomStream
+
+int64_t RandomStream::uniform_int(int64_t lo, int64_t hi) {
+    if (hi < lo) std::swap(lo, hi);
+    const uint64_t span = uint64_t(hi) - uint64_t(lo) + 1; // wraps to 0 for the full 64 bit range
+    if (span == 0) return int64_t((*this)());
+    // Reject the low 2^64 % span values so every residue is equally likely
+    const uint64_t threshold = (0 - span) % span;
+    uint64_t x;
+    do { x = (*this)(); } while (x < threshold);
+    return int64_t(uint64_t(lo) + x % span);
+}
+
+RandomStream & RandomStreams::get(const std::string & name) {
+    auto it = streams.find(name);
+    if (it == streams.end()) it = streams.try_emplace(name, stream_seed(master_seed, name)).first;
+    return it->second;
+}
+
+void RandomStreams::reseed(uint64_t new_master_seed) {
+    master_seed = new_master_seed;
+    for (auto & [name, stream] : streams) stream.reseed(stream_seed(master_seed, name));
+}
+
+/* static */
+uint64_t RandomStreams::stream_seed(uint64_t master_seed, const std::string & name) {
+    // FNV-1a rather than std::hash, which may differ between standard libraries and would break reproducibility
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (const unsigned char ch : name) hash = (hash ^ ch) * 0x100000001B3ull;
+    uint64_t state = master_seed ^ hash;
+    return detail::splitmix64(state);
+}
+
+#pragma mark Profiler
+
+/* static */
+Profiler & Profiler::get() {
+    static Profiler profiler;
+    return profiler;
+}
+
+void Profiler::set_enabled(bool on) {
+    std::lock_guard l(mutex);
+    enabled = on;
+    zones.clear();
+    counters.clear();
+    last_frame = {};
+    frame_start = clock::now();
+}
+
+void Profiler::count(std::string_view counter, int64_t n) {
+    if (!is_enabled()) return;
+    std::lock_guard l(mutex);
+    entry(counters, counter) += n;
+}
+
+void Profiler::begin_frame() {
+    if (!is_enabled()) return;
+    std::lock_guard l(mutex);
+    frame_start = clock::now();
+}
+
+void Profiler::end_frame() {
+    if (!is_enabled()) return;
+    std::lock_guard l(mutex);
+    const auto now = clock::now();
+
+    FrameStats stats;
+    stats.frame_ms = std::chrono::duration<double, std::milli>(now - frame_start).count();
+    stats.zones.reserve(zones.size());
+    for (const auto & [name, zone] : zones)
+        stats.zones.push_back({.name = name, .total_ms = zone.total_ms, .calls = zone.calls});
+    std::ranges::sort(stats.zones, std::greater{}, &ZoneStats::total_ms);
+    for (const auto & [name, value] : counters) stats.counters.emplace_back(name, value);
+    std::ranges::sort(stats.counters);
+
+    if (tracing) {
+        const auto ts = std::chrono::duration_cast<std::chrono::microseconds>(now - epoch).count();
+        for (const auto & [name, value] : counters)
+            if (trace.size() < max_trace_events)
+                trace.push_back({.name = name, .start_us = ts, .duration_us = value, .thread = 0, .phase = 'C'});
+    }
+
+    last_frame = std::move(stats);
+    zones.clear();
+    counters.clear();
+}
+
+Profiler::FrameStats Profiler::get_last_frame() const {
+    std::lock_guard l(mutex);
+    return last_frame;
+}
+
+void Profiler::start_trace() {
+    std::lock_guard l(mutex);
+    trace.clear();
+    tracing = true;
+}
+
+bool Profiler::is_tracing() const {
+    std::lock_guard l(mutex);
+    return tracing;
+}
+
+bool Profiler::write_trace(const std::string & path) {
+    std::vector<TraceEvent> events;
+    {
+        std::lock_guard l(mutex);
+        tracing = false;
+        events.swap(trace);
+    }
+
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) return false;
+
+    const auto escaped = [](std::string_view text) {
+        std::string result;
+        for (char c : text) {
+            if (c == '"' || c == '\\') result += '\\';
+            if (static_cast<unsigned char>(c) >= 0x20) result += c;
+        }
+        return result;
+    };
+
+    // Chrome's trace event format: complete events ('X') for scopes, counter events ('C') for the per frame counters
+    out << "{\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); ++i) {
+        const auto & e = events[i];
+        if (i > 0) out << ',';
+        if (e.phase == 'X')
+            out << std::format(R"({{"name":"{}","ph":"X","ts":{},"dur":{},"pid":1,"tid":{}}})", escaped(e.name),
+                               e.start_us, e.duration_us, e.thread);
+        else
+            out << std::format(R"({{"name":"{}","ph":"C","ts":{},"pid":1,"args":{{"value":{}}}}})", escaped(e.name),
+                               e.start_us, e.duration_us);
+    }
+    out << "]}\n";
+    return bool(out);
+}
+
+void Profiler::record(std::string_view name, clock::time_point start, clock::time_point end) {
+    std::lock_guard l(mutex);
+    if (!enabled) return; // switched off while the scope was open
+    auto & zone = entry(zones, name);
+    zone.total_ms += std::chrono::duration<double, std::milli>(end - start).count();
+    ++zone.calls;
+
+    if (tracing && trace.size() < max_trace_events) {
+        const auto start_us = std::chrono::duration_cast<std::chrono::microseconds>(start - epoch).count();
+        const auto end_us = std::chrono::duration_cast<std::chrono::microseconds>(end - epoch).count();
+        trace.push_back({.name = std::string(name), .start_us = start_us, .duration_us = end_us - start_us,
+                         .thread = thread_index(), .phase = 'X'});
+    }
+}
+
+uint32_t Profiler::thread_index() {
+    const auto id = std::this_thread::get_id();
+    auto it = std::ranges::find(threads, id);
+    if (it != threads.end()) return uint32_t(it - threads.begin());
+    threads.push_back(id);
+    return uint32_t(threads.size() - 1);
+}
+
+#pragma mark ThreadPool
+
+ThreadPool::ThreadPool(unsigned thread_count) {
+    for (unsigned i = 1; i < std::max(thread_count, 1u); ++i) workers.emplace_back([this] { worker_loop(); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::unique_lock l(mutex);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (auto & worker : workers) worker.join();
+}
+
+void ThreadPool::worker_loop() {
+    std::unique_lock l(mutex);
+    for (;;) {
+        work_available.wait(l, [this] { return stopping || !tasks.empty(); });
+        if (tasks.empty()) return; // stopping
+        auto task = std::move(tasks.front());
+        tasks.pop_front();
+        l.unlock();
+        task();
+        l.lock();
+    }
+}
+
+void ThreadPool::parallel_for(size_t begin, size_t end, const std::function<void(size_t, size_t)> & func,
+                              size_t min_chunk) {
+    if (end <= begin) return;
+    const size_t count = end - begin;
+    const size_t chunks = std::clamp<size_t>(count / std::max<size_t>(min_chunk, 1), 1, size());
+    if (chunks == 1) {
+        func(begin, end);
+        return;
+    }
+
+    std::atomic_size_t remaining{chunks - 1};
+    std::exception_ptr error;
+    const auto run_chunk = [&](size_t i) {
+        try {
+            func(begin + count * i / chunks, begin + count * (i + 1) / chunks);
+        } catch (...) {
+            std::unique_lock l(mutex);
+            if (!error) error = std::current_exception();
+        }
+    };
+
+    {
+        std::unique_lock l(mutex);
+        for (size_t i = 1; i < chunks; ++i) {
+            tasks.emplace_back([&, i] {
+                run_chunk(i);
+                if (remaining.fetch_sub(1) == 1) {
+                    std::unique_lock l(mutex);
+                    work_done.notify_all();
+                }
+            });
+        }
+    }
+    work_available.notify_all();
+
+    run_chunk(0);
+
+    // Help drain the queue rather than sleep, which also keeps nested parallel_for calls from deadlocking
+    std::unique_lock l(mutex);
+    while (remaining.load() != 0) {
+        if (!tasks.empty()) {
+            auto task = std::move(tasks.front());
+            tasks.pop_front();
+            l.unlock();
+            task();
+            l.lock();
+        } else {
+            work_done.wait(l, [&] { return remaining.load() == 0 || !tasks.empty(); });
+        }
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+#pragma mark AssetLoader
+
+AssetLoader::Loaded AssetLoader::load(Request request) {
+    Loaded loaded;
+    loaded.request = std::move(request);
+    const auto & path = loaded.request.path;
+    if (!std::filesystem::exists(path)) {
+        loaded.error = std::format("asset file does not exist: {}", path);
+        loaded.missing = true;
+        return loaded;
+    }
+
+    switch (loaded.request.kind) {
+        case Kind::SpriteSheet:
+        case Kind::Graphic:
+            loaded.surface.reset(IMG_Load(path.c_str()));
+            if (!loaded.surface) loaded.error = std::format("Unable to load image {}: {}", path, IMG_GetError());
+            break;
+        case Kind::Font: {
+            std::ifstream file(path, std::ios::binary);
+            loaded.bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            if (!file.good() && !file.eof()) loaded.error = std::format("Unable to read font {}", path);
+            break;
+        }
+        case Kind::Sound:
+            loaded.chunk.reset(Mix_LoadWAV(path.c_str()));
+            if (!loaded.chunk)
+                loaded.error = std::format("Unable to load sound \"{}\": {}", loaded.request.name, Mix_GetError());
+            break;
+        case Kind::Music:
+            loaded.music.reset(Mix_LoadMUS(path.c_str()));
+            if (!loaded.music) loaded.error = std::format("Unable to load music {}: {}", path, Mix_GetError());
+            break;
+    }
+    return loaded;
+}
+
+AssetLoader::AssetLoader(unsigned thread_count) {
+    for (unsigned i = 0; i < std::max(thread_count, 1u); ++i) workers.emplace_back([this] { worker_loop(); });
+}
+
+AssetLoader::~AssetLoader() {
+    {
+        std::unique_lock l(mutex);
+        stopping = true;
+        requests.clear();
+    }
+    work_available.notify_all();
+    for (auto & worker : workers) worker.join();
+}
+
+void AssetLoader::enqueue(Request request) {
+    {
+        std::unique_lock l(mutex);
+        requests.push_back(std::move(request));
+    }
+    work_available.notify_one();
+}
+
+std::vector<AssetLoader::Loaded> AssetLoader::take_loaded() {
+    std::unique_lock l(mutex);
+    return std::exchange(loaded, {});
+}
+
+void AssetLoader::worker_loop() {
+    std::unique_lock l(mutex);
+    for (;;) {
+        work_available.wait(l, [this] { return stopping || !requests.empty(); });
+        if (stopping) return;
+        auto request = std::move(requests.front());
+        requests.pop_front();
+        l.unlock();
+        auto result = load(std::move(request));
+        l.lock();
+        loaded.push_back(std::move(result));
+    }
+}
+
+#pragma mark MappedFile
+
+#ifdef _WIN32
+MappedFile::MappedFile(const std::string & path) {
+    file_handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_handle == INVALID_HANDLE_VALUE) {
+        file_handle = nullptr;
+        throw std::runtime_error(std::format("Unable to open '{}'", path));
+    }
+    LARGE_INTEGER file_size{};
+    GetFileSizeEx(file_handle, &file_size);
+    size = static_cast<size_t>(file_size.QuadPart);
+    if (size == 0) return;
+
+    mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_handle != nullptr)
+        data = static_cast<const uint8_t *>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+    if (data == nullptr) {
+        if (mapping_handle != nullptr) CloseHandle(mapping_handle);
+        CloseHandle(file_handle);
+        throw std::runtime_error(std::format("Unable to map '{}'", path));
+    }
+}
 
-    // Check if the starting position is a zero
-    if (grid(start_col, start_row) != 0) return path;
-
-    // Store grid size
-    const int grid_rows = static_cast<int>(grid.size1());
-    const int grid_cols = static_cast<int>(grid.size2());
-
-    // Create a priority queue to store the open list
-    std::priority_queue<pq_entry, std::vector<pq_entry>, std::greater<pq_entry>> open_list;
-    // Create a matrix to store the cost of reaching each cell
-    Matrix cost(grid_rows, grid_cols, INT_MAX);
-    // Create a matrix to store the parent of each cell
-    GenericMatrix<std::pair<int, int>> parent(grid_rows, grid_cols, std::pair{0, 0});
-    // Initialize the cost of the start cell to 0
-    cost(start_row, start_col) = 0;
-    // Add the start cell to the open list with a priority of 0
-    open_list.emplace(0, std::make_pair(start_row, start_col));
-
-    while (!open_list.empty()) {
-        // Get the cell with the lowest cost from the open list
-        int x, y;
-        std::tie(x, y) = open_list.top().second;
-        open_list.pop();
-
-        // Check if we have reached the goal cell
-        if (x == goal_col && y == goal_row) {
-            // Reconstruct the path from the goal to the start
-            while (x != start_row || y != start_col) {
-                path.emplace_back(x, y);
-                std::tie(x, y) = parent(x, y);
-            }
-            path.emplace_back(start_row, start_col);
-            std::reverse(path.begin(), path.end());
-            return path;
+MappedFile::~MappedFile() {
+    if (data != nullptr) UnmapViewOfFile(data);
+    if (mapping_handle != nullptr) CloseHandle(mapping_handle);
+    if (file_handle != nullptr) CloseHandle(file_handle);
+}
+#else
+MappedFile::MappedFile(const std::string & path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error(std::format("Unable to open '{}'", path));
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error(std::format("Unable to stat '{}'", path));
+    }
+    size = static_cast<size_t>(st.st_size);
+    if (size > 0) {
+        void * mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error(std::format("Unable to map '{}'", path));
         }
+        data = static_cast<const uint8_t *>(mapped);
+    }
+    close(fd); // the mapping stays valid without the descriptor
+}
 
-        // Explore the neighbors of the current cell
-        for (int i = 0; i < 4; ++i) {
-            const int nx = x + dx[i];
-            const int ny = y + dy[i];
+MappedFile::~MappedFile() {
+    if (data != nullptr) munmap(const_cast<uint8_t *>(data), size);
+}
+#endif
 
-            // Check if the neighbor is within the grid bounds
-            if (nx >= 0 && nx < grid_rows && ny >= 0 && ny < grid_cols && grid(nx, ny) == 0) {
-                // Calculate the cost of reaching the neighbor
-                const int new_cost = cost(x, y) + 1;
+#pragma mark SystemScheduler
 
-                // Check if the new cost is lower than the current cost
-                if (new_cost < cost(nx, ny)) {
-                    // Update the cost and parent of the neighbor
-                    cost(nx, ny) = new_cost;
-                    parent(nx, ny) = std::make_pair(x, y);
+bool SystemScheduler::add(ScheduledSystem system) {
+    if (std::ranges::any_of(systems, [&](const ScheduledSystem & other) { return other.name == system.name; }))
+        return false;
+    systems.push_back(std::move(system));
+    if (!rebuild_order()) {
+        systems.pop_back();
+        rebuild_order();
+        return false;
+    }
+    return true;
+}
 
-                    // Calculate the priority of the neighbor (cost + heuristic)
-                    // Add the neighbor to the open list
-                    open_list.emplace(new_cost + heuristic(nx, ny, goal_col, goal_row), std::make_pair(nx, ny));
-                }
-            }
+std::vector<std::string> SystemScheduler::get_order() const {
+    std::vector<std::string> names;
+    names.reserve(order.size());
+    for (size_t i : order) names.push_back(systems[i].name);
+    return names;
+}
+
+/* static */
+bool SystemScheduler::conflicts(const ScheduledSystem & a, const ScheduledSystem & b) {
+    const auto contains = [](const std::vector<std::string> & names, const std::string & name) {
+        return std::ranges::find(names, name) != names.end();
+    };
+    if (contains(b.after, a.name) || contains(a.after, b.name)) return true;
+    for (const auto & written : a.writes)
+        if (contains(b.reads, written) || contains(b.writes, written)) return true;
+    for (const auto & written : b.writes)
+        if (contains(a.reads, written)) return true;
+    return false;
+}
+
+bool SystemScheduler::rebuild_order() {
+    // Kahn's algorithm, always taking the earliest added of the systems that are ready so the order only differs from
+    // the order of adding where `after` demands it. Names in `after` that aren't scheduled (yet) are ignored.
+    const size_t n = systems.size();
+    std::vector<std::vector<size_t>> successors(n);
+    std::vector<size_t> pending(n);
+    for (size_t j = 0; j < n; ++j) {
+        for (const auto & name : systems[j].after) {
+            auto it = std::ranges::find(systems, name, &ScheduledSystem::name);
+            if (it == systems.end()) continue;
+            successors[size_t(it - systems.begin())].push_back(j);
+            ++pending[j];
         }
     }
-    // no path
-    path.clear();
-    return path;
-}
-} // namespace AStar
 
-#pragma mark Engine
+    std::set<size_t> ready;
+    for (size_t i = 0; i < n; ++i)
+        if (pending[i] == 0) ready.insert(i);
+
+    std::vector<size_t> sorted;
+    sorted.reserve(n);
+    while (!ready.empty()) {
+        const size_t i = *ready.begin();
+        ready.erase(ready.begin());
+        sorted.push_back(i);
+        for (size_t j : successors[i])
+            if (--pending[j] == 0) ready.insert(j);
+    }
 
-/* static */ std::atomic_int Engine::instance_ctr{0};
+    if (sorted.size() != n) return false;
+    order = std::move(sorted);
+    return true;
+}
 
-Engine::Engine() {
-    if (++instance_ctr != 1) {
-        --instance_ctr; // Note: ~Engine d'tor will never run if we throw here, so we must decrement ctr now.
-        throw std::runtime_error("Invariant violated: More than one Engine intances exist!");
+void SystemScheduler::run_natives(const std::vector<ScheduledSystem *> & batch) {
+    const auto run = [](ScheduledSystem & system) {
+        const Profiler::Scope scope(system.name);
+        system.native();
+    };
+    if (batch.size() == 1 || (thread_pool == nullptr && !batch.empty())) {
+        for (auto * system : batch) run(*system);
+    } else if (batch.size() > 1) {
+        thread_pool->parallel_for(0, batch.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) run(*batch[i]);
+        });
     }
 }
 
-Engine::~Engine() { tear_down(); --instance_ctr; }
+#pragma mark SDLLibraries
+
+/* static */ std::mutex SDLLibraries::mutex;
+/* static */ int SDLLibraries::users{0};
+
+SDLLibraries::SDLLibraries() {
+    std::lock_guard l(mutex);
+    if (users++ > 0) return;
 
-void Engine::initialize(sol::table game_config, sol::this_state) {
     auto throw_if_fail = [](bool failed, std::string_view errMsg, const char *(errFunc)(void)) {
-        if (failed) throw std::runtime_error(std::format("{}: {}", errMsg, errFunc()));
+        if (failed) {
+            --users; // Note: ~SDLLibraries d'tor will never run if we throw here, so we must decrement now.
+            throw std::runtime_error(std::format("{}: {}", errMsg, errFunc()));
+        }
     };
     throw_if_fail(Mix_OpenAudio(44100, AUDIO_S16SYS, 2, 4096) != 0,
                   "Failed to initialize Mix_OpenAudio", &Mix_GetError);
@@ -823,8 +2784,33 @@ void Engine::initialize(sol::table game_config, sol::this_state) {
                   "Failed to initialize SDL_ttf", &TTF_GetError);
     throw_if_fail(Mix_Init(MIX_INIT_MP3) == 0,
                   "Failed to initialize SDL2 mixer", &Mix_GetError);
+}
+
+SDLLibraries::~SDLLibraries() {
+    std::lock_guard l(mutex);
+    if (--users > 0) return;
+
+    Mix_CloseAudio();
+    Mix_Quit();
+    TTF_Quit();
+    IMG_Quit();
+    SDL_Quit();
+}
+
+#pragma mark Engine
+
+Engine::Engine(unsigned worker_threads) : thread_pool(worker_threads) { scheduler.set_thread_pool(&thread_pool); }
+
+Engine::~Engine() { tear_down(); }
 
-    entity_manager = std::make_unique<EntityManager>(lua.lua_state());
+void Engine::initialize(sol::table game_config, bool headless, sol::this_state) {
+    if (!headless) sdl_libraries.emplace(); // may throw
+
+    entity_manager = std::make_unique<EntityManager>(lua.lua_state(), &entity_memory);
+
+    // A fixed seed makes a session (map, spawns and every other Lua draw) reproducible
+    if (sol::optional<lua_Integer> seed = game_config["random_seed"]; seed)
+        random_streams.reseed(static_cast<uint64_t>(*seed));
 
     std::string window_title = game_config["window_title"];
     std::string window_icon_path = game_config["window_icon_path"];
@@ -838,92 +2824,186 @@ void Engine::initialize(sol::table game_config, sol::this_state) {
     current_dimension = {.point = {0, 0}, .size = {VIEW_PORT_WIDTH, VIEW_PORT_HEIGHT}};
     game_config["viewport_width"] = VIEW_PORT_WIDTH;
     game_config["viewport_height"] = VIEW_PORT_HEIGHT;
+    game_config["headless"] = headless;
+    // By default the field of view reaches the corners of the viewport
+    fov_radius =
+        game_config.get_or("fov_radius", int(std::ceil(std::hypot(VIEW_PORT_WIDTH / 2.0, VIEW_PORT_HEIGHT / 2.0))));
     game_config["keycodes"] =
         lua.create_table_with(1073741906, "up", 1073741905, "down", 1073741904, "left", 1073741903, "right", 119, "w",
                               97, "a", 115, "s", 100, "d", 32, "space");
 
-    window.reset(SDL_CreateWindow(window_title.c_str(), SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, window_width,
-                                  window_height, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC));
-    check_sdl_ptr_or_throw(window, "Failed to create SDL window");
+    // Simulation runs at a fixed rate whatever the frame rate; rendering is paced by vsync and/or max_fps
+    scheduler.set_simulation_step(1.0 / std::max(game_config.get_or("simulation_hz", 6.0), 1.0));
+    max_fps = std::max(game_config.get_or("max_fps", 0), 0);
+    profiler_overlay = game_config.get_or("profiler", false) && !headless;
 
-    {
-        UPtr<SDL_Surface> window_icon_surface{IMG_Load(window_icon_path.c_str())};
-        check_sdl_ptr_or_throw(window_icon_surface, "Unable to load icon");
-        SDL_SetWindowIcon(window.get(), window_icon_surface.get());
-    }
+    if (!headless) {
+        window.reset(SDL_CreateWindow(window_title.c_str(), SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                                      window_width, window_height, SDL_WINDOW_SHOWN));
+        check_sdl_ptr_or_throw(window, "Failed to create SDL window");
+
+        {
+            UPtr<SDL_Surface> window_icon_surface{IMG_Load(window_icon_path.c_str())};
+            check_sdl_ptr_or_throw(window_icon_surface, "Unable to load icon");
+            SDL_SetWindowIcon(window.get(), window_icon_surface.get());
+        }
+
+        Uint32 renderer_flags = SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE;
+        if (game_config.get_or("vsync", true)) renderer_flags |= SDL_RENDERER_PRESENTVSYNC;
+
+        renderer.reset(SDL_CreateRenderer(window.get(), -1, renderer_flags));
+        // No GPU renderer (a VM, or SDL_VIDEODRIVER=dummy for benchmarks), fall back to the software one
+        if (!renderer)
+            renderer.reset(SDL_CreateRenderer(window.get(), -1, SDL_RENDERER_SOFTWARE | SDL_RENDERER_TARGETTEXTURE));
+        check_sdl_ptr_or_throw(renderer, "SDL could not create renderer");
 
-    renderer.reset(SDL_CreateRenderer(window.get(), -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE));
-    check_sdl_ptr_or_throw(renderer, "SDL could not create renderer");
+        SDL_SetRenderDrawBlendMode(renderer.get(), SDL_BLENDMODE_BLEND);
+    }
 
-    SDL_SetRenderDrawBlendMode(renderer.get(), SDL_BLENDMODE_BLEND);
+    // Keeps the shared chase field current before the render systems draw, so the Lua systems asking for steps next
+    // frame rarely have to flood it themselves
+    scheduler.add({.name = "player_distance_field",
+                   .native = [this] { get_player_distance_field(); },
+                   .rate = SystemRate::Frame,
+                   .reads = {"position_component", "map"},
+                   .writes = {"player_distance_field"}});
 
     // FIXME: Need to create a way for user defined Text objects
     // std::string font_path = game_config["font_path"];
     // text_medium = std::make_unique<Text>();
     // text_medium->load_font(font_path, 32);
 
-    // Load the spritesheet (FIXME: add ability to load more than one spritesheet)
+    // Everything below streams in on the asset loader's threads while the first frames run, and is drawn (or played)
+    // once it is there. Headless engines load synchronously instead, so that replays behave the same from frame 0.
+    assets_requested = assets_installed = 0;
+    atlas_images.clear();
+    if (!headless && game_config.get_or("async_asset_loading", true)) asset_loader = std::make_unique<AssetLoader>();
+
+    // The spritesheet (FIXME: add ability to load more than one spritesheet)
     sprite_sheets.clear();
-    sprite_sheets.try_emplace(game_config["spritesheet_name"],
-                              std::make_shared<SpriteSheet>(
-                                  renderer.get(), game_config["spritesheet_name"], game_config["spritesheet_path"],
-                                  game_config["spritesheet_sprite_width"], game_config["spritesheet_sprite_height"],
-                                  game_config["spritesheet_sprite_scale_factor"]));
+    request_asset({.kind = AssetLoader::Kind::SpriteSheet,
+                   .name = game_config["spritesheet_name"].get<std::string>(),
+                   .path = game_config["spritesheet_path"].get<std::string>(),
+                   .sprite_width = spritesheet_sprite_width,
+                   .sprite_height = spritesheet_sprite_height,
+                   .size = spritesheet_sprite_scale_factor});
+
+    // Any images named in the config (logo, credits, ...), so the first frame that draws them doesn't stall. They
+    // are null until loaded, which keeps get_graphic from loading them a second time meanwhile.
+    graphics.clear();
+    for (const auto & [key, value] : game_config) {
+        if (!headless && key.get_type() == sol::type::string && value.get_type() == sol::type::string &&
+            key.as<std::string>().ends_with("_image_path")) {
+            const auto path = value.as<std::string>();
+            if (graphics.try_emplace(path).second)
+                request_asset({.kind = AssetLoader::Kind::Graphic, .name = path, .path = path});
+        }
+    }
 
-    // Initialize sounds
+    // Sounds (there is no audio when headless)
     sounds.clear();
+    if (headless) return;
     if (game_config["sounds"].valid() && game_config["sounds"].get_type() == sol::type::table) {
         sol::table sound_table = game_config["sounds"];
 
         for (const auto & [key, value] : sound_table) {
-            if (key.get_type() == sol::type::string && value.get_type() == sol::type::string) {
-                auto sound_name = key.as<std::string>();
-                const auto sound_path = value.as<std::string>();
-
-                // check to see if the sound file exists
-                if (!std::filesystem::exists(sound_path)) {
-                    println("sound file does not exist: {}", sound_path);
-                } else {
-                    Sound s{.name = std::move(sound_name), .sound{Mix_LoadWAV(sound_path.c_str())}};
-                    check_sdl_ptr_or_throw(s.sound, std::format("Unable to load sound \"{}\"", s.name));
-                    sounds.push_back(std::make_shared<Sound>(std::move(s)));
-                }
-            }
+            if (key.get_type() == sol::type::string && value.get_type() == sol::type::string)
+                request_asset({.kind = AssetLoader::Kind::Sound, .name = key.as<std::string>(),
+                               .path = value.as<std::string>()});
         }
     }
 
-    if (game_config["soundtrack_path"].valid() && game_config["soundtrack_path"].get_type() == sol::type::string) {
-        std::string soundtrack_path = game_config["soundtrack_path"];
+    if (game_config["soundtrack_path"].valid() && game_config["soundtrack_path"].get_type() == sol::type::string)
+        request_asset({.kind = AssetLoader::Kind::Music,
+                       .name = "soundtrack",
+                       .path = game_config["soundtrack_path"].get<std::string>()});
+}
+
+void Engine::request_asset(AssetLoader::Request request) {
+    ++assets_requested;
+    // The sprite sheet is loaded up front either way: map_to_world and the sprite sizes depend on it from _init on
+    if (asset_loader && request.kind != AssetLoader::Kind::SpriteSheet) asset_loader->enqueue(std::move(request));
+    else install_asset(AssetLoader::load(std::move(request)));
+}
+
+void Engine::install_loaded_assets() {
+    if (asset_loader)
+        for (auto & loaded : asset_loader->take_loaded()) install_asset(std::move(loaded));
 
-        soundtrack.reset(Mix_LoadMUS(soundtrack_path.c_str()));
-        check_sdl_ptr_or_throw(soundtrack, "Unable to load soundtrack");
-        Mix_PlayMusic(soundtrack.get(), 1);
+    // Packing the atlas redraws every cache, so it waits until there is nothing more coming
+    if (assets_installed == assets_requested && !atlas_images.empty()) {
+        build_texture_atlas(atlas_images);
+        atlas_images.clear();
+    }
+}
+
+void Engine::install_asset(AssetLoader::Loaded loaded) {
+    ++assets_installed;
+    const auto & request = loaded.request;
+    if (!loaded.error.empty()) {
+        // Only a missing sprite sheet is fatal, as it always was. Other missing files just go unplayed or undrawn, as
+        // does a font that won't open.
+        const bool fatal = loaded.missing ? request.kind == AssetLoader::Kind::SpriteSheet
+                                          : request.kind != AssetLoader::Kind::Font;
+        if (fatal) throw std::runtime_error(loaded.error);
+        println("{}", loaded.error);
+    } else {
+        switch (request.kind) {
+            case AssetLoader::Kind::SpriteSheet:
+                sprite_sheets.insert_or_assign(
+                    request.name, std::make_shared<SpriteSheet>(renderer.get(), request.name, request.path,
+                                                                loaded.surface.get(), request.sprite_width,
+                                                                request.sprite_height, request.size));
+                atlas_images[request.path] = std::move(loaded.surface);
+                break;
+            case AssetLoader::Kind::Graphic:
+                set_graphic_image(graphics[request.path], loaded.surface.get());
+                atlas_images[request.path] = std::move(loaded.surface);
+                break;
+            case AssetLoader::Kind::Font:
+                if (auto it = texts.find(request.name); it != texts.end())
+                    it->second->load_font(std::move(loaded.bytes), request.size);
+                break;
+            case AssetLoader::Kind::Sound:
+                sounds.push_back(
+                    std::make_shared<Sound>(Sound{.name = request.name, .sound = std::move(loaded.chunk)}));
+                break;
+            case AssetLoader::Kind::Music:
+                soundtrack = std::move(loaded.music);
+                Mix_PlayMusic(soundtrack.get(), 1);
+                break;
+        }
     }
 }
 
 void Engine::tear_down() {
+    asset_loader.reset(); // its threads may be loading sounds, which need the mixer
+    atlas_images.clear();
     soundtrack.reset();
     sounds.clear();
+    sprite_batch = {}; // it points into the textures about to go
     sprite_sheets.clear();
+    graphics.clear();
     maps.clear();
     texts.clear();
-    systems.clear();
+    scheduler.clear();
+    visible_entities.clear();
     entity_manager.reset();
     lua = sol::state{}; // clear lua
+    // Nothing points into the pool any more, so its slabs go back in a handful of frees instead of one per entity
+    entity_memory.release();
 
     renderer.reset();
     window.reset();
-
-    Mix_Quit();
-    TTF_Quit();
-    IMG_Quit();
-    SDL_Quit();
+    sdl_libraries.reset();
 }
 
-void Engine::game_loop() {
+void Engine::game_loop(const LoopOptions & options) {
     tear_down();
 
-    lua.open_libraries(sol::lib::base, sol::lib::math, sol::lib::debug, sol::lib::string);
+    // ffi and jit only exist on LuaJIT; sol2 skips them when built against plain Lua
+    lua.open_libraries(sol::lib::base, sol::lib::math, sol::lib::debug, sol::lib::string, sol::lib::table,
+                       sol::lib::ffi, sol::lib::jit);
 
     std::string roguely_script = "roguely.lua";
     if (!std::filesystem::exists(roguely_script))
@@ -941,7 +3021,8 @@ void Engine::game_loop() {
     if (!game_config.valid() || !check_game_config(game_config, lua.lua_state()))
         throw std::runtime_error("game script does not define the 'Game' configuration table properly.");
 
-    initialize(game_config, lua.lua_state()); // may throw
+    initialize(game_config, options.headless, lua.lua_state()); // may throw
+    if (options.random_seed) random_streams.reseed(*options.random_seed);
 
     setup_lua_api(lua.lua_state());
 
@@ -955,89 +3036,146 @@ void Engine::game_loop() {
 
     SDL_Event e;
     bool quit = false;
-    const int fps = 6;
-    const int frame_delay = 1000 / fps;
 
-    Uint32 last_update_time = SDL_GetTicks();
-    const Uint32 update_interval = 1000;
+    const auto run_system = [&](ScheduledSystem & system, auto &&... args) {
+        const Profiler::Scope scope(system.name);
+        auto result = system.callback(std::forward<decltype(args)>(args)...);
+        if (!result.valid()) {
+            sol::error err = result;
+            println("Lua script error in {}: {}", system.name, err.what());
+        }
+        // Whatever the system assigned to its entities' components is in the native pools before anything else runs
+        entity_manager->sync_components();
+    };
+
+    const double counter_frequency = double(SDL_GetPerformanceFrequency());
+    Uint64 last_frame_counter = SDL_GetPerformanceCounter();
+
+    auto & profiler = Profiler::get();
+    if (profiler_overlay) profiler.set_enabled(true);
+
+    uint64_t frame = 0;
+    auto next_key_press = options.key_presses.begin();
+
+    for (; !quit && (!options.max_frames || frame < *options.max_frames); ++frame) {
+        profiler.begin_frame();
+        const size_t lua_memory_at_frame_start = lua.memory_used();
+        const Uint64 frame_counter = SDL_GetPerformanceCounter();
+        // Clamped so a stall doesn't hand the render systems a huge step, the scheduler caps catch-up on its own
+        const double delta_time = options.fixed_frame_time.value_or(
+            std::min((frame_counter - last_frame_counter) / counter_frequency, 0.25));
+        last_frame_counter = frame_counter;
+
+        // These are stable tables, so fetch them once per frame and hand the same ones to every system.
+        // FIXME: Fix hard coded entity group and entity name for PLAYER
+        const sol::table player = entity_manager->get_lua_entity("common", "player");
+        const sol::table entities = entity_manager->get_lua_entities();
+
+        const auto key_pressed = [&](SDL_Keycode key) {
+            scheduler.for_each(SystemRate::Input, [&](ScheduledSystem & system) {
+                run_system(system, key, player, entities, get_lua_entities_in_viewport());
+            });
+            scheduler.for_each(SystemRate::Turn, [&](ScheduledSystem & system) {
+                run_system(system, player, entities, get_lua_entities_in_viewport());
+            });
+        };
 
-    Uint32 frame_start;
-    int frame_time;
+        // Scripted key presses skip SDL's event queue, which is shared by every engine in the process
+        for (; next_key_press != options.key_presses.end() && next_key_press->first <= frame; ++next_key_press)
+            key_pressed(next_key_press->second);
 
-    while (!quit) {
-        frame_start = SDL_GetTicks();
+        {
+            const Profiler::Scope scope("install_loaded_assets");
+            install_loaded_assets();
+        }
 
         // handle events
-        while (SDL_PollEvent(&e)) {
+        while (!options.headless && SDL_PollEvent(&e)) {
             if (e.type == SDL_QUIT) {
                 quit = true;
+            } else if (e.type == SDL_RENDER_TARGETS_RESET) {
+                // The driver threw away what was drawn into the map tile caches
+                for (const auto & map : maps) map->trigger_redraw();
+            } else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_F3) {
+                // F3 toggles the profiler and its overlay; the game never sees the key
+                profiler_overlay = !profiler_overlay;
+                profiler.set_enabled(profiler_overlay || profiler.is_tracing());
             } else if (e.type == SDL_KEYDOWN) {
-                if (auto it = systems.find("keyboard_input_system"); it != systems.end()) {
-                    // FIXME: Fix hard coded entity group and entity name for PLAYER
-                    auto keyboard_input_system_result = it->second(
-                        e.key.keysym.sym, entity_manager->get_lua_entity("common", "player"),
-                        entity_manager->get_lua_entities(),
-                        entity_manager->get_lua_entities_in_viewport(
-                            [&](int x, int y) { return is_within_viewport(x, y); }, lua.lua_state()));
-                    if (!keyboard_input_system_result.valid()) {
-                        sol::error err = keyboard_input_system_result;
-                        println("Lua script error: {}", err.what());
-                    }
-                }
+                key_pressed(e.key.keysym.sym);
             }
         }
 
-        for (auto & [name, func] : systems) {
-            if (name != "tick_system" && name != "keyboard_input_system" && name != "render_system") {
-                auto system_result = func(entity_manager->get_lua_entity("common", "player"), entity_manager->get_lua_entities(),
-                                          entity_manager->get_lua_entities_in_viewport([&](int x, int y) { return is_within_viewport(x, y); },
-                                                                                       lua.lua_state()));
-                if (!system_result.valid()) {
-                    sol::error err = system_result;
-                    throw std::runtime_error(std::format("Lua script error: {}", err.what()));
-                }
-            }
+        {
+            const Profiler::Scope scope("simulation");
+            scheduler.advance(delta_time, [&](ScheduledSystem & system) {
+                run_system(system, player, entities, get_lua_entities_in_viewport());
+            });
+            scheduler.for_each(SystemRate::Frame, [&](ScheduledSystem & system) {
+                run_system(system, player, entities, get_lua_entities_in_viewport());
+            });
         }
 
-        Uint32 current_time = SDL_GetTicks();
-        if (current_time - last_update_time >= update_interval) {
-            if (auto it = systems.find("tick_system"); it != systems.end()) {
-                auto tick_system_result = it->second(
-                    entity_manager->get_lua_entity("common", "player"), entity_manager->get_lua_entities(),
-                    entity_manager->get_lua_entities_in_viewport([&](int x, int y) { return is_within_viewport(x, y); },
-                                                                 lua.lua_state())
-                );
-                if (!tick_system_result.valid()) {
-                    sol::error err = tick_system_result;
-                    println("Lua script error: {}", err.what());
-                }
-            }
-            last_update_time = current_time;
+        {
+            // Whatever moved, collided or died this frame, from input and simulation alike
+            const Profiler::Scope scope("events");
+            entity_manager->get_events().dispatch(lua.lua_state(), [&](const GameEvent & event) {
+                return entity_manager->event_to_lua(event, lua.lua_state());
+            });
+            entity_manager->sync_components();
         }
 
-        SDL_RenderClear(renderer.get());
+        {
+            const Profiler::Scope scope("render");
+            if (renderer) SDL_RenderClear(renderer.get());
+
+            const double alpha = scheduler.get_alpha();
+            scheduler.for_each(SystemRate::Render, [&](ScheduledSystem & system) {
+                run_system(system, float(delta_time), player, entities, get_lua_entities_in_viewport(), alpha);
+            });
 
-        // Calculate delta time
-        Uint32 current_frame_time = SDL_GetTicks();
-        float delta_time = (current_frame_time - frame_start) / 1000.0f;
+            if (profiler_overlay) draw_profiler_overlay();
+        }
 
-        // Call render
-        if (auto it = systems.find("render_system"); it != systems.end()) {
-            auto render_system_result = it->second(
-                delta_time, entity_manager->get_lua_entity("common", "player"), entity_manager->get_lua_entities(),
-                entity_manager->get_lua_entities_in_viewport([&](int x, int y) { return is_within_viewport(x, y); },
-                                                             lua.lua_state()));
-            if (!render_system_result.valid()) {
-                sol::error err = render_system_result;
-                println("Lua script error: {}", err.what());
-            }
+        {
+            const Profiler::Scope scope("present");
+            if (renderer) SDL_RenderPresent(immediate_renderer());
         }
 
-        SDL_RenderPresent(renderer.get());
+        // Net growth of the Lua heap over the frame, a stand in for the tables and strings the frame allocated (it
+        // goes negative when a collection runs)
+        profiler.count("lua_heap_growth_kb", (int64_t(lua.memory_used()) - int64_t(lua_memory_at_frame_start)) / 1024);
+        profiler.end_frame();
 
         // limit frame rate
-        frame_time = SDL_GetTicks() - frame_start;
-        if (frame_delay > frame_time) { SDL_Delay(frame_delay - frame_time); }
+        if (max_fps > 0 && !options.fixed_frame_time) {
+            const double frame_time = (SDL_GetPerformanceCounter() - frame_counter) / counter_frequency;
+            const double frame_budget = 1.0 / max_fps;
+            if (frame_time < frame_budget) SDL_Delay(Uint32((frame_budget - frame_time) * 1000));
+        }
+    }
+}
+
+void Engine::draw_profiler_overlay() {
+    const auto font = default_font.lock();
+    if (!font) return;
+
+    // Shows the previous frame: the one being drawn is still being measured
+    const auto stats = Profiler::get().get_last_frame();
+    std::vector<std::string> lines;
+    lines.push_back(std::format("frame {:.2f} ms", stats.frame_ms));
+    for (size_t i = 0; i < stats.zones.size() && i < profiler_overlay_zones; ++i) {
+        const auto & zone = stats.zones[i];
+        lines.push_back(std::format("{:7.2f} ms {:4}x {}", zone.total_ms, zone.calls, zone.name));
+    }
+    for (const auto & [name, value] : stats.counters) lines.push_back(std::format("{} {}", name, value));
+
+    SDL_Renderer * const target = immediate_renderer();
+    int y = 4;
+    for (const auto & line : lines) {
+        const auto extents = font->get_text_extents(line);
+        draw_filled_rect_with_color(target, 0, y, extents.width + 8, extents.height, 0, 0, 0, 180);
+        font->draw_text(target, 4, y, line, SDL_Color{.r = 255, .g = 255, .b = 0, .a = 255});
+        y += extents.height;
     }
 }
 
@@ -1064,20 +3202,21 @@ bool Engine::check_game_config(sol::table game_config, sol::this_state) const {
     return true;
 }
 
-void Engine::draw_text(const std::string & t, int x, int y) const { draw_text(t, x, y, 255, 255, 255, 255); }
+void Engine::draw_text(const std::string & t, int x, int y) { draw_text(t, x, y, 255, 255, 255, 255); }
 
-void Engine::draw_text(const std::string & t, int x, int y, Uint8 r, Uint8 g, Uint8 b, Uint8 a) const {
+void Engine::draw_text(const std::string & t, int x, int y, Uint8 r, Uint8 g, Uint8 b, Uint8 a) {
     if (t.empty()) return;
 
     if (!default_font.expired()) {
         const SDL_Color text_color{.r = r, .g = g, .b = b, .a = a};
-        default_font.lock()->draw_text(renderer.get(), x, y, t, text_color);
+        default_font.lock()->draw_text(immediate_renderer(), x, y, t, text_color);
     }
 }
 
-void Engine::draw_sprite(const std::string & spritesheet_name, int sprite_id, int x, int y, int scale_factor) const {
+void Engine::draw_sprite(const std::string & spritesheet_name, int sprite_id, int x, int y, int scale_factor,
+                         std::optional<SDL_Color> tint) {
     if (auto it = sprite_sheets.find(spritesheet_name); it != sprite_sheets.end()) {
-        it->second->draw_sprite(renderer.get(), sprite_id, x, y, scale_factor);
+        it->second->batch_sprite(sprite_batch, sprite_id, x, y, scale_factor, tint);
     }
 }
 
@@ -1104,34 +3243,97 @@ void Engine::draw_filled_rect_with_color(SDL_Renderer * renderer, int x, int y,
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 }
 
-void Engine::draw_graphic(SDL_Renderer * renderer, const std::string & path, int window_width, int x, int y,
-                          bool centered, int scale_factor) const {
+const Engine::Graphic * Engine::get_graphic(const std::string & path) {
+    if (auto it = graphics.find(path); it != graphics.end()) return it->second.texture ? &it->second : nullptr;
+
+    // Missing files are cached too (as a null texture) so that we only ever hit the disk once per path
+    auto & graphic = graphics[path];
     if (!std::filesystem::exists(path)) {
         println("graphic file does not exist: {}", path);
+        return nullptr;
+    }
+
+    UPtr<SDL_Surface> surface{IMG_Load(path.c_str())};
+    check_sdl_ptr_or_throw(surface, "Unable to load graphic file");
+    set_graphic_image(graphic, surface.get());
+    return &graphic;
+}
+
+void Engine::set_graphic_image(Graphic & graphic, SDL_Surface * image) {
+    graphic.texture.reset(SDL_CreateTextureFromSurface(renderer.get(), image), detail::Deleter{});
+    check_sdl_ptr_or_throw(graphic.texture, "Unable to create graphic texture");
+    Profiler::get().count("sdl_textures_created");
+    graphic.width = image->w;
+    graphic.height = image->h;
+    graphic.texture_size = {graphic.width, graphic.height};
+    graphic.source = {.x = 0, .y = 0, .w = graphic.width, .h = graphic.height};
+}
+
+void Engine::build_texture_atlas(const std::unordered_map<std::string, UPtr<SDL_Surface>> & images) {
+    if (!renderer) return;
+
+    // The textures hold their pixels on the GPU side, where we can't copy them from, hence the images
+    std::vector<SDL_Surface *> surfaces;
+    std::vector<Size> sizes;
+    const auto pack = [&](const std::string & path) {
+        const auto it = images.find(path);
+        if (it == images.end() || !it->second) return false;
+        surfaces.push_back(it->second.get());
+        sizes.push_back({it->second->w, it->second->h});
+        return true;
+    };
+    std::vector<SpriteSheet *> packed_sheets;
+    for (const auto & [name, sheet] : sprite_sheets) {
+        if (sheet && sheet->get_spritesheet_texture() && pack(sheet->get_path())) packed_sheets.push_back(sheet.get());
+    }
+    std::vector<Graphic *> packed_graphics;
+    for (auto & [path, graphic] : graphics) {
+        if (graphic.texture && pack(path)) packed_graphics.push_back(&graphic);
+    }
+    if (surfaces.size() < 2) return; // nothing to gain
+
+    SDL_RendererInfo info{};
+    SDL_GetRendererInfo(renderer.get(), &info);
+    // Renderers that don't report a limit (the software one) get one every GPU manages
+    const Size max_size{.width = info.max_texture_width > 0 ? info.max_texture_width : 4096,
+                        .height = info.max_texture_height > 0 ? info.max_texture_height : 4096};
+    Size atlas_size{};
+    const auto places = TextureAtlas::pack(sizes, max_size, atlas_size);
+    if (!places) {
+        println("the sprite sheets and graphics don't fit in one {}x{} texture, drawing them separately",
+                max_size.width, max_size.height);
         return;
     }
 
-    auto *graphic = IMG_Load(path.c_str());
-    check_sdl_ptr_or_throw(graphic, "Unable to load graphic file");
-    Defer d1([&graphic] { SDL_FreeSurface(graphic); graphic = nullptr; });
-    auto *graphic_texture = SDL_CreateTextureFromSurface(renderer, graphic);
-    check_sdl_ptr_or_throw(graphic_texture, "Unable to create graphic texture");
-    Defer d2([&graphic_texture] { SDL_DestroyTexture(graphic_texture); graphic_texture = nullptr; });
+    const auto atlas = TextureAtlas::create(renderer.get(), surfaces, *places, atlas_size);
+    size_t i = 0;
+    for (auto * sheet : packed_sheets) sheet->move_to_atlas(atlas, atlas_size, (*places)[i++]);
+    for (auto * graphic : packed_graphics) {
+        graphic->texture = atlas;
+        graphic->texture_size = atlas_size;
+        graphic->source = (*places)[i++];
+    }
+    // Anything cached with the sheets' old textures has to go
+    for (const auto & map : maps) map->trigger_redraw();
+}
+
+void Engine::draw_graphic(const std::string & path, int window_width, int x, int y, bool centered, int scale_factor) {
+    const auto * graphic = get_graphic(path);
+    if (!graphic) return;
 
-    const SDL_Rect src = {.x = 0, .y = 0, .w = graphic->w, .h = graphic->h};
-    SDL_Rect dest = {.x = x, .y = y, .w = graphic->w, .h = graphic->h};
+    SDL_Rect dest = {.x = x, .y = y, .w = graphic->width, .h = graphic->height};
 
     if (scale_factor > 0) {
-        if (centered) dest = {((window_width / (2 + (int)scale_factor)) - (graphic->w / 2)), y, graphic->w, graphic->h};
+        if (centered)
+            dest = {((window_width / (2 + (int)scale_factor)) - (graphic->width / 2)), y, graphic->width,
+                    graphic->height};
 
-        SDL_RenderSetScale(renderer, (float)scale_factor, (float)scale_factor);
-        SDL_RenderCopy(renderer, graphic_texture, &src, &dest);
-        SDL_RenderSetScale(renderer, 1, 1);
+        // Scaled the way SDL_RenderSetScale would have, position included
+        dest = {dest.x * scale_factor, dest.y * scale_factor, dest.w * scale_factor, dest.h * scale_factor};
     } else {
-        if (centered) dest = {((window_width / 2) - (graphic->w / 2)), y, graphic->w, graphic->h};
-
-        SDL_RenderCopy(renderer, graphic_texture, &src, &dest);
+        if (centered) dest = {((window_width / 2) - (graphic->width / 2)), y, graphic->width, graphic->height};
     }
+    sprite_batch.add(graphic->texture.get(), graphic->texture_size, graphic->source, dest);
 }
 
 void Engine::play_sound(const std::string & name) const {
@@ -1141,61 +3343,72 @@ void Engine::play_sound(const std::string & name) const {
 }
 
 /* static */
-std::shared_ptr<Map> Engine::generate_map(const std::string & name, int map_width, int map_height) {
-    auto map = init_cellular_automata(map_width, map_height);
-    perform_cellular_automaton(*map, map_width, map_height, 10);
+std::shared_ptr<Map> Engine::generate_map(const std::string & name, int map_width, int map_height,
+                                          const MapGenerationParams & params, ThreadPool & pool) {
+    auto walls = init_cellular_automata(map_width, map_height, params, pool);
+    perform_cellular_automaton(walls, map_width, map_height, params.passes, pool);
+
+    auto map = std::make_shared<Matrix>(map_height, map_width);
+    int * const cells = map->data();
+    for (size_t i = 0; i < walls.size(); ++i) cells[i] = walls[i] ? 0 : 1; // 0 = wall, 1 = floor
 
     return std::make_shared<Map>(name, map_width, map_height, std::move(map));
 }
 
 /* static */
-std::shared_ptr<Matrix> Engine::init_cellular_automata(int map_width, int map_height) {
+std::vector<uint8_t> Engine::init_cellular_automata(int map_width, int map_height, const MapGenerationParams & params,
+                                                    ThreadPool & pool) {
     assert(map_width >= 0 && map_height >= 0);
-    auto ret = std::make_shared<Matrix>(map_height, map_width);
-    auto & map = *ret;
+    const size_t width = static_cast<size_t>(map_width);
+    std::vector<uint8_t> walls(width * static_cast<size_t>(map_height), 1);
 
-    for (int r = 0; r < map_height; ++r) {
-        for (int c = 0; c < map_width; ++c) {
-            const int z = generate_random_int(1, 100);
-            if (z > 48) {
-                map(r, c) = 1;
-            } else
-                map(r, c) = 0;
-        }
+    uint64_t seed = params.seed.value_or(0);
+    if (!params.seed) {
+        std::random_device rd;
+        seed = (uint64_t(rd()) << 32) | rd();
     }
 
-    return ret;
+    pool.parallel_for(1, std::max(map_height - 1, 1), [&](size_t row_begin, size_t row_end) {
+        for (size_t r = row_begin; r < row_end; ++r) {
+            // Each row gets its own generator so the result doesn't depend on how rows were split up
+            uint64_t state = seed ^ (r * 0xD1B54A32D192ED03ull);
+            uint8_t * const row = walls.data() + r * width;
+            for (size_t c = 1; c + 1 < width; ++c)
+                row[c] = uint8_t(double(detail::splitmix64(state) >> 11) * 0x1.0p-53 < params.wall_fill);
+        }
+    }, 16);
+
+    return walls;
 }
 
 /* static */
-void Engine::perform_cellular_automaton(Matrix & map, const int map_width, const int map_height, const int passes) {
-    const auto get_neighbor_wall_count = [&map, map_width, map_height](const int x, const int y) {
-        int wall_count = 0;
-
-        for (int row = y - 1; row <= y + 1; ++row) {
-            for (int col = x - 1; col <= x + 1; ++col) {
-                if (row >= 1 && col >= 1 && row < map_height - 1 && col < map_width - 1) {
-                    if (map(row, col) == 0) ++wall_count;
-                } else {
-                    ++wall_count;
-                }
-            }
-        }
+void Engine::perform_cellular_automaton(std::vector<uint8_t> & walls, const int map_width, const int map_height,
+                                        const int passes, ThreadPool & pool) {
+    if (map_width < 3 || map_height < 3) return; // all ring, all wall
 
-        return wall_count;
-    };
+    const size_t width = static_cast<size_t>(map_width);
+    // The outer ring is wall in both buffers and never written, so interior cells can read all 8 neighbours unchecked
+    std::vector<uint8_t> next(walls);
 
     for (int p = 0; p < passes; ++p) {
-        for (int r = 0; r < map_height; ++r) {
-            for (int c = 0; c < map_width; ++c) {
-                const int neighbor_wall_count = get_neighbor_wall_count(c, r);
-
-                if (neighbor_wall_count > 4) {
-                    map(r, c) = 0; // 0 = wall
-                } else
-                    map(r, c) = 1; // 1 = floor
+        const uint8_t * const cur = walls.data();
+        uint8_t * const out = next.data();
+        pool.parallel_for(1, size_t(map_height - 1), [&](size_t row_begin, size_t row_end) {
+            // Sum each column of the 3 row window once, then every 3x3 count is just 3 adjacent column sums. Both
+            // loops are branch free byte arithmetic, which the compiler vectorizes.
+            std::vector<uint8_t> column_sums(width);
+            for (size_t r = row_begin; r < row_end; ++r) {
+                const uint8_t * const up = cur + (r - 1) * width;
+                const uint8_t * const mid = cur + r * width;
+                const uint8_t * const down = cur + (r + 1) * width;
+                for (size_t c = 0; c < width; ++c) column_sums[c] = uint8_t(up[c] + mid[c] + down[c]);
+
+                uint8_t * const out_row = out + r * width;
+                for (size_t c = 1; c + 1 < width; ++c)
+                    out_row[c] = uint8_t(column_sums[c - 1] + column_sums[c] + column_sums[c + 1] > 4);
             }
-        }
+        }, 16);
+        walls.swap(next);
     }
 }
 
@@ -1214,6 +3427,210 @@ Dimension Engine::update_player_viewport(const Point & player_position, const Si
     return dim;
 }
 
+bool Engine::select_current_map(const std::string & name) {
+    if (current_map_info.name != name) {
+        auto map = find_map(name);
+
+        if (map != nullptr) {
+            current_map_info.map = map;
+            current_map_info.name = name;
+        }
+    }
+
+    return current_map_info.name == name && current_map_info.map != nullptr;
+}
+
+bool Engine::save_level(const std::string & path, const std::string & map_name,
+                        const std::vector<std::string> & entity_groups, sol::this_state s) {
+    auto map = find_map(map_name);
+    if (map == nullptr) {
+        println("Error, could not find map '{}'", map_name);
+        return false;
+    }
+
+    const auto group_names = entity_groups.empty() ? entity_manager->get_entity_group_names() : entity_groups;
+    std::vector<std::pair<const std::string *, std::shared_ptr<Entity>>> entities;
+    for (const auto & group_name : group_names) {
+        if (auto group = entity_manager->get_entities_in_group(group_name))
+            for (const auto & e : *group)
+                if (e->get_component<LuaComponent>() != nullptr) entities.emplace_back(&group_name, e);
+    }
+
+    LevelWriter writer;
+    LevelHeader header{};
+    std::copy(std::begin(LEVEL_MAGIC), std::end(LEVEL_MAGIC), header.magic);
+    header.version = LEVEL_VERSION;
+    header.width = uint32_t(map->get_width());
+    header.height = uint32_t(map->get_height());
+    header.group_count = uint32_t(group_names.size());
+    header.entity_count = uint32_t(entities.size());
+    writer.put(header);
+    writer.put_string(map_name);
+    for (const auto & group_name : group_names) writer.put_string(group_name);
+
+    const Matrix & cells = *map->get_map();
+    const Matrix & light = *map->get_light_map();
+    writer.bytes.reserve(writer.bytes.size() + 2 * cells.size1() * cells.size2());
+    for (size_t r = 0; r < cells.size1(); ++r)
+        for (const int cell : cells.row(r)) writer.put(uint8_t(std::clamp(cell, 0, 255)));
+    // Nothing is in view right after loading, so what's visible now is saved as explored
+    for (size_t r = 0; r < light.size1(); ++r)
+        for (const int l : light.row(r)) writer.put(uint8_t(l == Map::LIGHT_VISIBLE ? Map::LIGHT_EXPLORED : l));
+
+    for (const auto & [group_name, e] : entities) {
+        writer.put_string(*group_name);
+        writer.put_string(e->get_id());
+        writer.put_string(e->get_name());
+        writer.put_lua_value(entity_manager->snapshot_components(*e, s));
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(writer.bytes.data()), std::streamsize(writer.bytes.size()));
+    if (!out) {
+        println("Error, could not write level '{}'", path);
+        return false;
+    }
+    return true;
+}
+
+std::string Engine::load_level(const std::string & path, const sol::optional<sol::function> & restore_callback,
+                               sol::this_state s) {
+    sol::state_view lua(s);
+    const MappedFile file(path);
+    LevelReader reader(file.bytes());
+
+    const auto header = reader.get<LevelHeader>();
+    if (!std::equal(std::begin(LEVEL_MAGIC), std::end(LEVEL_MAGIC), header.magic) || header.version != LEVEL_VERSION)
+        throw std::runtime_error(std::format("'{}' is not a level file", path));
+
+    constexpr auto max_dimension = uint32_t(std::numeric_limits<int>::max());
+    if (header.width == 0 || header.height == 0 || header.width > max_dimension || header.height > max_dimension)
+        throw std::runtime_error(std::format("'{}' has a {} x {} map", path, header.width, header.height));
+
+    const std::string name = reader.get_string();
+    reader.check_count(header.group_count, sizeof(uint32_t)); // a length prefixed name each
+    std::vector<std::string> group_names(header.group_count);
+    for (auto & group_name : group_names) group_name = reader.get_string();
+
+    const size_t cell_count = size_t(header.width) * size_t(header.height);
+    const auto cells = reader.take(cell_count);
+    const auto light = reader.take(cell_count);
+
+    struct EntityRecord {
+        std::string group, id, name;
+        sol::object components;
+    };
+    // Read everything before touching the engine's state, so a truncated file leaves the current level alone. Each
+    // record is at least three length prefixed strings and a tagged value
+    reader.check_count(header.entity_count, 3 * sizeof(uint32_t) + sizeof(LevelValueTag));
+    std::vector<EntityRecord> records(header.entity_count);
+    for (auto & record : records) {
+        record.group = reader.get_string();
+        record.id = reader.get_string();
+        record.name = reader.get_string();
+        record.components = reader.get_lua_value(lua);
+    }
+
+    auto matrix = std::make_shared<Matrix>(int(header.height), int(header.width));
+    std::copy(cells.begin(), cells.end(), matrix->data());
+    auto map = std::make_shared<Map>(name, int(header.width), int(header.height), std::move(matrix));
+    std::copy(light.begin(), light.end(), map->get_light_map()->data());
+    map->set_fov_radius(fov_radius);
+    if (auto it = std::find_if(maps.begin(), maps.end(), [&name](const auto & m) { return m->get_name() == name; });
+        it != maps.end()) {
+        map->set_tile_rules((*it)->get_tile_rules());
+        *it = map;
+    } else {
+        maps.push_back(map);
+    }
+    current_map_info.name = name;
+    current_map_info.map = map;
+
+    for (const auto & group_name : group_names) entity_manager->clear_entity_group(group_name);
+    // Whatever happened before the load happened to entities that are gone now
+    entity_manager->get_events().clear();
+    for (auto & record : records) {
+        sol::table components =
+            record.components.is<sol::table>() ? record.components.as<sol::table>() : lua.create_table();
+        if (restore_callback) {
+            auto restore_result = (*restore_callback)(record.group, record.name, components);
+            if (!restore_result.valid()) {
+                sol::error err = restore_result;
+                println("Lua script error: {}", err.what());
+            } else if (restore_result.get_type() == sol::type::table) {
+                // The callback may hand back a table the script keeps using, eg a prototype's components
+                components = entity_manager->copy_table(restore_result.get<sol::table>(), s);
+            }
+        }
+
+        auto entity = entity_manager->make_entity(record.id, record.name);
+        entity->add_component(entity_manager->make_component<LuaComponent>("lua component", components));
+        entity_manager->add_entity_to_group(record.group, entity, s);
+
+        // Keep freshly generated ids from colliding with the restored ones
+        size_t numeric_id{};
+        const auto * const id_end = record.id.data() + record.id.size();
+        if (auto [ptr, ec] = std::from_chars(record.id.data(), id_end, numeric_id); ec == std::errc{} && ptr == id_end)
+            Id::reserve_through(numeric_id);
+    }
+
+    return name;
+}
+
+const DistanceField * Engine::get_player_distance_field() {
+    if (current_map_info.map == nullptr) return nullptr;
+    const auto player_position =
+        [this]() -> std::optional<Point> {
+            auto player = entity_manager->get_entity_by_name("common", "player");
+            return player ? entity_manager->get_entity_position(*player) : std::nullopt;
+        }();
+    if (!player_position) return nullptr;
+
+    // One flood per player move serves every mob asking for a step, however many there are
+    const Matrix & grid = *current_map_info.map->get_map();
+    const uint64_t revision = current_map_info.map->get_revision();
+    if (!player_distance_field.is_current(grid, revision, *player_position))
+        player_distance_field.compute(grid, revision, *player_position, 1);
+    return &player_distance_field;
+}
+
+void Engine::draw_visible_entities(const Map & map, const SpriteSheet & sprite_sheet,
+                                   const sol::function & draw_entity_callback) {
+    const Point & focus = current_dimension.supplemental_point;
+    const Point top_left{std::max(current_dimension.point.x, 0), std::max(current_dimension.point.y, 0)};
+    const Point bottom_right{std::min(current_dimension.size.width, map.get_width()) - 1,
+                             std::min(current_dimension.size.height, map.get_height()) - 1};
+
+    // Collect first: the Lua callbacks may well add, move or remove entities while we draw
+    visible_entities.clear();
+    entity_manager->get_spatial_index().for_each_in_rect(
+        top_left, bottom_right, [&](const Point & p, const SpatialIndex::Entry & entry) {
+            if (p == focus || map.is_visible(p.x, p.y)) visible_entities.emplace_back(p, entry);
+        });
+    // Whatever stands on the focus point (the player) is drawn last so it stays on top
+    std::stable_partition(visible_entities.begin(), visible_entities.end(),
+                          [&](const auto & pe) { return pe.first != focus; });
+
+    for (const auto & [p, entry] : visible_entities) {
+        auto entity_table = entity_manager->get_lua_entity_table(entry.group_name, *entry.entity);
+        if (!entity_table.valid()) continue;
+
+        const auto world = sprite_sheet.map_to_world(p.x, p.y, current_dimension);
+        auto draw_entity_callback_result =
+            draw_entity_callback(entity_table, world.x, world.y, sprite_sheet.get_scale_factor());
+        if (!draw_entity_callback_result.valid()) {
+            sol::error err = draw_entity_callback_result;
+            println("Lua script error: {}", err.what());
+        }
+    }
+    visible_entities.clear();
+}
+
+sol::table Engine::get_lua_entities_in_viewport() {
+    return entity_manager->get_lua_entities_in_viewport({view_port_x, view_port_y},
+                                                        {view_port_width - 1, view_port_height - 1}, lua.lua_state());
+}
+
 sol::function Engine::check_if_lua_function_defined(sol::this_state s, const std::string & name) const {
     sol::state_view lua(s);
     sol::function lua_func = lua[name];
@@ -1227,78 +3644,156 @@ sol::function Engine::check_if_lua_function_defined(sol::this_state s, const std
 
 void Engine::setup_lua_api(sol::this_state s) {
     sol::state_view lua(s);
+    // Every binding is timed under its own name while the profiler is on
+    const auto set_function = [&](const char * name, auto func) {
+        lua.set_function(name, profiled(name, std::move(func)));
+    };
+    // Headless there is nothing to draw to, so drawing functions take whatever they are given and do nothing, draw
+    // callbacks included
+    const auto set_draw_function = [&](const char * name, auto func) {
+        if (renderer) set_function(name, std::move(func));
+        else lua.set_function(name, [](sol::variadic_args) {});
+    };
 
-    lua.set_function("get_sprite_info", [&](std::string sprite_sheet_name, sol::this_state s) {
+    // Small results go back to Lua as these usertypes instead of fresh tables, so the calls made every turn (several
+    // per mob) leave a single userdata each for the collector. They are copies: assigning to a field changes nothing in
+    // the engine.
+    lua.new_usertype<Point>("Point", sol::call_constructor, sol::factories([](int x, int y) { return Point{x, y}; }),
+                            "x", &Point::x, "y", &Point::y);
+    lua.new_usertype<Size>("Size", sol::no_constructor, "width", &Size::width, "height", &Size::height);
+    lua.new_usertype<AdjacentPoint>("AdjacentPoint", sol::no_constructor, "x", &AdjacentPoint::x, "y",
+                                    &AdjacentPoint::y, "blocked", &AdjacentPoint::blocked);
+    // Handed out by value, sol2 would otherwise give member references that dangle once the parent is collected
+    lua.new_usertype<AdjacentPoints>(
+        "AdjacentPoints", sol::no_constructor,
+        "up", sol::readonly_property([](const AdjacentPoints & a) { return a.up; }),
+        "down", sol::readonly_property([](const AdjacentPoints & a) { return a.down; }),
+        "left", sol::readonly_property([](const AdjacentPoints & a) { return a.left; }),
+        "right", sol::readonly_property([](const AdjacentPoints & a) { return a.right; }));
+
+    set_function("get_sprite_info", [&](std::string sprite_sheet_name, sol::this_state s) {
         if (auto it = sprite_sheets.find(sprite_sheet_name); it != sprite_sheets.end()) {
             it->second->get_sprites_as_lua_table(s);
         }
     });
-    lua.set_function("draw_text", [&](const std::string & t, int x, int y) { draw_text(t, x, y); });
-    lua.set_function("draw_text_with_color", [&](const std::string & t, int x, int y, int r, int g, int b, int a) {
+    set_draw_function("draw_text", [&](const std::string & t, int x, int y) { draw_text(t, x, y); });
+    set_draw_function("draw_text_with_color", [&](const std::string & t, int x, int y, int r, int g, int b, int a) {
         draw_text(t, x, y, Uint8(r), Uint8(g), Uint8(b), Uint8(a));
     });
-    lua.set_function("draw_sprite", [&](const std::string & spritesheet_name, int sprite_id, int x, int y) {
+    set_draw_function("draw_sprite", [&](const std::string & spritesheet_name, int sprite_id, int x, int y) {
         draw_sprite(spritesheet_name, sprite_id, x, y, 0);
     });
-    lua.set_function("draw_sprite_scaled",
-                     [&](const std::string & spritesheet_name, int sprite_id, int x, int y, int scale_factor) {
-                         draw_sprite(spritesheet_name, sprite_id, x, y, scale_factor);
-                     });
-    lua.set_function("draw_sprite_sheet", [&](const std::string & spritesheet_name, int x, int y) {
+    set_draw_function("draw_sprite_scaled",
+                      [&](const std::string & spritesheet_name, int sprite_id, int x, int y, int scale_factor) {
+                          draw_sprite(spritesheet_name, sprite_id, x, y, scale_factor);
+                      });
+    set_draw_function("draw_sprite_tinted", [&](const std::string & spritesheet_name, int sprite_id, int x, int y,
+                                                int scale_factor, int r, int g, int b, sol::optional<int> a) {
+        draw_sprite(spritesheet_name, sprite_id, x, y, scale_factor,
+                    SDL_Color{Uint8(r), Uint8(g), Uint8(b), Uint8(a.value_or(255))});
+    });
+    set_draw_function("draw_sprite_sheet", [&](const std::string & spritesheet_name, int x, int y) {
         auto ss_i = sprite_sheets.find(spritesheet_name);
-        if (ss_i != sprite_sheets.end()) { ss_i->second->draw_sprite_sheet(renderer.get(), x, y); }
-    });
-    lua.set_function("set_draw_color", [&](int r, int g, int b, int a) { set_draw_color(renderer.get(), Uint8(r), Uint8(g), Uint8(b), Uint8(a)); });
-    lua.set_function("draw_point", [&](int x, int y) { draw_point(renderer.get(), x, y); });
-    lua.set_function("draw_rect", [&](int x, int y, int w, int h) { draw_rect(renderer.get(), x, y, w, h); });
-    lua.set_function("draw_filled_rect", [&](int x, int y, int w, int h) { draw_filled_rect(renderer.get(), x, y, w, h); });
-    lua.set_function("draw_filled_rect_with_color", [&](int x, int y, int w, int h, int r, int g, int b, int a) {
-        draw_filled_rect_with_color(renderer.get(), x, y, w, h, Uint8(r), Uint8(g), Uint8(b), Uint8(a));
-    });
-    lua.set_function("draw_graphic",
-                     [&](const std::string & path, int window_width, int x, int y, bool centered, int scale_factor) {
-                         draw_graphic(renderer.get(), path, window_width, x, y, centered, scale_factor);
-                     });
-    lua.set_function("play_sound", [&](const std::string & name) { play_sound(name); });
-    lua.set_function("get_random_number", [&](int min, int max) { return generate_random_int(min, max); });
-    lua.set_function("generate_uuid", [&]() { return generate_uuid(); });
-    lua.set_function("generate_map", [&](const std::string & name, int map_width, int map_height) {
-        auto map = generate_map(name, map_width, map_height);
+        if (ss_i != sprite_sheets.end()) { ss_i->second->draw_sprite_sheet(immediate_renderer(), x, y); }
+    });
+    set_draw_function("set_draw_color", [&](int r, int g, int b, int a) {
+        set_draw_color(renderer.get(), Uint8(r), Uint8(g), Uint8(b), Uint8(a));
+    });
+    set_draw_function("draw_point", [&](int x, int y) { draw_point(immediate_renderer(), x, y); });
+    set_draw_function("draw_rect", [&](int x, int y, int w, int h) { draw_rect(immediate_renderer(), x, y, w, h); });
+    set_draw_function("draw_filled_rect",
+                      [&](int x, int y, int w, int h) { draw_filled_rect(immediate_renderer(), x, y, w, h); });
+    set_draw_function("draw_filled_rect_with_color", [&](int x, int y, int w, int h, int r, int g, int b, int a) {
+        draw_filled_rect_with_color(immediate_renderer(), x, y, w, h, Uint8(r), Uint8(g), Uint8(b), Uint8(a));
+    });
+    set_draw_function("draw_graphic",
+                      [&](const std::string & path, int window_width, int x, int y, bool centered, int scale_factor) {
+                          draw_graphic(path, window_width, x, y, centered, scale_factor);
+                      });
+    set_function("play_sound", [&](const std::string & name) { play_sound(name); });
+    set_function("get_random_number", [&](int min, int max, sol::optional<std::string> stream) {
+        return int(random_streams.get(stream.value_or("default")).uniform_int(min, max));
+    });
+    set_function("seed_random", [&](lua_Integer seed) { random_streams.reseed(static_cast<uint64_t>(seed)); });
+    set_function("get_random_seed", [&]() { return static_cast<lua_Integer>(random_streams.get_master_seed()); });
+    set_function("generate_uuid", [&]() { return generate_uuid(); });
+    set_function("generate_map", [&](const std::string & name, int map_width, int map_height,
+                                     sol::optional<sol::table> options) {
+        auto params = read_map_generation_params(options);
+        if (!params.seed) params.seed = random_streams.get("map")();
+        auto map = generate_map(name, map_width, map_height, params, thread_pool);
+        map->set_fov_radius(fov_radius);
         current_map_info.name = name;
         current_map_info.map = map;
         maps.push_back(map);
     });
-    lua.set_function("get_random_point_on_map", [&](sol::this_state s) {
+    set_function("set_fov_radius", [&](const std::string & name, int radius) {
+        if (auto map = find_map(name)) map->set_fov_radius(radius);
+    });
+    set_function("find_path", [&](int start_x, int start_y, int goal_x, int goal_y, sol::optional<bool> use_jump_points,
+                                  sol::this_state s) {
+        sol::state_view lua(s);
+        sol::table result = lua.create_table();
+        if (current_map_info.map == nullptr) return result;
+        // floor tiles (1) are walkable, walls (0) are not
+        const auto mode = use_jump_points.value_or(false) ? AStar::PathfinderContext::Mode::JumpPoint
+                                                          : AStar::PathfinderContext::Mode::AStar;
+        const auto & path = pathfinder.find_path(*current_map_info.map->get_map(), Point{.x = start_x, .y = start_y},
+                                                 Point{.x = goal_x, .y = goal_y}, 1, mode);
+        for (size_t i = 0; i < path.size(); ++i)
+            result[i + 1] = lua.create_table_with("x", path[i].x, "y", path[i].y);
+        return result;
+    });
+    set_function("get_step_toward_player", [&](int x, int y, sol::this_state s) -> sol::object {
         sol::state_view lua(s);
-        if (current_map_info.map != nullptr) {
-            Point point{0, 0};
+        const DistanceField * field = get_player_distance_field();
+        if (field == nullptr) return sol::lua_nil;
+        // Cells holding a blocking entity are skipped so mobs queue up rather than stack, the player's own cell
+        // included: whoever is next to the player gets nil and is free to attack instead.
+        const auto step =
+            field->step_toward_origin(x, y, [&](const Point & p) { return entity_manager->is_blocking_at(p); });
+        if (!step) return sol::lua_nil;
+        return lua.create_table_with("x", step->x, "y", step->y, "distance", field->distance(x, y));
+    });
+    set_function("get_random_point_on_map", [&](sol::optional<std::string> stream) -> sol::optional<Point> {
+        if (current_map_info.map == nullptr) return sol::nullopt;
 
-            do {
-                point = current_map_info.map->get_random_point({0});
-            } while (!entity_manager->lua_is_point_unique(point));
+        Point point{0, 0};
+        auto & rng = random_streams.get(stream.value_or("spawn"));
 
-            return lua.create_table_with("x", point.x, "y", point.y);
+        do {
+            point = current_map_info.map->get_random_point({0}, rng);
+        } while (!entity_manager->lua_is_point_unique(point));
+
+        return point;
+    });
+    set_function("save_level", [&](const std::string & path, const std::string & map_name,
+                                   sol::optional<sol::table> groups, sol::this_state s) {
+        std::vector<std::string> group_names;
+        if (groups)
+            for (const auto & [_, value] : *groups)
+                if (value.is<std::string>()) group_names.push_back(value.as<std::string>());
+        return save_level(path, map_name, group_names, s);
+    });
+    set_function("load_level", [&](const std::string & path, sol::optional<sol::function> restore_callback,
+                                   sol::this_state s) -> sol::object {
+        try {
+            return sol::make_object(s, load_level(path, restore_callback, s));
+        } catch (const std::exception & e) {
+            println("Error, could not load level '{}': {}", path, e.what());
+            return sol::lua_nil;
         }
-        return lua.create_table();
     });
-    lua.set_function("set_map", [&](const std::string & name) {
+    set_function("set_map", [&](const std::string & name) {
         auto map = find_map(name);
         if (map != nullptr) {
             current_map_info.map = map;
             current_map_info.name = name;
         }
     });
-    lua.set_function("draw_visible_map", [&](const std::string & name, const std::string & ss_name, sol::function draw_map_callback) {
-        if (current_map_info.name != name) {
-            auto map = find_map(name);
-
-            if (map != nullptr) {
-                current_map_info.map = map;
-                current_map_info.name = name;
-            }
-        }
-
-        if (current_map_info.name == name) {
+    set_draw_function("draw_visible_map", [&](const std::string & name, const std::string & ss_name,
+                                              sol::function draw_map_callback) {
+        if (select_current_map(name)) {
             auto ss_it = sprite_sheets.find(ss_name);
             if (ss_it == sprite_sheets.end()) {
                 println("Error, could not find sprite sheet '{}'", ss_name);
@@ -1308,8 +3803,14 @@ void Engine::setup_lua_api(sol::this_state s) {
                 println("Error, sprite sheet '{}' is null!", ss_name);
                 return;
             }
+            // The hook may well draw entities into the tile cache, so the cells they moved onto or off are redrawn
+            if (auto changes = entity_manager->take_spatial_changes(); changes.all)
+                current_map_info.map->trigger_redraw();
+            else
+                for (const auto & p : changes.tiles) current_map_info.map->mark_dirty(p);
+            // The sprites the hook queues go into the tile cache, so they are flushed before it is drawn from
             current_map_info.map->draw_map(
-                renderer.get(), current_dimension, ss_it->second,
+                immediate_renderer(), current_dimension, ss_it->second,
                 [&](int rows, int cols, int dx, int dy, int cell_id, int light_cell, int scale_factor) {
                     auto draw_map_callback_result =
                         draw_map_callback(rows, cols, dx, dy, cell_id, light_cell, scale_factor);
@@ -1317,173 +3818,317 @@ void Engine::setup_lua_api(sol::this_state s) {
                         sol::error err = draw_map_callback_result;
                         println("Lua script error: {}", err.what());
                     }
-                });
+                },
+                [&] { sprite_batch.flush(renderer.get()); });
         }
     });
-    lua.set_function("draw_full_map", [&](const std::string & name, int x, int y, int a, sol::function draw_map_callback) {
-        if (current_map_info.name != name) {
-            auto map = find_map(name);
+    set_function("set_map_tile_rules", [&](const std::string & name, sol::table cell_sprites,
+                                           sol::optional<sol::table> light_tints) {
+        auto map = find_map(name);
+        if (map == nullptr) {
+            println("Error, could not find map '{}'", name);
+            return;
+        }
 
-            if (map != nullptr) {
-                current_map_info.map = map;
-                current_map_info.name = name;
-            }
+        map->set_tile_rules(read_tile_rules(cell_sprites, light_tints, map->get_tile_rules()));
+    });
+    set_function("generate_world", [&](const std::string & name, sol::optional<sol::table> options) {
+        auto params = read_map_generation_params(options);
+        const uint64_t seed = params.seed ? *params.seed : random_streams.get("map")();
+        worlds[name] = std::make_unique<ChunkedMap>(name, seed, params);
+    });
+    set_function("update_world", [&](const std::string & name, int x, int y, int radius) {
+        if (auto it = worlds.find(name); it != worlds.end()) it->second->update_residency({x, y}, radius, thread_pool);
+    });
+    set_function("get_world_cell", [&](const std::string & name, int x, int y) {
+        auto it = worlds.find(name);
+        return it != worlds.end() ? int(it->second->get_cell({x, y})) : 0;
+    });
+    set_function("set_world_cell", [&](const std::string & name, int x, int y, int value) {
+        auto it = worlds.find(name);
+        return it != worlds.end() && it->second->set_cell({x, y}, uint8_t(std::clamp(value, 0, 255)));
+    });
+    set_function("set_world_tile_rules", [&](const std::string & name, sol::table cell_sprites,
+                                             sol::optional<sol::table> light_tints) {
+        if (auto it = worlds.find(name); it != worlds.end())
+            it->second->set_tile_rules(read_tile_rules(cell_sprites, light_tints, it->second->get_tile_rules()));
+    });
+    set_draw_function("draw_world_tiles", [&](const std::string & name, const std::string & ss_name, int x, int y,
+                                              int width, int height) {
+        auto it = worlds.find(name);
+        auto ss_it = sprite_sheets.find(ss_name);
+        if (it == worlds.end() || ss_it == sprite_sheets.end() || !ss_it->second) return;
+        it->second->draw_tiles(immediate_renderer(), {x, y}, {width, height}, *ss_it->second);
+    });
+    set_draw_function("draw_world_minimap", [&](const std::string & name, int dest_x, int dest_y, int center_x,
+                                                int center_y, int radius, int pixel_size) {
+        if (auto it = worlds.find(name); it != worlds.end())
+            it->second->draw_minimap(immediate_renderer(), dest_x, dest_y, {center_x, center_y}, radius, pixel_size);
+    });
+    set_draw_function("draw_visible_map_tiles", [&](const std::string & name, const std::string & ss_name,
+                                                    sol::function draw_entity_callback) {
+        if (!select_current_map(name)) return;
+
+        auto ss_it = sprite_sheets.find(ss_name);
+        if (ss_it == sprite_sheets.end() || !ss_it->second) {
+            println("Error, could not find sprite sheet '{}'", ss_name);
+            return;
         }
 
-        if (current_map_info.name == name) {
-            current_map_info.map->draw_map(renderer.get(), current_dimension, x, y, a, [&](int rows, int cols, int cell_id) {
-                auto draw_map_callback_result = draw_map_callback(rows, cols, cell_id);
-                if (!draw_map_callback_result.valid()) {
-                    sol::error err = draw_map_callback_result;
-                    println("Lua script error: {}", err.what());
-                }
-            });
+        current_map_info.map->draw_map_tiles(immediate_renderer(), current_dimension, *ss_it->second);
+        draw_visible_entities(*current_map_info.map, *ss_it->second, draw_entity_callback);
+    });
+    set_draw_function("draw_full_map", [&](const std::string & name, int x, int y, int a,
+                                           sol::function draw_map_callback) {
+        if (select_current_map(name)) {
+            current_map_info.map->draw_map(
+                immediate_renderer(), current_dimension, x, y, a,
+                [&](int rows, int cols, int cell_id) {
+                    auto draw_map_callback_result = draw_map_callback(rows, cols, cell_id);
+                    if (!draw_map_callback_result.valid()) {
+                        sol::error err = draw_map_callback_result;
+                        println("Lua script error: {}", err.what());
+                    }
+                },
+                [&] { sprite_batch.flush(renderer.get()); });
         }
     });
-    lua.set_function("add_entity", [&](const std::string & group_name, const std::string & name, sol::table components,
-                                       sol::this_state s) {
-        auto entity = std::make_shared<Entity>(name);
+    set_function("add_entity", [&](const std::string & group_name, const std::string & name, sol::table components,
+                                   sol::this_state s) {
+        auto entity = entity_manager->make_entity(name);
         auto components_copy = entity_manager->copy_table(components, s);
-        auto lua_component = std::make_shared<LuaComponent>("lua component", components_copy, s);
+        auto lua_component = entity_manager->make_component<LuaComponent>("lua component", components_copy);
         entity->add_component(lua_component);
         entity_manager->add_entity_to_group(group_name, entity, s);
     });
-    lua.set_function("remove_entity", [&](const std::string & entity_group_name, const std::string & entity_id) {
+    set_function("spawn_from_prototype", [&](const std::string & group_name, const std::string & name,
+                                             sol::table prototype, sol::optional<sol::table> overrides,
+                                             sol::this_state s) {
+        auto entity = entity_manager->make_entity(name);
+        entity->add_component(entity_manager->make_component<LuaComponent>(
+            "lua component", entity_manager->instantiate_prototype(prototype, overrides, s)));
+        entity_manager->add_entity_to_group(group_name, entity, s);
+        return entity->get_id();
+    });
+    set_function("remove_entity", [&](const std::string & entity_group_name, const std::string & entity_id) {
         entity_manager->remove_entity(entity_group_name, entity_id);
     });
-    lua.set_function("remove_component", [&](const std::string & entity_group_name, const std::string & entity_name,
-                                             const std::string & component_name) {
+    set_function("set_entity_position", [&](const std::string & entity_group_name, const std::string & entity_id,
+                                            int x, int y) {
+        return entity_manager->set_entity_position(entity_group_name, entity_id, x, y);
+    });
+    set_function("query", [&](const std::vector<std::string> & components,
+                              const sol::optional<std::string> & entity_group, sol::this_state s) {
+        return entity_manager->query(components, entity_group.value_or(""), s);
+    });
+    set_function("remove_component", [&](const std::string & entity_group_name, const std::string & entity_name,
+                                         const std::string & component_name) {
         entity_manager->remove_lua_component(entity_group_name, entity_name, component_name);
     });
-    lua.set_function("get_component_value",
-                     [&](const std::string & entity_group_name, const std::string & entity_name,
-                         const std::string & component_name, const std::string & key, sol::this_state s) {
-                         sol::state_view lua(s);
-                         auto entity = entity_manager->get_entity_by_name(entity_group_name, entity_name);
-                         if (entity != nullptr) {
-                             auto component = entity->find_first_component_by_type<LuaComponent>();
-                             if (component != nullptr) {
-                                 auto lua_component = component->get_property<sol::table>(component_name);
-
-                                 if (lua_component != sol::nil) { return (sol::object)lua_component[key]; }
-                             }
+    set_function("get_component_value",
+                 [&](const std::string & entity_group_name, const std::string & entity_name,
+                     const std::string & component_name, const std::string & key) {
+                     auto entity = entity_manager->get_entity_by_name(entity_group_name, entity_name);
+                     if (entity != nullptr) {
+                         auto * component = entity->get_component<LuaComponent>();
+                         if (component != nullptr) {
+                             auto lua_component = component->get_property<sol::table>(component_name);
+
+                             if (lua_component != sol::nil) { return (sol::object)lua_component[key]; }
                          }
-                         return (sol::object)lua.create_table();
-                     });
-    lua.set_function("set_component_value", [&](const std::string & entity_group_name, const std::string & entity_name,
-                                                const std::string & component_name, const std::string & key,
-                                                sol::object value, sol::this_state) {
+                     }
+                     return (sol::object)sol::lua_nil;
+                 });
+    set_function("set_component_value", [&](const std::string & entity_group_name, const std::string & entity_name,
+                                            const std::string & component_name, const std::string & key,
+                                            sol::object value, sol::this_state) {
         auto entity = entity_manager->get_entity_by_name(entity_group_name, entity_name);
         if (entity != nullptr) {
-            auto component = entity->find_first_component_by_type<LuaComponent>();
+            auto * component = entity->get_component<LuaComponent>();
             if (component != nullptr) {
                 auto lua_component = component->get_property<sol::table>(component_name);
                 if (lua_component != sol::nil) { lua_component.set(key, value); }
+                entity_manager->bind_native_components(entity_group_name, entity);
             }
         }
     });
-    lua.set_function("update_player_viewport", [&](int x, int y, int width, int height) {
+    set_function("update_player_viewport", [&](int x, int y, int width, int height) {
         current_dimension = update_player_viewport(
             {x, y}, {current_map_info.map->get_width(), current_map_info.map->get_height()}, {width, height});
     });
-    lua.set_function("get_text_extents", [&](const std::string & t, sol::this_state s) {
-        sol::state_view lua(s);
-        sol::table extents_table = lua.create_table();
-        if (!default_font.expired()) {
-            auto extents = default_font.lock()->get_text_extents(t);
-            extents_table.set("width", extents.width);
-            extents_table.set("height", extents.height);
-        }
-        return extents_table;
-    });
-    lua.set_function("add_system", [&](const std::string & name, sol::function system_callback) {
-        systems.try_emplace(name, system_callback);
-    });
-    lua.set_function("get_random_key_from_table", [&](sol::table table) {
-        std::string ret;
-        if (table.valid() && !table.empty()) {
-            int ctr = 0, size = 0;
-            table.for_each([&](const sol::object &, const sol::object &) { ++size; });
-            const int idx = size == 1 ? 0 : generate_random_int(0, size - 1);
-            table.for_each([&](const sol::object & key, const sol::object &) {
-                if (ctr++ == idx)
-                    ret = key.as<std::string>();
-            });
+    set_function("get_text_extents", [&](const std::string & t) {
+        // 0 by 0 without a font (eg headless), so layout arithmetic in the script still works
+        const auto font = default_font.lock();
+        return font ? font->get_text_extents(t) : Size{};
+    });
+    set_function("add_system", [&](const std::string & name, sol::function system_callback,
+                                   sol::optional<sol::table> schedule) {
+        // Systems added without a schedule keep running the way the fixed 6 fps loop used to run them
+        ScheduledSystem system{.name = name, .callback = system_callback};
+        if (name == "render_system") system.rate = SystemRate::Render;
+        else if (name == "keyboard_input_system") system.rate = SystemRate::Input;
+        else if (name == "tick_system") system.period = 1.0;
+
+        if (schedule) {
+            const auto names = [&](const char * key) {
+                return schedule->get<sol::optional<std::vector<std::string>>>(key).value_or(std::vector<std::string>{});
+            };
+            system.reads = names("reads");
+            system.writes = names("writes");
+            system.after = names("after");
+
+            static const std::unordered_map<std::string, SystemRate> rates{{"frame", SystemRate::Frame},
+                                                                          {"fixed", SystemRate::Fixed},
+                                                                          {"turn", SystemRate::Turn},
+                                                                          {"input", SystemRate::Input},
+                                                                          {"render", SystemRate::Render}};
+            if (auto rate = schedule->get<sol::optional<std::string>>("rate")) {
+                auto it = rates.find(*rate);
+                if (it == rates.end()) {
+                    println("Error, unknown rate '{}' for system '{}'", *rate, name);
+                    return false;
+                }
+                system.rate = it->second;
+                system.period = 0;
+            }
+            if (auto hz = schedule->get<sol::optional<double>>("hz"); hz && *hz > 0) system.period = 1.0 / *hz;
         }
-        return ret;
+
+        if (!scheduler.add(std::move(system))) {
+            println("Error, system '{}' is already added or its 'after' list makes a cycle", name);
+            return false;
+        }
+        return true;
+    });
+    set_function("get_system_order", [&]() { return sol::as_table(scheduler.get_order()); });
+    set_function("set_profiler_enabled", [&](bool on) {
+        Profiler::get().set_enabled(on || Profiler::get().is_tracing());
+        if (!on) profiler_overlay = false;
     });
-    lua.set_function("find_entity_with_name", [&](const std::string & group_name, const std::string & name) {
+    set_function("set_profiler_overlay", [&](bool on) {
+        profiler_overlay = on;
+        if (on) Profiler::get().set_enabled(true);
+    });
+    set_function("start_profiler_trace", [&]() {
+        Profiler::get().set_enabled(true);
+        Profiler::get().start_trace();
+    });
+    set_function("write_profiler_trace", [&](const std::string & path) {
+        const bool written = Profiler::get().write_trace(path);
+        if (!written) println("Error, could not write profiler trace to '{}'", path);
+        Profiler::get().set_enabled(profiler_overlay);
+        return written;
+    });
+    set_function("get_profiler_stats", [&](sol::this_state s) {
+        sol::state_view lua(s);
+        const auto stats = Profiler::get().get_last_frame();
+        sol::table zones = lua.create_table();
+        for (const auto & zone : stats.zones)
+            zones.add(lua.create_table_with("name", zone.name, "ms", zone.total_ms, "calls", zone.calls));
+        sol::table counters = lua.create_table();
+        for (const auto & [name, value] : stats.counters) counters[name] = value;
+        return lua.create_table_with("frame_ms", stats.frame_ms, "zones", zones, "counters", counters);
+    });
+    set_function("get_random_key_from_table", [&](sol::table table, sol::optional<std::string> stream) {
+        if (!table.valid() || table.empty()) return std::string{};
+        // Sorted, since Lua's iteration order over string keys differs between runs and a seeded stream has to pick
+        // the same key every time
+        std::vector<std::string> keys;
+        table.for_each([&](const sol::object & key, const sol::object &) { keys.push_back(key.as<std::string>()); });
+        std::ranges::sort(keys);
+        if (keys.size() == 1) return keys.front();
+        return keys[size_t(random_streams.get(stream.value_or("default")).uniform_int(0, int64_t(keys.size()) - 1))];
+    });
+    set_function("find_entity_with_name", [&](const std::string & group_name, const std::string & name) {
         return entity_manager->get_lua_entity(group_name, name);
     });
-    lua.set_function("get_overlapping_points",
-                     [&](const std::string & entity_name, int x, int y, sol::function point_callback) {
-                         return entity_manager->lua_for_each_overlapping_point(entity_name, x, y, point_callback);
-                     });
-    lua.set_function("get_blocked_points", [&](const std::string & entity_group, int x, int y,
-                                               const std::string & direction, sol::this_state s) {
-        auto blocked_points = entity_manager->get_lua_blocked_points(entity_group, x, y, direction, s);
-        if (!blocked_points.empty() && current_map_info.map != nullptr) { current_map_info.map->trigger_redraw(); }
-        return blocked_points;
-    });
-    lua.set_function("is_within_viewport", [&](int x, int y) { return is_within_viewport(x, y); });
-    lua.set_function("force_redraw_map", [&]() {
+    set_function("subscribe_event", [&](const std::string & type, sol::function callback) {
+        entity_manager->get_events().subscribe(type, std::move(callback));
+    });
+    set_function("publish_event", [&](const std::string & type, sol::optional<sol::table> data, sol::this_state s) {
+        if (!entity_manager->get_events().is_wanted(type)) return;
+        // A shallow copy, so the caller's table is left alone and the entity tables in it stay the entities' own
+        sol::table event = sol::state_view(s).create_table();
+        if (data)
+            data->for_each([&](const sol::object & key, const sol::object & value) { event.raw_set(key, value); });
+        event["type"] = type;
+        entity_manager->get_events().publish({.type = type, .data = event});
+    });
+    set_function("get_overlapping_points",
+                 [&](const std::string & entity_name, int x, int y, sol::function point_callback) {
+                     return entity_manager->lua_for_each_overlapping_point(entity_name, x, y, point_callback);
+                 });
+    set_function("get_blocked_points", [&](const std::string & entity_group, int x, int y,
+                                           const std::string & direction, sol::this_state s) {
+        return entity_manager->get_lua_blocked_points(entity_group, x, y, direction, s);
+    });
+    set_function("is_within_viewport", [&](int x, int y) { return is_within_viewport(x, y); });
+    set_function("force_redraw_map", [&]() {
         if (current_map_info.map != nullptr) { current_map_info.map->trigger_redraw(); }
     });
-    lua.set_function("add_font", [&](const std::string & name, const std::string & font_path, int font_size) {
-        auto text = std::make_shared<Text>();
-        text->load_font(font_path, font_size);
-        texts.try_emplace(name, text);
-        default_font = text;
+    set_function("add_font", [&](const std::string & name, const std::string & font_path, int font_size) {
+        default_font = texts.try_emplace(name, std::make_shared<Text>()).first->second;
+        // Headless engines don't initialize SDL_ttf. Until the font has loaded, its text is drawn as nothing.
+        if (renderer)
+            request_asset({.kind = AssetLoader::Kind::Font, .name = name, .path = font_path, .size = font_size});
     });
-    lua.set_function("set_font", [&](const std::string & name) {
+    // How many of the assets asked for so far (by the config and add_font) are loaded and ready: loaded, total
+    set_function("get_asset_progress", [&]() { return std::make_tuple(assets_installed, assets_requested); });
+    set_function("set_font", [&](const std::string & name) {
         auto it = texts.find(name);
         if (it != texts.end()) { default_font = it->second; }
     });
-    lua.set_function("get_adjacent_points", [&](int x, int y, sol::this_state s) {
-        sol::state_view lua(s);
-        std::vector<Point> points = {/* UP    */ {x, y - 1},
-                                                      /* DOWN  */ {x, y + 1},
-                                                      /* LEFT  */ {x - 1, y},
-                                                      /* RIGHT */ {x + 1, y}};
-
-        auto is_up_blocked = entity_manager->lua_is_point_unique(points[0]) &&
-                             current_map_info.map->is_point_blocked(points[0].x, points[0].y);
-        auto is_down_blocked = entity_manager->lua_is_point_unique(points[1]) &&
-                               current_map_info.map->is_point_blocked(points[1].x, points[1].y);
-        auto is_left_blocked = entity_manager->lua_is_point_unique(points[2]) &&
-                               current_map_info.map->is_point_blocked(points[2].x, points[2].y);
-        auto is_right_blocked = entity_manager->lua_is_point_unique(points[3]) &&
-                                current_map_info.map->is_point_blocked(points[3].x, points[3].y);
-        entity_manager->lua_is_point_unique(points[3]) &&
-            current_map_info.map->is_point_blocked(points[3].x, points[3].y);
-
-        sol::table adjacent_points = lua.create_table_with(
-            "up", lua.create_table_with("blocked", is_up_blocked, "x", points[0].x, "y", points[0].y), "down",
-            lua.create_table_with("blocked", is_down_blocked, "x", points[1].x, "y", points[1].y), "left",
-            lua.create_table_with("blocked", is_left_blocked, "x", points[2].x, "y", points[2].y), "right",
-            lua.create_table_with("blocked", is_right_blocked, "x", points[3].x, "y", points[3].y));
-        return adjacent_points;
-    });
-    lua.set_function("map_to_world", [&](int x, int y, const std::string & ss_name, sol::this_state s) {
-        sol::state_view lua(s);
-        sol::table table = lua.create_table();
-        if (auto ss_it = sprite_sheets.find(ss_name); ss_it != sprite_sheets.end()) {
-            auto point = ss_it->second->map_to_world(x, y, current_dimension);
-            table.set("x", point.x);
-            table.set("y", point.y);
-        }
-        return table;
+    set_function("get_adjacent_points", [&](int x, int y) {
+        const auto adjacent = [&](int ax, int ay) {
+            return AdjacentPoint{.x = ax, .y = ay, .blocked = entity_manager->lua_is_point_unique({ax, ay}) &&
+                                                              current_map_info.map->is_point_blocked(ax, ay)};
+        };
+        return AdjacentPoints{.up = adjacent(x, y - 1), .down = adjacent(x, y + 1), .left = adjacent(x - 1, y),
+                              .right = adjacent(x + 1, y)};
     });
-    lua.set_function("set_highlight_color", [&](const std::string & ss_name, int r, int g, int b) {
+    set_function("map_to_world", [&](int x, int y, const std::string & ss_name) -> sol::optional<Point> {
+        if (auto ss_it = sprite_sheets.find(ss_name); ss_it != sprite_sheets.end())
+            return ss_it->second->map_to_world(x, y, current_dimension);
+        return sol::nullopt;
+    });
+    set_draw_function("set_highlight_color", [&](const std::string & ss_name, int r, int g, int b) {
         if (auto it = sprite_sheets.find(ss_name); it != sprite_sheets.end())
             it->second->set_highlight_color(Uint8(r), Uint8(g), Uint8(b));
     });
-    lua.set_function("reset_highlight_color", [&](const std::string & ss_name) {
-        if (auto it = sprite_sheets.find(ss_name); it != sprite_sheets.end()) {
-            it->second->reset_highlight_color();
-            if (current_map_info.map != nullptr) { current_map_info.map->trigger_redraw(); }
-        }
+    set_draw_function("reset_highlight_color", [&](const std::string & ss_name) {
+        if (auto it = sprite_sheets.find(ss_name); it != sprite_sheets.end()) it->second->reset_highlight_color();
     });
+
+    // Views of the engine's own arrays for LuaJIT's FFI, only there when the ffi library is. A script casts the
+    // pointers (eg ffi.cast("const int32_t *", view.cells)) and indexes them from 0 in loops the JIT compiles, instead
+    // of calling a binding per cell or entity. They are read only: writing through them skips the redraw, distance
+    // field and spatial index bookkeeping. They stay valid until the map is regenerated or an entity is added, removed
+    // or gains or loses a position, so fetch them again each time a system runs rather than keeping them.
+    if (lua["ffi"].valid()) {
+        static_assert(sizeof(int) == sizeof(int32_t), "the FFI views are documented as int32_t arrays");
+        // The views are const in spirit only, Lua light userdata can't carry that
+        const auto view_of = [](const auto * data) { return static_cast<void *>(const_cast<int *>(data)); };
+
+        set_function("get_map_view", [&, view_of](const std::string & name, sol::this_state s) -> sol::object {
+            const auto map = find_map(name);
+            if (map == nullptr) return sol::lua_nil;
+            // Row-major, the cell at (x, y) is at y * width + x
+            return sol::state_view(s).create_table_with(
+                "cells", view_of(map->get_map()->data()), "light", view_of(map->get_light_map()->data()), "width",
+                map->get_width(), "height", map->get_height());
+        });
+        set_function("get_position_view", [&, view_of](sol::this_state s) {
+            const auto & positions = entity_manager->get_native_components().positions;
+            return sol::state_view(s).create_table_with("x", view_of(positions.column<0>().data()), "y",
+                                                        view_of(positions.column<1>().data()), "count",
+                                                        positions.size());
+        });
+        set_function("get_position_owner", [&](size_t slot) -> sol::optional<std::string> {
+            const auto & owners = entity_manager->get_native_components().positions.owners();
+            if (slot >= owners.size()) return sol::nullopt;
+            return owners[slot]->get_id();
+        });
+    }
 }
 
 } // namespace roguely
@@ -1,14 +1,31 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <deque>
 #include <format>
 #include <functional>
 #include <iostream>
+#include <list>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <random>
 #include <set>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -19,7 +36,15 @@
 #include <SDL2/SDL_mixer.h>
 #include <SDL2/SDL_ttf.h>
 #include <mpg123.h>
+// All of sol2's checks are on unless the build turns them off (cmake -DROGUELY_LUA_SAFETY=OFF), which stops every
+// binding from checking what the script passes it. Lua functions are still called protected, so script errors are
+// reported either way.
+#ifndef SOL_ALL_SAFETIES_ON
 #define SOL_ALL_SAFETIES_ON 1
+#endif
+#ifndef SOL_SAFE_FUNCTIONS
+#define SOL_SAFE_FUNCTIONS 1
+#endif
 #include <sol/sol.hpp>
 
 namespace roguely {
@@ -35,6 +60,15 @@ namespace detail {
         void operator()(SDL_Window *) const;
         void operator()(TTF_Font *) const;
     };
+
+    // Hands out a small dense id per component type, used to index an Entity's typed component slots
+    size_t next_component_type_id();
+
+    template <typename T>
+    size_t component_type_id() {
+        static const size_t id = next_component_type_id();
+        return id;
+    }
 } // namespace detail
 
 template <typename T>
@@ -47,29 +81,215 @@ class Id {
 public:
     Id() : id{nextId++} {}
 
+    // Makes sure ids generated from now on are greater than id, eg after restoring saved entities
+    static void reserve_through(size_t id);
+
     std::string to_string() const;
     size_t get() const { return id; }
 };
 
 std::string generate_uuid();
 
+namespace detail {
+// SplitMix64 step: advances state and returns the next well mixed 64 bit value. Used to expand seeds, and cheap enough
+// to act as a per-row generator so parallel work stays deterministic no matter how rows are split across threads.
+inline uint64_t splitmix64(uint64_t & state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+} // namespace detail
+
+// xoshiro256** pseudo random generator; satisfies UniformRandomBitGenerator so it also works with <random>
+class RandomStream {
+public:
+    using result_type = uint64_t;
+
+    explicit RandomStream(uint64_t seed = 0) { reseed(seed); }
+
+    void reseed(uint64_t seed) {
+        for (auto & word : state) word = detail::splitmix64(seed);
+    }
+
+    result_type operator()() {
+        const uint64_t result = rotl(state[1] * 5, 7) * 9;
+        const uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+    // Uniform integer in the inclusive range [lo, hi], without modulo bias
+    int64_t uniform_int(int64_t lo, int64_t hi);
+    // Uniform double in [0, 1)
+    double uniform_real() { return double((*this)() >> 11) * 0x1.0p-53; }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    std::array<uint64_t, 4> state{};
+};
+
+// Named RandomStreams, one per subsystem ("map", "spawn", "mobs", ...), so that drawing more numbers in one doesn't
+// shift the sequence of another. Each stream's seed is derived from the master seed and its name alone, so one master
+// seed reproduces every stream regardless of the order they are first used in.
+class RandomStreams {
+public:
+    explicit RandomStreams(uint64_t master_seed) : master_seed(master_seed) {}
+
+    // Returns the named stream, creating it on first use
+    RandomStream & get(const std::string & name);
+    // Restarts every stream from a new master seed
+    void reseed(uint64_t new_master_seed);
+    uint64_t get_master_seed() const { return master_seed; }
+
+private:
+    static uint64_t stream_seed(uint64_t master_seed, const std::string & name);
+
+    uint64_t master_seed;
+    std::unordered_map<std::string, RandomStream> streams;
+};
+
+// Frame profiler: scoped timers and counters, summed per frame, plus an optional Chrome trace of every timed scope
+// (load the written file in chrome://tracing or ui.perfetto.dev). Off by default and switched at runtime; while off a
+// Scope costs one relaxed atomic load. There is one, shared app wide, so code anywhere can time itself without having
+// the engine passed in. Safe to use from worker threads.
+class Profiler {
+public:
+    static Profiler & get();
+
+    // Times from construction to destruction under name
+    class Scope {
+    public:
+        explicit Scope(std::string_view scope_name) {
+            if (!Profiler::get().is_enabled()) return;
+            name = scope_name;
+            start = clock::now();
+        }
+        ~Scope() {
+            if (start) Profiler::get().record(name, *start, clock::now());
+        }
+        Scope(const Scope &) = delete;
+        Scope & operator=(const Scope &) = delete;
+
+    private:
+        std::string name; // a copy, taken only while profiling; what it came from may go while the scope is open
+        std::optional<std::chrono::steady_clock::time_point> start;
+    };
+
+    struct ZoneStats {
+        std::string name;
+        double total_ms{};
+        uint32_t calls{};
+    };
+    struct FrameStats {
+        double frame_ms{};
+        std::vector<ZoneStats> zones; // slowest first
+        std::vector<std::pair<std::string, int64_t>> counters;
+    };
+
+    bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+    void set_enabled(bool on);
+
+    // Adds n to a counter for the current frame
+    void count(std::string_view counter, int64_t n = 1);
+
+    // Frame boundaries: end_frame publishes what was gathered since begin_frame as the last frame's stats
+    void begin_frame();
+    void end_frame();
+    FrameStats get_last_frame() const;
+
+    // Starts keeping every timed scope (up to max_trace_events) until write_trace
+    void start_trace();
+    bool is_tracing() const;
+    // Stops tracing and writes what was kept as Chrome trace event JSON; false if it couldn't be written
+    bool write_trace(const std::string & path);
+
+    static constexpr size_t max_trace_events = 1 << 20;
+
+private:
+    using clock = std::chrono::steady_clock;
+    struct Zone {
+        double total_ms{};
+        uint32_t calls{};
+    };
+    struct TraceEvent {
+        std::string name;
+        int64_t start_us{};
+        int64_t duration_us{};
+        uint32_t thread{};
+        char phase{}; // 'X' for a timed scope, 'C' for a counter sample
+    };
+
+    void record(std::string_view name, clock::time_point start, clock::time_point end);
+    uint32_t thread_index(); // call with mutex held
+
+    // Keyed by copies of the names, so nothing dangles when a system is renamed or its string goes away; looking a
+    // name up by string_view doesn't allocate
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view name) const { return std::hash<std::string_view>{}(name); }
+    };
+    template <typename T>
+    using NameMap = std::unordered_map<std::string, T, NameHash, std::equal_to<>>;
+    template <typename T>
+    static T & entry(NameMap<T> & map, std::string_view name) {
+        if (auto it = map.find(name); it != map.end()) return it->second;
+        return map.try_emplace(std::string(name)).first->second;
+    }
+
+    std::atomic_bool enabled{};
+    mutable std::mutex mutex;
+    clock::time_point epoch{clock::now()};
+    clock::time_point frame_start{};
+    NameMap<Zone> zones;
+    NameMap<int64_t> counters;
+    FrameStats last_frame;
+    bool tracing{};
+    std::vector<TraceEvent> trace;
+    std::vector<std::thread::id> threads; // index is the trace's tid
+};
+
 template<typename ...Args>
 void println(std::format_string<Args...> fmt, Args && ...args) {
     std::cout << std::format(std::move(fmt), std::forward<Args>(args)...) << std::endl;
 }
 
+// Dense 2D matrix stored as a single row-major buffer. operator() is unchecked and meant for the hot loops (map
+// generation, field of view, path finding, drawing); use at() wherever indices come from untrusted input (e.g. Lua).
 template <typename T>
 class GenericMatrix {
     size_t nr{}, nc{};
-    std::vector<std::vector<T>> rows;
+    std::vector<T> cells;
 public:
     GenericMatrix() {}
-    GenericMatrix(size_t nrows, size_t ncols, const T & fill = {}) : nr{nrows}, nc{ncols}, rows(nrows, std::vector<T>(ncols, fill)) {}
-    T & operator()(size_t r, size_t c) { return rows.at(r).at(c); }
-    const T & operator()(size_t r, size_t c) const { return rows.at(r).at(c); }
+    GenericMatrix(size_t nrows, size_t ncols, const T & fill = {}) : nr{nrows}, nc{ncols}, cells(nrows * ncols, fill) {}
+    T & operator()(size_t r, size_t c) { return cells[r * nc + c]; }
+    const T & operator()(size_t r, size_t c) const { return cells[r * nc + c]; }
+    T & at(size_t r, size_t c) { check_bounds(r, c); return cells[r * nc + c]; }
+    const T & at(size_t r, size_t c) const { check_bounds(r, c); return cells[r * nc + c]; }
+    bool in_bounds(long long r, long long c) const { return r >= 0 && c >= 0 && size_t(r) < nr && size_t(c) < nc; }
+    std::span<T> row(size_t r) { return {cells.data() + r * nc, nc}; }
+    std::span<const T> row(size_t r) const { return {cells.data() + r * nc, nc}; }
+    T * data() { return cells.data(); }
+    const T * data() const { return cells.data(); }
     size_t size1() const { return nr; }
     size_t size2() const { return nc; }
-    void clear() { *this = GenericMatrix<T>(nr, nc); }
+    void fill(const T & value) { std::fill(cells.begin(), cells.end(), value); }
+    void clear() { fill(T{}); }
+
+private:
+    void check_bounds(size_t r, size_t c) const {
+        if (r >= nr || c >= nc)
+            throw std::out_of_range(std::format("Matrix index ({}, {}) out of range ({}, {})", r, c, nr, nc));
+    }
 };
 
 using Matrix = GenericMatrix<int>;
@@ -95,29 +315,54 @@ struct Dimension {
     bool operator!=(const Dimension & d) const { return !(*this == d); }
 
     Point point{};
-    Point supplemental_point{}; // this is a hack for our Janky map drawing
-                                // optimization
+    Point supplemental_point{}; // the player, which the field of view is cast from
     Size size{};
 };
 
+// A neighbouring cell, as get_adjacent_points hands them to Lua
+struct AdjacentPoint {
+    int x{};
+    int y{};
+    bool blocked{};
+};
+
+struct AdjacentPoints {
+    AdjacentPoint up, down, left, right;
+};
+
 struct Sound {
     std::string name;
     UPtr<Mix_Chunk> sound;
     void play() { if (sound) Mix_PlayChannel(-1, sound.get(), 0); }
 };
 
+// Renders strings with a TTF font. Rendered strings are kept in an LRU cache keyed by (text, rgb) -- alpha is
+// applied at draw time through the texture's alpha mod -- so text that is drawn every frame is only rasterized once.
 class Text {
 public:
     int load_font(const std::string & path, int ptsize);
+    // Opens the font from the contents of its file, which are kept for as long as the font is open
+    int load_font(std::vector<char> data, int ptsize);
     void draw_text(SDL_Renderer * renderer, int x, int y, const std::string & text);
     void draw_text(SDL_Renderer * renderer, int x, int y, const std::string & text, SDL_Color color);
     Size get_text_extents(const std::string & text);
 
+    void set_cache_capacity(size_t capacity);
+
 private:
+    struct RenderedText {
+        std::string key;
+        UPtr<SDL_Texture> texture;
+        int width{};
+        int height{};
+    };
+
+    std::vector<char> font_data; // what font was opened from, if it was opened from memory
     UPtr<TTF_Font> font;
-    std::string text;
-    UPtr<SDL_Texture> text_texture;
-    SDL_Rect text_rect{};
+    size_t cache_capacity{256};
+    std::list<RenderedText> lru; // most recently used at the front
+    std::unordered_map<std::string, std::list<RenderedText>::iterator> cache;
+    std::string key_scratch; // reused to build lookup keys without allocating
 
     SDL_Color text_color{.r = 255, .g = 255, .b = 255, .a = 255};
     SDL_Color text_background_color{.r = 0, .g = 0, .b = 0, .a = 255};
@@ -196,11 +441,29 @@ public:
         return matches;
     }
 
+    // Returns the first component that was added with static type T. Unlike find_first_component_by_type this is a
+    // plain load: no dynamic casts, no shared_ptr copy. The pointer is valid for as long as the entity keeps the
+    // component.
+    template <ComponentType T>
+    T * get_component() const {
+        const size_t type_id = detail::component_type_id<T>();
+        return type_id < typed_components.size() ? static_cast<T *>(typed_components[type_id]) : nullptr;
+    }
+
     auto get_name() const { return name; }
     auto get_id() const { return id; }
-    void add_component(const std::shared_ptr<Component> & c) { components.push_back(c); }
+
+    // Components added through a shared_ptr to their concrete type also become reachable through get_component<T>
+    template <ComponentType T>
+    void add_component(const std::shared_ptr<T> & c) {
+        if constexpr (std::is_same_v<T, Component>) {
+            add_component_with_type_id(c, no_type_id);
+        } else {
+            add_component_with_type_id(c, detail::component_type_id<T>());
+        }
+    }
     void add_components(const std::vector<std::shared_ptr<Component>> & c) {
-        components.insert(components.end(), c.begin(), c.end());
+        for (auto & component : c) add_component_with_type_id(component, no_type_id);
     }
 
     template <ComponentType T>
@@ -212,18 +475,50 @@ public:
     template <ComponentType T>
     void remove_component(const std::shared_ptr<T> & component) {
         auto it = std::find(components.begin(), components.end(), component);
-        if (it != components.end()) it = components.erase(it);
+        if (it == components.end()) return;
+
+        const auto idx = size_t(it - components.begin());
+        const size_t type_id = component_type_ids[idx];
+        components.erase(it);
+        component_type_ids.erase(component_type_ids.begin() + idx);
+
+        // If this was the slotted component for its type, promote the next one of the same type (if any)
+        if (type_id != no_type_id && typed_components[type_id] == component.get()) {
+            typed_components[type_id] = nullptr;
+            for (size_t i = 0; i < components.size(); ++i) {
+                if (component_type_ids[i] == type_id) {
+                    typed_components[type_id] = components[i].get();
+                    break;
+                }
+            }
+        }
     }
 
     void for_each_component(const std::function<void(const std::shared_ptr<Component> &)> & fc) const {
         for (auto & c : components) fc(c);
     }
 
-    void clear_components() { components.clear(); }
+    void clear_components() {
+        components.clear();
+        component_type_ids.clear();
+        typed_components.clear();
+    }
     size_t get_component_count() const { return components.size(); }
 
 private:
+    static constexpr size_t no_type_id = size_t(-1);
+
+    void add_component_with_type_id(const std::shared_ptr<Component> & c, size_t type_id) {
+        components.push_back(c);
+        component_type_ids.push_back(type_id);
+        if (type_id == no_type_id) return;
+        if (type_id >= typed_components.size()) typed_components.resize(type_id + 1u, nullptr);
+        if (typed_components[type_id] == nullptr) typed_components[type_id] = c.get();
+    }
+
     std::string id{};
+    std::vector<size_t> component_type_ids;   // parallel to components; no_type_id for untyped adds
+    std::vector<Component *> typed_components; // indexed by detail::component_type_id<T>()
 
 protected:
     std::string name;
@@ -233,13 +528,229 @@ protected:
 struct EntityGroup {
     std::string name{};
     std::shared_ptr<std::vector<std::shared_ptr<Entity>>> entities{};
+    // Lookup tables over entities; always add and remove through the functions below so they stay consistent
+    struct Slot {
+        size_t index{};                             // into entities
+        std::list<std::string>::iterator name_it{}; // the id's place in ids_by_name, so removal needn't search for it
+    };
+    std::unordered_map<std::string, Slot> slot_by_id{};                    // entity id -> where it is kept
+    std::unordered_map<std::string, std::list<std::string>> ids_by_name{}; // entity name -> ids, oldest first
+
+    void add(const std::shared_ptr<Entity> & e);
+    // Swap-and-pop removal, so the order of entities is not preserved. Returns the removed entity (if any).
+    std::shared_ptr<Entity> remove(const std::string & entity_id);
+    std::shared_ptr<Entity> find_by_id(const std::string & entity_id) const {
+        auto it = slot_by_id.find(entity_id);
+        return it != slot_by_id.end() ? (*entities)[it->second.index] : nullptr;
+    }
+    // Returns the oldest entity with this name
+    std::shared_ptr<Entity> find_by_name(const std::string & entity_name) const {
+        auto it = ids_by_name.find(entity_name);
+        return it != ids_by_name.end() ? find_by_id(it->second.front()) : nullptr;
+    }
+};
+
+// Dense structure-of-arrays storage for one native component type: slot i of every field column belongs to
+// owners()[i]. Removal moves the last slot into the hole, so the columns stay contiguous and fully used.
+template <typename... Fields>
+class ComponentPool {
+public:
+    template <size_t I>
+    using field_type = std::tuple_element_t<I, std::tuple<Fields...>>;
+
+    size_t size() const { return owner_list.size(); }
+    const std::vector<const Entity *> & owners() const { return owner_list; }
+
+    template <size_t I>
+    std::vector<field_type<I>> & column() { return std::get<I>(columns); }
+    template <size_t I>
+    const std::vector<field_type<I>> & column() const { return std::get<I>(columns); }
+
+    std::optional<size_t> slot(const Entity * e) const {
+        auto it = slots.find(e);
+        return it != slots.end() ? std::optional<size_t>(it->second) : std::nullopt;
+    }
+
+    // Adds e, or overwrites its fields if it's already here; returns its slot
+    size_t set(const Entity * e, Fields... values) {
+        auto [it, inserted] = slots.try_emplace(e, owner_list.size());
+        if (inserted) owner_list.push_back(e);
+        assign(it->second, inserted, std::index_sequence_for<Fields...>{}, values...);
+        return it->second;
+    }
+
+    void remove(const Entity * e) {
+        auto it = slots.find(e);
+        if (it == slots.end()) return;
+        const size_t hole = it->second, last = owner_list.size() - 1u;
+        slots.erase(it);
+        if (hole != last) {
+            owner_list[hole] = owner_list[last];
+            slots[owner_list[hole]] = hole;
+        }
+        owner_list.pop_back();
+        swap_and_pop(hole, last, std::index_sequence_for<Fields...>{});
+    }
+
+    void clear() {
+        owner_list.clear();
+        slots.clear();
+        std::apply([](auto &... column) { (column.clear(), ...); }, columns);
+    }
+
+private:
+    template <size_t... I>
+    void assign(size_t slot, bool append, std::index_sequence<I...>, Fields... values) {
+        if (append) (std::get<I>(columns).push_back(values), ...);
+        else ((std::get<I>(columns)[slot] = values), ...);
+    }
+
+    template <size_t... I>
+    void swap_and_pop(size_t hole, size_t last, std::index_sequence<I...>) {
+        ((std::get<I>(columns)[hole] = std::get<I>(columns)[last], std::get<I>(columns).pop_back()), ...);
+    }
+
+    std::vector<const Entity *> owner_list;
+    std::tuple<std::vector<Fields>...> columns;
+    std::unordered_map<const Entity *, size_t> slots;
+};
+
+// The hot entity fields, kept natively so C++ can scan them without touching the Lua VM. Lua still reads and writes
+// them as plain fields of the entity's component tables: EntityManager moves the raw values into these pools and gives
+// each such table a metatable that forwards those keys here.
+struct NativeComponents {
+    ComponentPool<int, int> positions;    // position_component.x, .y
+    ComponentPool<uint8_t> blocking;      // position_component.blocking; other entities can't step onto blocking ones
+    ComponentPool<double, double> health; // stats_component.health, .max_health (NaN if nil), as Lua set them
+    ComponentPool<int> sprites;           // sprite_component.sprite_id
+
+    void remove(const Entity * e) {
+        positions.remove(e);
+        blocking.remove(e);
+        health.remove(e);
+        sprites.remove(e);
+    }
+};
+
+// Buckets entities by the map tile they stand on so that point and area queries only touch the entities that are
+// actually there. EntityManager keeps this in sync as entities with a position_component are added, moved or removed.
+class SpatialIndex {
+public:
+    struct Entry {
+        std::shared_ptr<Entity> entity;
+        std::string group_name;
+    };
+
+    void insert(const Point & p, const std::shared_ptr<Entity> & e, const std::string & group_name);
+    void remove(const Point & p, const Entity * e);
+    void move(const Point & from, const Point & to, const Entity * e);
+    void clear() {
+        cells.clear();
+        count = 0;
+        changes.all = true;
+    }
+
+    // The tiles whose occupants changed since the last call, for redrawing only those. all is set instead when there
+    // were too many to keep track of, or the index was cleared.
+    struct Changes {
+        std::vector<Point> tiles;
+        bool all{};
+    };
+    Changes take_changes() { return std::exchange(changes, {}); }
+    static constexpr size_t max_tracked_changes = 4096;
+
+    // Returns the entities on tile p, or nullptr if there are none
+    const std::vector<Entry> * at(const Point & p) const {
+        auto it = cells.find(key(p));
+        return it != cells.end() ? &it->second : nullptr;
+    }
+
+    // Calls func(point, entry) for every entity within the inclusive rectangle [top_left, bottom_right]
+    template <typename Func>
+    void for_each_in_rect(const Point & top_left, const Point & bottom_right, Func && func) const {
+        if (top_left.x > bottom_right.x || top_left.y > bottom_right.y) return;
+        const auto area = size_t(bottom_right.x - top_left.x + 1) * size_t(bottom_right.y - top_left.y + 1);
+        if (area > cells.size()) {
+            // Fewer occupied tiles than tiles in the rectangle, so just walk the occupied ones
+            for (const auto & [k, entries] : cells) {
+                const Point p = point(k);
+                if (p.x < top_left.x || p.x > bottom_right.x || p.y < top_left.y || p.y > bottom_right.y) continue;
+                for (const auto & entry : entries) func(p, entry);
+            }
+        } else {
+            for (int y = top_left.y; y <= bottom_right.y; ++y)
+                for (int x = top_left.x; x <= bottom_right.x; ++x)
+                    if (const auto * entries = at({x, y}))
+                        for (const auto & entry : *entries) func(Point{x, y}, entry);
+        }
+    }
+
+    size_t size() const { return count; }
+
+private:
+    static std::uint64_t key(const Point & p) { return (std::uint64_t(std::uint32_t(p.x)) << 32) | std::uint32_t(p.y); }
+    static Point point(std::uint64_t k) { return {int(std::uint32_t(k >> 32)), int(std::uint32_t(k))}; }
+
+    void changed(const Point & p) {
+        if (changes.all) return;
+        if (changes.tiles.size() < max_tracked_changes) changes.tiles.push_back(p);
+        else changes = {.tiles = {}, .all = true};
+    }
+
+    std::unordered_map<std::uint64_t, std::vector<Entry>> cells;
+    size_t count{};
+    Changes changes;
+};
+
+// Something that happened in the game. The engine publishes "move" (entity went from `from` to `to`), "collide"
+// (entity moved onto `to` where other already was, one event per entity there) and "death" (entity's health dropped
+// to 0 or below). Scripts publish their own types, carried in data.
+struct GameEvent {
+    std::string type;
+    SpatialIndex::Entry entity{};
+    SpatialIndex::Entry other{};
+    Point from{};
+    Point to{};
+    sol::table data{};
+};
+
+// Game events queued as they happen and handed to the Lua subscribers once a frame, rather than every system polling
+// for what might have changed. Each subscriber gets all of its type's events since the last dispatch in one call, as
+// an array in the order they were published.
+class EventBus {
+public:
+    // Whether anybody listens for type; events nobody listens for are never queued, so check before building one
+    bool is_wanted(const std::string & type) const { return subscribers.contains(type); }
+    void publish(GameEvent event) {
+        if (is_wanted(event.type)) queue.push_back(std::move(event));
+    }
+    void subscribe(const std::string & type, sol::function callback) {
+        subscribers[type].push_back(std::move(callback));
+    }
+    // Drops the events not dispatched yet, eg when the entities they are about have been replaced by a loaded game
+    void clear() { queue.clear(); }
+
+    // Events the subscribers publish go out in the same dispatch, in rounds, up to max_rounds of them so that events
+    // that keep causing each other can't hang the frame; whatever is left waits for the next dispatch. to_lua makes
+    // the table a subscriber gets for an event.
+    void dispatch(sol::this_state s, const std::function<sol::table(const GameEvent &)> & to_lua);
+    static constexpr int max_rounds = 8;
+
+private:
+    std::unordered_map<std::string, std::vector<sol::function>> subscribers;
+    std::vector<GameEvent> queue;
 };
 
 class EntityManager {
 public:
-    EntityManager(sol::this_state s) {
+    // make_entity and make_component allocate from memory, eg a slab pool the owner releases in one go once the manager
+    // and every Lua reference to its entities are gone
+    EntityManager(sol::this_state s, std::pmr::memory_resource * memory = std::pmr::get_default_resource())
+        : memory(memory) {
         sol::state_view lua(s);
         lua_entities = lua.create_table();
+        prototype_metatables = lua.create_table();
+        prototype_metatables[sol::metatable_key] = lua.create_table_with("__mode", "k");
     }
 
     void add_entity_to_group(const std::string & group_name, std::shared_ptr<Entity> e, sol::this_state s);
@@ -247,9 +758,24 @@ public:
         add_entity_to_group(entity_group_name_to_string(group_name), e, s);
     }
 
+    // An entity or component sharing one allocation with its reference counts, taken from the manager's memory so
+    // a level's entities sit together rather than scattered over the heap. Main thread only: the pool the engine
+    // hands in isn't synchronized.
+    template <typename... Args>
+    std::shared_ptr<Entity> make_entity(Args &&... args) const {
+        return std::allocate_shared<Entity>(std::pmr::polymorphic_allocator<Entity>(memory),
+                                            std::forward<Args>(args)...);
+    }
+    template <ComponentType T, typename... Args>
+    std::shared_ptr<T> make_component(Args &&... args) const {
+        return std::allocate_shared<T>(std::pmr::polymorphic_allocator<T>(memory), std::forward<Args>(args)...);
+    }
+
     std::shared_ptr<EntityGroup> create_entity_group(const std::string & group_name);
     std::shared_ptr<Entity> create_entity_in_group(const std::string & group_name, const std::string & entity_name);
     void remove_entity(const std::string & entity_group_name, const std::string & entity_id);
+    // Removes every entity in the group, keeping the (now empty) group itself
+    void clear_entity_group(const std::string & entity_group_name);
 
     std::vector<std::string> get_entity_group_names() const {
         std::vector<std::string> results;
@@ -290,17 +816,20 @@ public:
     }
 
     std::shared_ptr<std::vector<std::shared_ptr<Entity>>>
-    find_entities_in_group(const std::string & entity_group, std::function<bool(std::shared_ptr<Entity>)> predicate) const;
+    find_entities_in_group(const std::string & entity_group,
+                           std::function<bool(const std::shared_ptr<Entity> &)> predicate) const;
 
     std::shared_ptr<Entity> find_entity(const std::string & entity_group,
-                                        std::function<bool(std::shared_ptr<Entity>)> predicate) const;
+                                        std::function<bool(const std::shared_ptr<Entity> &)> predicate) const;
     std::shared_ptr<Entity> find_entity(EntityGroupName entity_group,
-                                        std::function<bool(std::shared_ptr<Entity>)> predicate) const {
+                                        std::function<bool(const std::shared_ptr<Entity> &)> predicate) const {
         return find_entity(entity_group_name_to_string(entity_group), predicate);
     }
 
     sol::table get_lua_entities() const { return lua_entities; }
     sol::table get_lua_entity(const std::string & entity_group, const std::string & entity_name) const;
+    // The {id, name, full_name, components} table for e, or nil if it has none
+    sol::table get_lua_entity_table(const std::string & entity_group, const Entity & e) const;
     void remove_lua_component(const std::string & entity_group, const std::string & entity_name, const std::string & component_name);
 
     bool lua_entities_for_each(std::function<bool(sol::table)> predicate) const;
@@ -308,7 +837,57 @@ public:
     void lua_for_each_overlapping_point(const std::string & entity_name, int x, int y, sol::function point_callback);
     sol::table get_lua_blocked_points(const std::string & entity_group, int x, int y, const std::string & direction,
                                       sol::this_state s);
-    sol::table get_lua_entities_in_viewport(std::function<bool(int x, int y)> predicate, sol::this_state s);
+    // top_left and bottom_right are inclusive map coordinates. The result is cached: the same table is returned until
+    // the rectangle changes or an entity enters or leaves it, so callers must treat it as read-only.
+    sol::table get_lua_entities_in_viewport(const Point & top_left, const Point & bottom_right, sol::this_state s);
+
+    const SpatialIndex & get_spatial_index() const { return spatial_index; }
+    // Moves and deaths are published here, as they happen
+    EventBus & get_events() { return events; }
+    // The table a subscriber gets for one of the engine's events: type, the entity's group, id, name, full_name and
+    // entity table (nil if it is gone by now), x and y (where it happened), from_x and from_y for moves, and the same
+    // fields prefixed other_ (other for the table) for the entity collided with
+    sol::table event_to_lua(const GameEvent & event, sol::this_state s) const;
+    SpatialIndex::Changes take_spatial_changes() { return spatial_index.take_changes(); }
+    const NativeComponents & get_native_components() const { return native; }
+
+    std::optional<Point> get_entity_position(const Entity & e) const {
+        const auto & positions = native.positions;
+        if (auto slot = positions.slot(&e)) return Point{positions.column<0>()[*slot], positions.column<1>()[*slot]};
+        return std::nullopt;
+    }
+    // True if any entity on p has position_component.blocking set
+    bool is_blocking_at(const Point & p) const;
+
+    // Moves an entity, giving it a position_component if it has none
+    bool set_entity_position(const std::string & entity_group, const std::string & entity_id, int x, int y);
+    // Hooks the entity's component tables up to the native pools: tables that aren't bound yet (new entities, or
+    // tables Lua has just replaced wholesale) have their hot fields moved into the pools, and components that are gone
+    // drop the entity from their pools. Keeps the spatial index in step with the position.
+    void bind_native_components(const std::string & entity_group, const std::shared_ptr<Entity> & e);
+    // Lua can replace or remove a component by plain assignment without the engine hearing of it, so this compares
+    // every entity's component tables with the ones it last saw and refreshes those that changed. Called by query and
+    // after each Lua system and event dispatch.
+    void sync_components();
+    // Builds a components table for a new entity that shares prototype's component tables instead of copying them:
+    // each component starts out empty with the prototype's component as its __index, so methods, sprite definitions
+    // and other fields are read from the prototype until the entity writes its own value. Fields in overrides (a
+    // table of component tables) are set on the entity directly, and components that only appear there are taken
+    // over as they are. Nested tables are shared too, so replace them rather than change them in place.
+    sol::table instantiate_prototype(const sol::table & prototype, const sol::optional<sol::table> & overrides,
+                                     sol::this_state s);
+    // The table a component instantiated by instantiate_prototype falls back to, or nil for ordinary components
+    static sol::table get_component_prototype(const sol::table & component);
+    // A plain deep copy of the entity's components with the native fields and inherited prototype fields written back
+    // in, eg for saving
+    sol::table snapshot_components(const Entity & e, sol::this_state s) const;
+
+    // The entities of entity_group (every group, if it's empty) that have all of the named components, as an array of
+    // their Lua entity tables. Views are cached per query and kept current as entities and components come and go, so
+    // asking again each frame is a lookup after sync_components. The result is the live view and must be treated as
+    // read-only; walk it backwards if entities may drop out of it on the way, as a removal moves the last entry into
+    // the hole.
+    sol::table query(std::vector<std::string> components, const std::string & entity_group, sol::this_state s);
 
     static sol::table copy_table(const sol::table & original, sol::this_state s) {
         sol::state_view lua(original.lua_state());
@@ -326,8 +905,71 @@ public:
     }
 
 private:
-    std::vector<std::shared_ptr<EntityGroup>> entity_groups;
+    enum class NativeComponent { Position, Stats, Sprite };
+    enum class NativeField { PositionX, PositionY, Blocking, Health, MaxHealth, SpriteId };
+    static std::optional<NativeField> native_field(NativeComponent component, std::string_view key);
+    static std::span<const std::string_view> native_field_names(NativeComponent component);
+    sol::object read_native_field(const Entity & e, NativeField field, sol::this_state s) const;
+    // Returns false if key isn't a native field or e isn't in its pool. Throws if value doesn't suit the field, and
+    // unbinds the component when a field it can't do without is set to nil
+    bool write_native_field(sol::table component, NativeComponent kind, std::string_view key, const Entity & e,
+                            const sol::object & value);
+    // Moves the component's fields back into its table and drops e from their pools (and the spatial index)
+    void unbind_native_component(sol::table component, NativeComponent kind, const Entity & e);
+    void install_native_proxy(sol::table component, NativeComponent kind, const std::shared_ptr<Entity> & e);
+    static bool is_bound(const sol::table & component, const Entity & e);
+    void move_entity(const Entity & e, const Point & to);
+    // Gives the entity's components table a metatable that notices components being added to it from Lua
+    void install_component_hook(const std::string & entity_group, const std::shared_ptr<Entity> & e);
+    // Binds the entity's components, updates the query views and remembers which component tables it has for
+    // sync_components to compare against
+    void refresh_components(const std::string & entity_group, const std::shared_ptr<Entity> & e);
+    void update_query_views(const std::string & entity_group, const std::shared_ptr<Entity> & e);
+
+    // All spatial index updates go through these so the viewport cache is invalidated when membership changes
+    void index_insert(const Point & p, const std::shared_ptr<Entity> & e, const std::string & group_name);
+    void index_remove(const Point & p, const Entity * e);
+    void index_move(const Point & from, const Point & to, const Entity * e);
+    // The entity's own shared pointer and its group, found through its id
+    std::optional<SpatialIndex::Entry> find_entry(const Entity & e) const;
+    // Publishes a death if health went from above 0 to 0 or below
+    void health_changed(const Entity & e, double from, double to);
+
+    struct ViewportCache {
+        Point top_left{}, bottom_right{};
+        sol::table entities{};
+        bool valid{};
+
+        bool contains(const Point & p) const {
+            return p.x >= top_left.x && p.x <= bottom_right.x && p.y >= top_left.y && p.y <= bottom_right.y;
+        }
+    };
+
+    struct QueryView {
+        std::string entity_group; // empty matches every group
+        std::vector<std::string> components;
+        sol::table entities{};              // 1-based array of entity tables, entities[i + 1] belongs to owners[i]
+        std::vector<const Entity *> owners;
+        std::unordered_map<const Entity *, size_t> slots;
+
+        bool matches(const std::string & group_name, const Entity & e) const;
+        void insert(const Entity * e, const sol::table & entity_table);
+        void erase(const Entity * e);
+    };
+
+    std::pmr::memory_resource * memory; // where entities and components are allocated
+    std::vector<std::shared_ptr<EntityGroup>> entity_groups; // in creation order
+    std::unordered_map<std::string, std::shared_ptr<EntityGroup>> entity_groups_by_name;
     sol::table lua_entities{};
+    SpatialIndex spatial_index;
+    EventBus events;
+    NativeComponents native;
+    ViewportCache viewport_cache;
+    std::unordered_map<std::string, QueryView> query_views; // keyed by group and sorted component names
+    // Each entity's component tables by name, as of its last refresh_components
+    using ComponentSnapshot = std::vector<std::pair<std::string, const void *>>;
+    std::unordered_map<const Entity *, ComponentSnapshot> component_snapshots;
+    sol::table prototype_metatables{}; // prototype component -> the metatable its instances share, weak keyed
 };
 
 // For Lua integration we don't need a bunch of custom components. We'll just
@@ -335,10 +977,8 @@ private:
 class LuaComponent : public Component {
     sol::table properties;
 public:
-    LuaComponent(const std::string & n, sol::table props, sol::this_state s) : Component(n) {
-        sol::state_view lua(s);
-        properties = copy_table(props, s);
-    }
+    // Takes props as is rather than copying it, so a table the script still holds on to must be copy_table'd first
+    LuaComponent(const std::string & n, sol::table props) : Component(n), properties(std::move(props)) {}
 
     sol::table get_properties() const { return properties; }
 
@@ -360,15 +1000,55 @@ public:
     static sol::table copy_table(const sol::table & original, sol::this_state s);
 };
 
+// Textured quads queued up and submitted with as few SDL_RenderGeometry calls as possible: one per run of quads that
+// share a texture. The tint is applied per vertex, so differently coloured quads don't need texture color mod
+// changes between them and still go out together.
+class SpriteBatch {
+public:
+    // Queues source (in a texture_size texture) to be drawn to destination; a null texture (headless) is ignored
+    void add(SDL_Texture * texture, const Size & texture_size, const SDL_Rect & source, const SDL_Rect & destination,
+             SDL_Color tint = {255, 255, 255, 255});
+    // Draws everything queued, in the order it was queued, and empties the batch
+    void flush(SDL_Renderer * renderer);
+    bool empty() const { return runs.empty(); }
+
+private:
+    struct Run {
+        SDL_Texture * texture{};
+        size_t first_vertex{};
+        size_t first_index{};
+    };
+    // Reused between flushes so that steady-state batching does not allocate
+    std::vector<SDL_Vertex> vertices;
+    std::vector<int> indices; // relative to their run's first vertex
+    std::vector<Run> runs;
+};
+
 class SpriteSheet {
 public:
-    SpriteSheet(SDL_Renderer * renderer, const std::string & n, const std::string & p, int sw, int sh, int sf);
+    // tileset is the decoded image at path p; the sheet makes its own texture from it
+    SpriteSheet(SDL_Renderer * renderer, const std::string & n, const std::string & p, SDL_Surface * tileset, int sw,
+                int sh, int sf);
 
     void draw_sprite(SDL_Renderer * renderer, int sprite_id, int x, int y) const;
     void draw_sprite(SDL_Renderer * renderer, int sprite_id, int x, int y, int scale_factor) const;
     void draw_sprite_sheet(SDL_Renderer * renderer, int x, int y) const;
 
+    // Queues a sprite in batch, tinted with tint or, without one, the highlight color. Like draw_sprite(), a scale
+    // factor of 0 or less draws it unscaled.
+    void batch_sprite(SpriteBatch & batch, int sprite_id, int x, int y, int scale_factor,
+                      std::optional<SDL_Color> tint = std::nullopt) const;
+    // Queues a sprite to be drawn by the next flush_batch(), which submits everything queued so far as a single
+    // SDL_RenderGeometry call. The tint is applied per vertex, so it does not touch the texture's color mod.
+    void batch_sprite(int sprite_id, int x, int y, int scale_factor, SDL_Color tint = {255, 255, 255, 255}) {
+        batch_sprite(own_batch, sprite_id, x, y, scale_factor, tint);
+    }
+    void flush_batch(SDL_Renderer * renderer) { own_batch.flush(renderer); }
+
     SDL_Texture * get_spritesheet_texture() const { return spritesheet_texture.get(); }
+    const std::string & get_path() const { return path; }
+    // Draws from region of atlas from now on instead of the sheet's own texture, which is released
+    void move_to_atlas(std::shared_ptr<SDL_Texture> atlas, const Size & atlas_size, const SDL_Rect & region);
 
     std::string get_name() const { return name; }
     int get_sprite_width() const { return sprite_width; }
@@ -383,14 +1063,15 @@ public:
     void remove_blocked_sprite(int sprite_id) { blocked_sprite_ids.erase(sprite_id); }
     bool is_sprite_blocked(int sprite_id) const { return blocked_sprite_ids.find(sprite_id) != blocked_sprite_ids.end(); }
 
-    void set_highlight_color(Uint8 r, Uint8 g, Uint8 b) { SDL_SetTextureColorMod(spritesheet_texture.get(), r, g, b); }
-
-    void reset_highlight_color() { SDL_SetTextureColorMod(spritesheet_texture.get(), o_red, o_green, o_blue); }
+    // The tint batched sprites get when not given one. It is per sheet state rather than the texture's color mod, so
+    // sheets sharing an atlas don't tint each other and highlighted sprites batch with the rest.
+    void set_highlight_color(Uint8 r, Uint8 g, Uint8 b) { highlight_color = {r, g, b, 255}; }
+    void reset_highlight_color() { highlight_color = {255, 255, 255, 255}; }
 
     Point map_to_world(int x, int y, const Dimension & dimensions) const;
 
 private:
-    Uint8 o_red{}, o_green{}, o_blue{};
+    SDL_Color highlight_color{255, 255, 255, 255};
 
     std::set<int> blocked_sprite_ids;
     std::string name;
@@ -399,49 +1080,158 @@ private:
     int sprite_height{};
     int scale_factor{};
     std::vector<SDL_Rect> sprites;
-    UPtr<SDL_Texture> spritesheet_texture;
+    std::shared_ptr<SDL_Texture> spritesheet_texture; // the sheet's own, or an atlas it was moved to
+    Size texture_size{};
+
+    SpriteBatch own_batch; // for batch_sprite() without a batch
+};
+
+// Packs sprite sheets and graphics into one texture, so that everything drawn from them can go out in a single
+// SpriteBatch run. Rects are placed on shelves, tallest first, with a pixel of padding so filtering never picks up a
+// neighbour's edge.
+class TextureAtlas {
+public:
+    // Where each surface goes, in order, or nothing if they don't all fit in max_size
+    static std::optional<std::vector<SDL_Rect>> pack(const std::vector<Size> & sizes, const Size & max_size,
+                                                     Size & atlas_size);
+    // Copies the surfaces into a new texture at the places pack() found for them
+    static std::shared_ptr<SDL_Texture> create(SDL_Renderer * renderer, const std::vector<SDL_Surface *> & surfaces,
+                                               const std::vector<SDL_Rect> & places, const Size & atlas_size);
+
+    static constexpr int padding = 1;
 };
 
 class Map {
 public:
     Map() = default;
     Map(const std::string & n, int w, int h, std::shared_ptr<Matrix> m)
-        : name(n), width(w), height(h), map(std::move(m)), light_map(std::make_shared<Matrix>(h, w, 0)){}
+        : name(n), width(w), height(h), map(std::move(m)), light_map(std::make_shared<Matrix>(h, w, 0)),
+          dirty(h, w, 1) {}
 
+    // Calls draw_hook(rows, cols, dx, dy, cell_id, light, scale_factor) for each viewport cell that needs redrawing
+    // into the tile cache, with (dx, dy) the cell's place in the cache texture, then flush() for whatever the hook
+    // batched, then draws the viewport from the cache
     void draw_map(SDL_Renderer * renderer, const Dimension & dimensions,
                   const std::shared_ptr<SpriteSheet> & sprite_sheet,
-                  const std::function<void(int, int, int, int, int, int, int)> & draw_hook);
+                  const std::function<void(int, int, int, int, int, int, int)> & draw_hook,
+                  const std::function<void()> & flush = {});
 
     void draw_map(SDL_Renderer * renderer, const Dimension & dimensions, int x, int y, int a,
-                  const std::function<void(int, int, int)> & draw_hook);
+                  const std::function<void(int, int, int)> & draw_hook, const std::function<void()> & flush = {});
+
+    // Native replacement for the per-cell draw hook: the viewport cells that need redrawing are drawn into the tile
+    // cache with the tile rules, in one batch. The cell at dimensions.supplemental_point (the player) is always
+    // treated as fully lit.
+    void draw_map_tiles(SDL_Renderer * renderer, const Dimension & dimensions, SpriteSheet & sprite_sheet);
+
+    // Which sprite to draw for each cell id and how to tint it for each light map value. Cells whose light value has
+    // no tint are not drawn at all.
+    struct TileRules {
+        std::vector<int> sprite_for_cell;                        // indexed by cell id, -1 = draw nothing
+        std::vector<std::optional<SDL_Color>> tint_for_light;    // indexed by light map value
+    };
+    void set_tile_rules(TileRules rules) {
+        tile_rules = std::move(rules);
+        trigger_redraw();
+    }
+    const TileRules & get_tile_rules() const { return tile_rules; }
+
+    // Light map values
+    static constexpr int LIGHT_UNEXPLORED = 0; // never seen
+    static constexpr int LIGHT_VISIBLE = 1;    // in the current field of view
+    static constexpr int LIGHT_EXPLORED = 2;   // seen before, but not currently visible
 
+    // Recursive shadowcasting from dimensions.supplemental_point out to the fov radius. The light map is updated in
+    // place: only the previous field of view's bounding box is demoted to explored before casting, and only the cells
+    // whose light value actually changed are marked dirty.
     void calculate_field_of_view(const Dimension & dimensions);
+    void set_fov_radius(int radius) { fov_radius = std::max(radius, 1); }
+    int get_fov_radius() const { return fov_radius; }
+    bool is_visible(int x, int y) const { return (*light_map)(y, x) == LIGHT_VISIBLE; }
 
     auto get_name() const { return name; }
     auto get_width() const { return width; }
     auto get_height() const { return height; }
+    // Call cells_changed() after editing the cells
     auto get_map() const { return map; }
     auto get_light_map() const { return light_map; }
+    // Changes whenever the cells do, and no two maps ever share one, so whatever was worked out from the cells (a
+    // distance field, say) can tell whether it still holds
+    uint64_t get_revision() const { return revision; }
+    void cells_changed() {
+        revision = next_revision();
+        trigger_redraw();
+    }
 
-    Point get_random_point(const std::set<int> & off_limit_sprites_ids) const;
+    Point get_random_point(const std::set<int> & off_limit_sprites_ids, RandomStream & rng) const;
 
-    void trigger_redraw() { current_map_segment_dimension = {}; }
+    // Redraws a cell (eg one an entity moved onto or off) the next time the tile cache is drawn, or every cell
+    void mark_dirty(const Point & p) {
+        if (dirty.in_bounds(p.y, p.x)) dirty(p.y, p.x) = 1;
+    }
+    void trigger_redraw() { dirty.fill(1); }
 
-    auto is_point_blocked(int x, int y) { return (*map)(y, x) == 0; }
+    auto is_point_blocked(int x, int y) { return map->at(y, x) == 0; }
 
 private:
-    // This is our jank optimization for preventing us from creating a new
-    // SDL_Texture every frame if nothing has changed. This is used in draw_map.
-    Dimension current_map_segment_dimension{};
+    // The tiles around the viewport, kept in one texture between frames. It is toroidal: map cell (x, y) lives in
+    // slot (x mod tiles.width, y mod tiles.height), so when the viewport scrolls only the rows and columns coming
+    // into the cached region are drawn. Apart from those only cells marked dirty are redrawn. The region has a margin
+    // around the viewport, so stepping back and forth near its middle doesn't redraw anything.
+    struct TileCache {
+        enum class Content { Hook, Tiles }; // which of the draw functions filled it
+        static constexpr int margin = 2;    // tiles cached beyond each edge of the viewport
+
+        UPtr<SDL_Texture> texture;
+        Content content{};
+        const SpriteSheet * sprite_sheet{};
+        int tile_width{};
+        int tile_height{};
+        Point origin{}; // map cell in the region's top left corner
+        Size tiles{};   // region size, in tiles
+        bool drawn{};   // false until the region has been drawn once
+        Point focus{-1, -1};
+    };
+
+    // Brings tile_cache up to date for the viewport, calling draw_tile(x, y, dx, dy) for each map cell to redraw at
+    // (dx, dy) in the cache texture (its slot has been cleared) and flush() once they are all in, then draws the
+    // viewport from the cache.
+    void draw_cached(SDL_Renderer * renderer, const Dimension & dimensions, TileCache::Content content,
+                     const SpriteSheet & sprite_sheet, const std::function<void(int, int, int, int)> & draw_tile,
+                     const std::function<void()> & flush);
+
+    TileCache tile_cache;
     Dimension current_full_map_dimension{};
-    UPtr<SDL_Texture> current_map_segment_texture;
     UPtr<SDL_Texture> current_full_map_texture;
 
     std::string name;
     int width{};
     int height{};
+    static uint64_t next_revision() {
+        static std::atomic<uint64_t> last{};
+        return ++last;
+    }
+
     std::shared_ptr<Matrix> map;
+    uint64_t revision{next_revision()};
     std::shared_ptr<Matrix> light_map;
+    GenericMatrix<uint8_t> dirty; // per cell, 1 = redraw it in the tile cache
+    TileRules tile_rules{.sprite_for_cell = {}, .tint_for_light = {std::nullopt, SDL_Color{255, 255, 255, 255}}};
+
+    void cast_light(int cx, int cy, int row, float start_slope, float end_slope, int xx, int xy, int yx, int yy);
+
+    // Only while calculate_field_of_view runs: visible last time, not yet seen this time
+    static constexpr int LIGHT_WAS_VISIBLE = 3;
+    // Marks a cell visible, and dirty unless it was visible last time too
+    void light_up(int x, int y) {
+        int & light = (*light_map)(y, x);
+        if (light != LIGHT_VISIBLE && light != LIGHT_WAS_VISIBLE) dirty(y, x) = 1;
+        light = LIGHT_VISIBLE;
+    }
+
+    int fov_radius{20};
+    // Inclusive bounding box of the cells marked visible by the last calculate_field_of_view, if any
+    std::optional<std::pair<Point, Point>> fov_region;
 };
 
 struct MapInfo {
@@ -451,22 +1241,437 @@ struct MapInfo {
 
 // AStar path finding algorithm
 namespace AStar {
+// Reusable scratch space for path searches over a 4-connected grid. The per-cell buffers are sized to the largest
+// grid seen and stamped with a search generation, so starting a new search doesn't clear or reallocate W x H memory.
+class PathfinderContext {
+public:
+    enum class Mode {
+        AStar,      // plain A*, expands every passable neighbour
+        JumpPoint,  // Jump Point Search (JPS4), skips runs of symmetric cells; best on open cave maps
+    };
+
+    // Finds a path over the cells of grid equal to passable_cell. Returns the points from start to goal inclusive,
+    // or an empty vector if there is no path. The returned reference is valid until the next call.
+    const std::vector<Point> & find_path(const Matrix & grid, Point start, Point goal, int passable_cell,
+                                         Mode mode = Mode::AStar);
+
+private:
+    struct OpenEntry {
+        int f, h, g, index;
+        // heap ordering: lowest f first, ties broken on the lowest h (closest to the goal)
+        bool operator>(const OpenEntry & o) const { return f != o.f ? f > o.f : h > o.h; }
+    };
+
+    void begin_search(size_t cell_count);
+    int cost_at(int index) const { return stamp[index] == generation ? cost[index] : INT_MAX; }
+    void relax(int index, int from, int g);
+    bool passable(int x, int y) const;
+    int jump(int x, int y, int dx, int dy) const;
+    bool jump_vertical(int x, int y, int dy) const;
+    void reconstruct(int goal_index);
+
+    // per-search state; only valid during find_path
+    const Matrix * grid{};
+    int width{}, height{}, passable_cell{};
+    Point goal{};
+
+    uint32_t generation{};
+    std::vector<uint32_t> stamp;
+    std::vector<int> cost;
+    std::vector<int> parent;
+    std::vector<OpenEntry> open;
+    std::vector<Point> path;
+};
+
+// Convenience wrapper over a per-thread PathfinderContext. Cells equal to 0 are passable. Returns (row, col) pairs
+// from start to goal inclusive, or an empty vector if there is no path.
 std::vector<std::pair<int, int>> FindPath(const Matrix & grid, int start_row, int start_col, int goal_row, int goal_col);
 } // namespace AStar
 
-// Runs the game. This is a singleton; only one of these may exist app-wide.
-class Engine {
-    static std::atomic_int instance_ctr; // enforces singleton
+// Breadth-first distance map (a "Dijkstra map") over a 4-connected grid, flooded out from a single origin. One flood
+// serves any number of agents heading for the origin: each just steps to a neighbour that is closer to it.
+class DistanceField {
+public:
+    static constexpr int UNREACHABLE = INT_MAX;
+
+    // Floods the cells of grid equal to passable_cell, starting at origin. grid_revision tells apart the states the
+    // grid goes through (eg Map::get_revision()). The buffers are reused between calls.
+    void compute(const Matrix & grid, uint64_t grid_revision, Point origin, int passable_cell);
+
+    // True if the last compute() was over this grid, unchanged since, from this origin, ie the field doesn't need
+    // recomputing
+    bool is_current(const Matrix & grid, uint64_t grid_revision, Point origin) const {
+        return source == &grid && revision == grid_revision && origin == this->origin;
+    }
+
+    int distance(int x, int y) const {
+        if (x < 0 || y < 0 || x >= width || y >= height) return UNREACHABLE;
+        return distances[static_cast<size_t>(y) * width + x];
+    }
+
+    // The neighbour of (x, y) one step closer to the origin for which is_blocked(Point) is false, or nullopt if
+    // (x, y) is the origin, can't reach it, or every closer neighbour is blocked.
+    template <typename Blocked>
+    std::optional<Point> step_toward_origin(int x, int y, Blocked && is_blocked) const {
+        const int d = distance(x, y);
+        if (d == UNREACHABLE || d == 0) return std::nullopt;
+        for (const Point n : {Point{x, y - 1}, Point{x, y + 1}, Point{x - 1, y}, Point{x + 1, y}})
+            if (distance(n.x, n.y) == d - 1 && !is_blocked(n)) return n;
+        return std::nullopt;
+    }
+
+private:
+    const Matrix * source{};
+    uint64_t revision{};
+    Point origin{-1, -1};
+    int width{}, height{};
+    std::vector<int> distances;
+    std::vector<int> frontier;
+};
+
+// A fixed set of worker threads for data-parallel jobs such as map generation
+class ThreadPool {
+public:
+    // thread_count counts the calling thread, which always works on its share of a parallel_for
+    explicit ThreadPool(unsigned thread_count = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool & operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return workers.size() + 1; }
+
+    // Splits [begin, end) into contiguous ranges of at least min_chunk items (the last one may be shorter) and calls
+    // func(range_begin, range_end) for each, in parallel. Blocks until all have run; rethrows the first exception.
+    void parallel_for(size_t begin, size_t end, const std::function<void(size_t, size_t)> & func, size_t min_chunk = 1);
+
+private:
+    void worker_loop();
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::condition_variable work_done;
+    std::deque<std::function<void()>> tasks;
+    bool stopping{};
+};
+
+// Reads and decodes the game's images, sounds, music and fonts on background threads, so that the window can come up
+// and the first scenes run while they stream in. Whatever needs the main thread is left to whoever takes the loaded
+// assets: creating textures (the renderer is not thread safe) and opening fonts (SDL_ttf isn't either), for which
+// only the file is read here.
+class AssetLoader {
+public:
+    enum class Kind { SpriteSheet, Graphic, Font, Sound, Music };
+
+    struct Request {
+        Kind kind{};
+        std::string name; // what the asset is known by: a sprite sheet, font or sound name, or the path for a graphic
+        std::string path;
+        int sprite_width{};  // SpriteSheet
+        int sprite_height{}; // SpriteSheet
+        int size{};          // a SpriteSheet's scale factor, a Font's point size
+    };
+
+    // A finished request, with the member for its kind set, or error saying why it couldn't be loaded
+    struct Loaded {
+        Request request;
+        UPtr<SDL_Surface> surface; // SpriteSheet, Graphic
+        std::vector<char> bytes;   // Font
+        UPtr<Mix_Chunk> chunk;     // Sound
+        UPtr<Mix_Music> music;     // Music
+        std::string error;
+        bool missing{}; // the file isn't there, rather than it being unreadable
+    };
+
+    // Loads request on the calling thread
+    static Loaded load(Request request);
 
+    // Loading is mostly waiting on the disk, so a couple of threads keep it busy
+    explicit AssetLoader(unsigned thread_count = 2);
+    ~AssetLoader(); // waits for the loads in progress; requests not started yet are dropped
+
+    AssetLoader(const AssetLoader &) = delete;
+    AssetLoader & operator=(const AssetLoader &) = delete;
+
+    void enqueue(Request request);
+    // The requests finished since the last call, in the order they finished
+    std::vector<Loaded> take_loaded();
+
+private:
+    void worker_loop();
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::deque<Request> requests;
+    std::vector<Loaded> loaded;
+    bool stopping{};
+};
+
+struct MapGenerationParams {
+    int passes{10};                     // cellular automaton smoothing passes
+    double wall_fill{0.48};             // probability that a cell starts out as a wall
+    std::optional<uint64_t> seed{};     // the same seed, size and params always produce the same map; unset = random
+};
+
+// An unbounded world streamed in fixed size chunks of byte cells (0 = wall, 1 = floor, like Map) around a focus
+// point, so memory scales with the active area rather than the world size. Chunks are a pure function of the seed and
+// their coordinates: the cellular automaton runs over each chunk plus a margin wide enough that neighbouring chunks
+// meet seamlessly. Evicted chunks are simply dropped unless set_cell changed them, in which case they are kept as a
+// run length encoded blob and restored from that instead. A one byte summary outlives every chunk for the minimap.
+class ChunkedMap {
 public:
-    Engine(); // may throw if singleton invariant violated
+    static constexpr int CHUNK_SIZE = 32;
+    using Cells = std::array<uint8_t, CHUNK_SIZE * CHUNK_SIZE>;
+
+    ChunkedMap(const std::string & n, uint64_t seed, const MapGenerationParams & params)
+        : name(n), seed(seed), params(params) {}
+
+    // Makes every chunk within radius chunks of tile center resident (generating missing ones across the pool) and
+    // evicts those more than radius + 1 away, so walking back and forth over a chunk border doesn't thrash.
+    void update_residency(const Point & center, int radius, ThreadPool & pool);
+
+    // Cells in chunks that aren't resident read as walls
+    uint8_t get_cell(const Point & p) const;
+    // Returns false if p's chunk isn't resident
+    bool set_cell(const Point & p, uint8_t value);
+
+    // Floor coverage of a chunk (0 = solid rock, 255 = all floor), known once it has been resident
+    std::optional<uint8_t> get_summary(int chunk_x, int chunk_y) const;
+
+    // Batches the sprite for every cell of the size.width x size.height tile rectangle at top_left and draws them
+    void draw_tiles(SDL_Renderer * renderer, const Point & top_left, const Size & size, SpriteSheet & sprite_sheet);
+    // One pixel_size square per chunk within radius chunks of tile center, shaded by its summary
+    void draw_minimap(SDL_Renderer * renderer, int dest_x, int dest_y, const Point & center, int radius,
+                      int pixel_size);
+
+    void set_tile_rules(Map::TileRules rules) { tile_rules = std::move(rules); }
+    const Map::TileRules & get_tile_rules() const { return tile_rules; }
+
+    auto get_name() const { return name; }
+    size_t get_resident_chunk_count() const { return resident.size(); }
+    size_t get_stored_chunk_count() const { return stored.size(); }
+
+    static int chunk_coord(int tile) { return tile >= 0 ? tile / CHUNK_SIZE : (tile + 1) / CHUNK_SIZE - 1; }
+
+private:
+    struct Chunk {
+        Cells cells{};
+        bool modified{};
+    };
+
+    static uint64_t key(int chunk_x, int chunk_y) { return (uint64_t(uint32_t(chunk_x)) << 32) | uint32_t(chunk_y); }
+    static uint8_t summarize(const Cells & cells);
+    void generate(int chunk_x, int chunk_y, Cells & cells) const;
+    const Chunk * find_chunk(const Point & p) const;
+
+    std::string name;
+    uint64_t seed;
+    MapGenerationParams params;
+    Map::TileRules tile_rules{.sprite_for_cell = {}, .tint_for_light = {std::nullopt, SDL_Color{255, 255, 255, 255}}};
+
+    std::unordered_map<uint64_t, std::unique_ptr<Chunk>> resident;
+    std::unordered_map<uint64_t, std::vector<uint8_t>> stored; // modified chunks that were evicted, run length encoded
+    std::unordered_map<uint64_t, uint8_t> summaries;
+};
+
+// Read-only memory mapping of a whole file (mmap on POSIX, a file mapping on Windows). Throws std::runtime_error if
+// the file can't be opened or mapped.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string & path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    std::span<const uint8_t> bytes() const { return {data, size}; }
+
+private:
+    const uint8_t * data{};
+    size_t size{};
+#ifdef _WIN32
+    void * file_handle{};
+    void * mapping_handle{};
+#endif
+};
+
+// When a system runs. Render systems run once per presented frame and Frame systems just before them, Input systems on
+// each key press and Turn systems right after each one, so whatever a key press sets off resolves without waiting
+// for the next frame. Fixed systems run at their own rate in simulated time, independent of the frame rate.
+enum class SystemRate { Frame, Fixed, Turn, Input, Render };
+
+struct ScheduledSystem {
+    std::string name;
+    sol::function callback;       // a Lua system, always run on the main thread
+    std::function<void()> native; // a native system; these never touch the Lua VM and may run on worker threads
+    SystemRate rate{SystemRate::Fixed};
+    double period{}; // seconds between runs of a Fixed system, 0 for the simulation step
+    double accumulator{};
+    // The data the system reads and writes, by any names systems agree on (components, "map", ...), and the systems
+    // it must run after. Native systems only run at the same time as others whose data doesn't clash with theirs.
+    std::vector<std::string> reads, writes, after;
+
+    bool is_native() const { return static_cast<bool>(native); }
+};
+
+// Decides which systems are due and runs them in a fixed order: the order they were added in, adjusted so every
+// system comes after the ones it names in `after`. Fixed systems each keep an accumulator of simulated time and run
+// once for every period it holds, so a long frame catches them up and a short one may not run them at all. Adjacent
+// native systems whose data doesn't conflict are run together on the thread pool; Lua systems run one at a time in
+// between.
+class SystemScheduler {
+public:
+    // Catch-up is capped at this many runs per system per frame, so a stall (a breakpoint, a dragged window) doesn't
+    // turn into a burst of simulation
+    static constexpr int max_steps_per_frame = 5;
+
+    // Returns false if a system of that name is already scheduled, or if its `after` list would make a cycle
+    bool add(ScheduledSystem system);
+    void clear() {
+        systems.clear();
+        order.clear();
+        simulation_accumulator = 0;
+    }
+    void set_thread_pool(ThreadPool * pool) { thread_pool = pool; }
+
+    void set_simulation_step(double seconds) { simulation_step = seconds; }
+    double get_simulation_step() const { return simulation_step; }
+    // How far simulated time is into the next simulation step, in [0, 1), for interpolating between the last two
+    // simulated states when rendering
+    double get_alpha() const { return simulation_accumulator / simulation_step; }
+
+    // System names in the order they run
+    std::vector<std::string> get_order() const;
+
+    // Advances simulated time by dt seconds and runs every Fixed system step that falls due, calling run(system) for
+    // Lua systems. Systems due more than once run in rounds, each round in system order.
+    template <typename Func>
+    void advance(double dt, Func && run) {
+        simulation_accumulator = std::min(simulation_accumulator + dt, max_steps_per_frame * simulation_step);
+        while (simulation_accumulator >= simulation_step) simulation_accumulator -= simulation_step;
+
+        std::vector<int> due(systems.size());
+        int rounds = 0;
+        for (size_t i = 0; i < systems.size(); ++i) {
+            auto & system = systems[i];
+            if (system.rate != SystemRate::Fixed) continue;
+            const double period = system.period > 0 ? system.period : simulation_step;
+            system.accumulator = std::min(system.accumulator + dt, max_steps_per_frame * period);
+            while (system.accumulator >= period) {
+                system.accumulator -= period;
+                ++due[i];
+            }
+            rounds = std::max(rounds, due[i]);
+        }
+        for (int round = 0; round < rounds; ++round)
+            execute([&](size_t i) { return due[i] > round; }, run);
+    }
+
+    // Runs every system of the given rate, calling run(system) for Lua systems
+    template <typename Func>
+    void for_each(SystemRate rate, Func && run) {
+        execute([&](size_t i) { return systems[i].rate == rate; }, run);
+    }
+
+private:
+    // True if a and b (a ahead of b in the order) must not run at the same time
+    static bool conflicts(const ScheduledSystem & a, const ScheduledSystem & b);
+    // Topologically sorts the systems into order, breaking ties by the order they were added; false on a cycle
+    bool rebuild_order();
+    void run_natives(const std::vector<ScheduledSystem *> & batch);
+
+    template <typename Selected, typename Func>
+    void execute(Selected && selected, Func && run) {
+        std::vector<ScheduledSystem *> batch;
+        // A copy, since a Lua system adding a system rebuilds order; systems added on the way first run next time
+        const auto current_order = order;
+        for (size_t i : current_order) {
+            if (!selected(i)) continue;
+            auto & system = systems[i];
+            if (!system.is_native()) {
+                run_natives(batch);
+                batch.clear();
+                run(system);
+                continue;
+            }
+            if (std::ranges::any_of(batch, [&](const ScheduledSystem * other) { return conflicts(*other, system); })) {
+                run_natives(batch);
+                batch.clear();
+            }
+            batch.push_back(&system);
+        }
+        run_natives(batch);
+    }
+
+    std::deque<ScheduledSystem> systems; // in the order they were added; a deque so adding one doesn't move the others
+    std::vector<size_t> order;           // indices into systems, in the order they run
+    ThreadPool * thread_pool{};
+    double simulation_step{1.0 / 6};
+    double simulation_accumulator{};
+};
+
+// Initializes SDL and its image, font and mixer libraries for as long as any instance is alive, so several windowed
+// engines can come and go in one process: the first one in initializes them and the last one out quits them.
+class SDLLibraries {
+public:
+    SDLLibraries(); // may throw
+    ~SDLLibraries();
+
+    SDLLibraries(const SDLLibraries &) = delete;
+    SDLLibraries & operator=(const SDLLibraries &) = delete;
+
+private:
+    static std::mutex mutex;
+    static int users; // guarded by mutex
+};
+
+// Runs the game. Each instance has its own Lua state, entities, maps and thread pool, so any number may exist at once,
+// each on its own thread. Windowed engines share SDL's single event queue and have to run on the main thread (SDL
+// video needs it), so running more than one is really only for headless ones.
+class Engine {
+public:
+    // worker_threads sizes the engine's thread pool (counting the thread running the game loop); pass 1 when running
+    // many engines side by side
+    explicit Engine(unsigned worker_threads = std::thread::hardware_concurrency());
     ~Engine();
 
-    void game_loop(); // Activates the engine and runs the game loop; throws if there is an error.
+    Engine(const Engine &) = delete;
+    Engine & operator=(const Engine &) = delete;
+
+    // For replays and benchmarks: stop after max_frames, advance simulated time by a fixed frame time rather than the
+    // clock (so a replay plays out the same however fast the machine is; this also skips the max_fps wait), press
+    // keys at given frames and override the random seed.
+    //
+    // headless runs without SDL: no window, renderer, audio or fonts. Every draw call is a no op, sounds don't play,
+    // text extents are 0 and the only input is key_presses. Game.headless is set for the script to check. Use it
+    // with fixed_frame_time and max_frames for batch simulation.
+    struct LoopOptions {
+        std::optional<uint64_t> max_frames;
+        std::optional<double> fixed_frame_time;
+        std::vector<std::pair<uint64_t, SDL_Keycode>> key_presses; // (frame, key), in frame order
+        std::optional<uint64_t> random_seed;
+        bool headless{};
+    };
+
+    // Activates the engine and runs the game loop; throws if there is an error.
+    void game_loop(const LoopOptions & options = {});
+
+    static std::shared_ptr<Map> generate_map(const std::string & name, int map_width, int map_height,
+                                             const MapGenerationParams & params, ThreadPool & pool);
+
+    // Quick and dirty cellular automata that I learned about from YouTube. We can do more but currently are just doing
+    // the very least to get a playable level. Both work on a row-major byte grid (1 = wall) whose outer ring is always
+    // wall, and split their rows across the pool.
+    static std::vector<uint8_t> init_cellular_automata(int map_width, int map_height,
+                                                       const MapGenerationParams & params, ThreadPool & pool);
+    static void perform_cellular_automaton(std::vector<uint8_t> & walls, int map_width, int map_height, int passes,
+                                           ThreadPool & pool);
 
 private:
     // Internal functions
-    void initialize(sol::table game_config, sol::this_state s);
+    void initialize(sol::table game_config, bool headless, sol::this_state s);
     void tear_down();
 
     void setup_lua_api(sol::this_state s);
@@ -475,18 +1680,48 @@ private:
     void play_sound(const std::string & name) const;
 
     // Drawing functions
-    void draw_text(const std::string & t, int x, int y) const;
-    void draw_text(const std::string & t, int x, int y, Uint8 r, Uint8 g, Uint8 b, Uint8 a) const;
-    void draw_sprite(const std::string & spritesheet_name, int sprite_id, int x, int y, int scale_factor) const;
+    void draw_text(const std::string & t, int x, int y);
+    void draw_text(const std::string & t, int x, int y, Uint8 r, Uint8 g, Uint8 b, Uint8 a);
+    // Sprites and graphics are queued in sprite_batch; tint defaults to the sheet's highlight color
+    void draw_sprite(const std::string & spritesheet_name, int sprite_id, int x, int y, int scale_factor,
+                     std::optional<SDL_Color> tint = std::nullopt);
     void set_draw_color(SDL_Renderer * renderer, Uint8 r, Uint8 g, Uint8 b, Uint8 a) const;
     void draw_point(SDL_Renderer * renderer, int x, int y) const;
     void draw_rect(SDL_Renderer * renderer, int x, int y, int w, int h) const;
     void draw_filled_rect(SDL_Renderer * renderer, int x, int y, int w, int h) const;
     void draw_filled_rect_with_color(SDL_Renderer * renderer, int x, int y, int w, int h, Uint8 r, Uint8 g, Uint8 b, Uint8 a) const;
-    void draw_graphic(SDL_Renderer * renderer, const std::string & path, int window_width, int x, int y, bool centered,
-                      int scale_factor) const;
+    void draw_graphic(const std::string & path, int window_width, int x, int y, bool centered, int scale_factor);
+    // The profiler's numbers for the last frame, in the top left corner
+    void draw_profiler_overlay();
+
+    // Everything drawn directly rather than through sprite_batch has to be drawn with this renderer, which has had
+    // the queued sprites flushed to it first so that what is drawn next still lands on top of them
+    SDL_Renderer * immediate_renderer() {
+        sprite_batch.flush(renderer.get());
+        return renderer.get();
+    }
 
-    static std::shared_ptr<Map> generate_map(const std::string & name, int map_width, int map_height);
+    struct Graphic {
+        std::shared_ptr<SDL_Texture> texture; // its own, or the atlas
+        Size texture_size{};
+        SDL_Rect source{}; // where it is in texture
+        int width{};
+        int height{};
+    };
+    // Loads (on first use) and returns the cached texture for path, or nullptr if it could not be found or is still
+    // being loaded
+    const Graphic * get_graphic(const std::string & path);
+    void set_graphic_image(Graphic & graphic, SDL_Surface * image);
+    // Moves the sprite sheets and graphics whose images are in images, keyed by path, into one texture, if it fits
+    // the renderer's limits
+    void build_texture_atlas(const std::unordered_map<std::string, UPtr<SDL_Surface>> & images);
+
+    // Loads the asset in the background if there is an asset loader, or else right away
+    void request_asset(AssetLoader::Request request);
+    // Puts the assets the loader has finished to use, and packs the atlas once they all are; throws
+    // std::runtime_error if a required one failed to load
+    void install_loaded_assets();
+    void install_asset(AssetLoader::Loaded loaded);
 
     Dimension update_player_viewport(const Point & player_position, const Size & current_map, const Size & initial_view_port);
 
@@ -496,6 +1731,26 @@ private:
         return nullptr;
     }
 
+    sol::table get_lua_entities_in_viewport();
+
+    // Makes the named map current if it exists; returns true if it is now the current map
+    bool select_current_map(const std::string & name);
+    // Writes the named map's cells and light map plus the Lua component data of every entity in entity_groups (all
+    // groups if empty) to path. Lua functions can't be saved and are skipped. Returns false on failure.
+    bool save_level(const std::string & path, const std::string & map_name,
+                    const std::vector<std::string> & entity_groups, sol::this_state s);
+    // Maps a file written by save_level, replaces (or adds) its map and makes it current, and restores its entities,
+    // emptying each saved group first. restore_callback(group, name, components), if given, may return a replacement
+    // components table, eg to re-attach functions. Returns the map name; throws std::runtime_error on a bad file.
+    std::string load_level(const std::string & path, const sol::optional<sol::function> & restore_callback,
+                           sol::this_state s);
+
+    // The distance field flooded from the player over the current map, or nullptr if there is no map or player
+    const DistanceField * get_player_distance_field();
+    // Calls draw_entity_callback(entity, dx, dy, scale_factor) for every entity on a drawn cell in the viewport
+    void draw_visible_entities(const Map & map, const SpriteSheet & sprite_sheet,
+                               const sol::function & draw_entity_callback);
+
     bool is_within_viewport(int x, int y) const {
         return (x >= view_port_x && x <= view_port_width - 1) && (y >= view_port_y && y <= view_port_height - 1);
     }
@@ -506,28 +1761,45 @@ private:
     int view_port_height{};
     int VIEW_PORT_WIDTH{};
     int VIEW_PORT_HEIGHT{};
+    int fov_radius{};
 
     Dimension current_dimension{};
     MapInfo current_map_info{};
 
-    // Quick and dirty cellular automata that I learned about from YouTube. We can do more but currently are just doing the
-    // very least to get a playable level.
-    static std::shared_ptr<Matrix> init_cellular_automata(int map_width, int map_height);
-    static void perform_cellular_automaton(Matrix & map, int map_width, int map_height, int passes);
-
+    std::optional<SDLLibraries> sdl_libraries; // empty when headless
     UPtr<SDL_Window> window;
-    UPtr<SDL_Renderer> renderer;
+    UPtr<SDL_Renderer> renderer; // nullptr when headless, which makes every draw call a no op
     UPtr<Mix_Music> soundtrack;
 
     // FIXME: Need to have ability to load multiple fonts
     std::weak_ptr<Text> default_font;
 
+    // Every entity and component, in slabs per size rather than one heap block each. Declared ahead of lua since the
+    // native field metatables keep weak pointers into it: tear_down releases it whole once the state is gone. A level
+    // load can't, as unsaved groups live on and Lua may still hold those weak pointers; the freed blocks get reused.
+    std::pmr::unsynchronized_pool_resource entity_memory;
     sol::state lua;
     std::unique_ptr<EntityManager> entity_manager;
     std::vector<std::shared_ptr<Sound>> sounds;
     std::unordered_map<std::string, std::shared_ptr<SpriteSheet>> sprite_sheets;
+    std::unordered_map<std::string, Graphic> graphics; // draw_graphic's texture cache, keyed by path
+    SpriteBatch sprite_batch; // the sprites and graphics drawn since the last immediate draw
+    std::unique_ptr<AssetLoader> asset_loader; // nullptr when assets are loaded synchronously
+    size_t assets_requested{};
+    size_t assets_installed{};
+    // The images installed so far, kept until everything has loaded and they are packed into the texture atlas
+    std::unordered_map<std::string, UPtr<SDL_Surface>> atlas_images;
     std::vector<std::shared_ptr<Map>> maps;
+    std::unordered_map<std::string, std::unique_ptr<ChunkedMap>> worlds;
     std::unordered_map<std::string, std::shared_ptr<Text>> texts;
-    std::unordered_map<std::string, sol::function> systems;
+    SystemScheduler scheduler;
+    int max_fps{}; // 0 leaves frame pacing to vsync, or runs uncapped without it
+    bool profiler_overlay{};
+    static constexpr size_t profiler_overlay_zones = 16; // slowest scopes listed
+    std::vector<std::pair<Point, SpatialIndex::Entry>> visible_entities; // scratch for draw_visible_entities
+    AStar::PathfinderContext pathfinder; // shared by every find_path call from Lua
+    DistanceField player_distance_field; // recomputed lazily whenever the player moves or the map changes
+    ThreadPool thread_pool;
+    RandomStreams random_streams{std::random_device{}()}; // reseeded from game_config.random_seed or seed_random()
 };
 } // namespace roguely
@@ -49,6 +49,11 @@ Game = {
         walk = "assets/sounds/walk.wav"
     },
     debug = false,
+    -- Set to replay the exact same session: map, spawns, combat rolls and mob movement
+    -- random_seed = 1337,
+    -- Mobs within this many steps of the player (walking distance, not as the crow flies) chase the player instead
+    -- of wandering
+    mob_chase_distance = 6,
     -- These are used for map rendering. Maps are simple and just a wall or a
     -- floor tile. This is here so that we aren't hard coding sprite ids in the
     -- render function.
@@ -57,6 +62,20 @@ Game = {
         floor = 74
     },
     action_log = {},
+    -- Action log messages rise this many pixels, and lose this much of their 255 opacity, per second
+    action_log_rise_speed = 60,
+    action_log_fade_speed = 300,
+    -- Sprites flash this many seconds when hit
+    blink_duration = 0.15,
+    -- Simulated steps per second for fixed rate systems, whatever the frame rate. Frames are paced by vsync unless
+    -- max_fps is set.
+    simulation_hz = 6,
+    vsync = true,
+    -- max_fps = 60,
+    -- Shows the frame profiler overlay from the start, F3 toggles it at any time
+    profiler = false,
+    -- Seconds the last frame took, set by render_system
+    frame_delta = 0,
     health_recovery_timer = 0,
     level_growth_rate = 1.2,
     level_xp_start = 25,
@@ -75,14 +94,10 @@ Game = {
                     blink = false,
                     render = function(self, game, player, dx, dy, scale_factor)
                         if (self.blink) then
-                            set_highlight_color(self.spritesheet_name, 255, 0, 0)
-                        end
-
-                        draw_sprite_scaled(self.spritesheet_name, self.sprite_id, dx, dy, scale_factor)
-
-                        if (self.blink) then
-                            self.blink = false
-                            reset_highlight_color(self.spritesheet_name)
+                            draw_sprite_tinted(self.spritesheet_name, self.sprite_id, dx, dy, scale_factor, 255, 0, 0)
+                            update_blink(self)
+                        else
+                            draw_sprite_scaled(self.spritesheet_name, self.sprite_id, dx, dy, scale_factor)
                         end
 
                         player.components.healthbar_component:render(game, player, dx-2, dy, 8, 138, 41)
@@ -151,7 +166,7 @@ Game = {
                         end
                     end,
                     inflict_damage = function(self, player, entities)
-                        local entity_attack = get_random_number(1, player.components.stats_component.attack)
+                        local entity_attack = get_random_number(1, player.components.stats_component.attack, "combat")
                         if(is_critical_attack) then
                             damage = entity_attack * player.components.stats_component.crit_multiplier
                         else
@@ -379,6 +394,12 @@ Game = {
 
                             draw_graphic(game.start_game_image_path, game.window_width, 0, 180, true, 2)
                             draw_graphic(game.credit_image_path, game.window_width, 0, 230, true, 2)
+
+                            -- Assets stream in while the title scene is up
+                            local loaded, total = get_asset_progress()
+                            if loaded < total then
+                                draw_text(string.format("Loading %d/%d", loaded, total), 10, game.window_height - 40)
+                            end
                         end
                     }
                 }
@@ -579,6 +600,9 @@ Game = {
     }
 }
 
+-- The fields of what get_adjacent_points returns, in a fixed order to walk or pick from
+Directions = { "up", "down", "left", "right" }
+
 function calculate_health_bar_width(health, max_health,
                                     health_bar_max_width)
     local hw = health_bar_max_width
@@ -592,7 +616,7 @@ end
 
 function spawn_player()
     local player_spawn_point = get_random_point_on_map()
-    Game.entities.player.components.position_component = { x = player_spawn_point.x, y = player_spawn_point.y }
+    Game.entities.player.components.position_component = { x = player_spawn_point.x, y = player_spawn_point.y, blocking = true }
     add_entity("common", "player", Game.entities.player.components)
     update_player_viewport(Game.entities.player.components.position_component.x,
             Game.entities.player.components.position_component.y,
@@ -603,21 +627,23 @@ end
 function spawn_coins()
     for i = 1, 50 do
         local spawn_point = get_random_point_on_map()
-        Game.entities.items.coin.components.position_component = { x = spawn_point.x, y = spawn_point.y }
-        add_entity("items", "coin", Game.entities.items.coin.components)
+        spawn_from_prototype("items", "coin", Game.entities.items.coin.components, {
+            position_component = { x = spawn_point.x, y = spawn_point.y }
+        })
     end
 end
 
 function spawn_health_gems()
     for i = 1, 25 do
         local spawn_point = get_random_point_on_map()
-        Game.entities.items.health_gem.components.position_component = { x = spawn_point.x, y = spawn_point.y }
-        add_entity("items", "health_gem", Game.entities.items.health_gem.components)
+        spawn_from_prototype("items", "health_gem", Game.entities.items.health_gem.components, {
+            position_component = { x = spawn_point.x, y = spawn_point.y }
+        })
     end
 end
 
 function spawn_mobs()
-    local add_mob_components = function(mob, mob_spawn_point)
+    local add_mob_components = function(mob)
         Game.entities.enemies[mob].components.stats_component["take_damage"] = function(self, player, entity, damage)
             --print(string.format("MOB TAKE DAMAGE: %d", damage))
 
@@ -630,7 +656,7 @@ function spawn_mobs()
         end
         Game.entities.enemies[mob].components.stats_component["inflict_damage"] = function(self, player, entities)
             local mob = entities.mobs[player.components.combat_component.mob]
-            local entity_attack = get_random_number(1, mob.components.stats_component.attack)
+            local entity_attack = get_random_number(1, mob.components.stats_component.attack, "combat")
             if(is_critical_attack) then
                 damage = entity_attack * mob.components.stats_component.crit_multiplier
             else
@@ -652,14 +678,10 @@ function spawn_mobs()
             render = function(self, game, entity, dx, dy, scale_factor)
                 --draw_sprite_scaled(self.spritesheet_name, self.sprite_id, dx, dy, scale_factor)
                 if (self.blink) then
-                    set_highlight_color(self.spritesheet_name, 128, 128, 128)
-                end
-
-                draw_sprite_scaled(self.spritesheet_name, self.sprite_id, dx, dy, scale_factor)
-
-                if (self.blink) then
-                    self.blink = false
-                    reset_highlight_color(self.spritesheet_name)
+                    draw_sprite_tinted(self.spritesheet_name, self.sprite_id, dx, dy, scale_factor, 128, 128, 128)
+                    update_blink(self)
+                else
+                    draw_sprite_scaled(self.spritesheet_name, self.sprite_id, dx, dy, scale_factor)
                 end
 
                 entity.components.healthbar_component:render(game, entity, dx, dy, 255, 0, 0)
@@ -681,24 +703,27 @@ function spawn_mobs()
                 end
             end
         }
-        Game.entities.enemies[mob].components.position_component = { x = mob_spawn_point.x, y = mob_spawn_point.y }
     end
 
     for key, value in pairs(Game.entities.enemies) do
-        add_mob_components(key, {x = 0, y = 0})
+        add_mob_components(key)
     end
 
+    -- Every mob of a kind shares its kind's components, methods included, and only stores what it changes itself
     for i = 1, 50 do
         local mob_spawn_point = get_random_point_on_map()
-        local mob = get_random_key_from_table(Game.entities.enemies)
-        add_mob_components(mob, mob_spawn_point)
-        add_entity("mobs", mob, Game.entities.enemies[mob].components)
+        local mob = get_random_key_from_table(Game.entities.enemies, "spawn")
+        -- blocking: chasing mobs queue up behind each other rather than pile onto one tile
+        spawn_from_prototype("mobs", mob, Game.entities.enemies[mob].components, {
+            position_component = { x = mob_spawn_point.x, y = mob_spawn_point.y, blocking = true }
+        })
     end
 end
 
 function spawn_treasure_chest(name, spawn_point)
-    Game.entities.items.treasure_chests[name].components.position_component = { x = spawn_point.x, y = spawn_point.y }
-    add_entity("items", name, Game.entities.items.treasure_chests[name].components)
+    spawn_from_prototype("items", name, Game.entities.items.treasure_chests[name].components, {
+        position_component = { x = spawn_point.x, y = spawn_point.y }
+    })
 end
 
 function spawn_golden_candle()
@@ -715,8 +740,20 @@ function display_position(entity, dx, dy)
         math.floor(dy - text_extents.height) + 22)
 end
 
+-- Sprites blink for Game.blink_duration seconds rather than a single frame, which is gone in an instant with vsync
+function update_blink(sprite_component)
+    sprite_component.blink_time = (sprite_component.blink_time or 0) + Game.frame_delta
+    if sprite_component.blink_time >= Game.blink_duration then
+        sprite_component.blink = false
+        sprite_component.blink_time = 0
+    end
+end
+
 function add_action_log(who, type, multiplier, value, x, y)
     local coords = map_to_world(x, y, Game.spritesheet_name)
+    if coords == nil then
+        return
+    end
     local r = 0
     local g = 0
     local b = 0
@@ -760,11 +797,12 @@ function render_action_log()
     for action_log_key, action_log_value in pairs(Game.action_log) do
         draw_text_with_color(action_log_value.message,
             action_log_value.x,
-            action_log_value.y,
-            action_log_value.r, action_log_value.g, action_log_value.b, action_log_value.transparancy)
+            math.floor(action_log_value.y),
+            action_log_value.r, action_log_value.g, action_log_value.b, math.floor(action_log_value.transparancy))
 
-        action_log_value.y = action_log_value.y - 10
-        action_log_value.transparancy = math.max(action_log_value.transparancy - 50, 1)
+        -- Scaled by the frame time so messages rise and fade at the same speed whatever the frame rate
+        action_log_value.y = action_log_value.y - Game.action_log_rise_speed * Game.frame_delta
+        action_log_value.transparancy = math.max(action_log_value.transparancy - Game.action_log_fade_speed * Game.frame_delta, 1)
 
         if(action_log_value.transparancy == 1) then
             Game.action_log[action_log_key] = nil
@@ -785,6 +823,9 @@ function _init()
     set_font("large")
 
     generate_map("level1", Game.map_width, Game.map_height)
+    set_map_tile_rules("level1",
+        { [0] = Game.sprite_ids.wall, [1] = Game.sprite_ids.floor },
+        { [1] = { 255, 255, 255, 255 }, [2] = { 90, 90, 110, 255 } })
 
     add_entity("ui", "title_scene", Game.entities.ui.title_scene.components)
     add_entity("ui", "end_scene", Game.entities.ui.end_scene.components)
@@ -797,45 +838,30 @@ function _init()
     spawn_health_gems()
     spawn_golden_candle()
 
-    add_system("render_system", render_system)
-    add_system("keyboard_input_system", keyboard_input_system)
-    add_system("combat_system", combat_system)
-    add_system("leveling_system", leveling_system)
-    add_system("loot system", loot_system)
-    add_system("tick_system", tick_system)
-    add_system("mob_movement_system", mob_movement_system)
+    -- Turn systems run straight after each key press, so combat and pickups resolve on the frame the key lands.
+    -- Fixed systems run in simulated time, independent of how fast frames are drawn.
+    add_system("render_system", render_system, { rate = "render" })
+    add_system("keyboard_input_system", keyboard_input_system, { rate = "input" })
+    add_system("combat_system", combat_system,
+        { rate = "turn", reads = { "combat_component" }, writes = { "stats_component" } })
+
+    -- Pickups and kills are handled from engine events, dispatched once per frame after the systems have run
+    subscribe_event("collide", on_collide)
+    subscribe_event("pickup", on_pickup)
+    subscribe_event("death", on_death)
+    add_system("tick_system", tick_system, { rate = "fixed", hz = 1 })
+    add_system("mob_movement_system", mob_movement_system, { rate = "fixed" })
 end
 
-function render_system(delta_time, player, entities, entities_in_viewport)
+function render_system(delta_time, player, entities, entities_in_viewport, alpha)
+    Game.frame_delta = delta_time
     if player.components.current_scene_component.name == "game" then
-        draw_visible_map("level1", Game.spritesheet_name,
-            function(rows, cols, dx, dy, cell_id, light_cell, scale_factor)
-                local sprite_id = 0
-                if cell_id == 0 then
-                    sprite_id = Game.sprite_ids.wall;
-                elseif cell_id == 1 then
-                    sprite_id = Game.sprite_ids.floor;
-                end
-
-                if(player.components.position_component.x == cols and player.components.position_component.y == rows) then
-                    player.components.sprite_component:render(Game, player, dx, dy, scale_factor)
-                else
-                    if(light_cell == 1) then
-                        -- wall or floor, these are not entities
-                        draw_sprite_scaled(Game.spritesheet_name, sprite_id, dx, dy, scale_factor)
-
-                        for key, value in pairs(entities.items) do
-                            if value.components.position_component.x == cols and value.components.position_component.y == rows then
-                                value.components.sprite_component:render(Game, value, dx, dy, scale_factor)
-                            end
-                        end
-
-                        for key, value in pairs(entities.mobs) do
-                            if value.components.position_component.x == cols and value.components.position_component.y == rows then
-                                value.components.sprite_component:render(Game, value, dx, dy, scale_factor)
-                            end
-                        end
-                    end
+        -- Map tiles are drawn natively (see set_map_tile_rules in _init), we only have to draw the entities that
+        -- are standing on visible cells
+        draw_visible_map_tiles("level1", Game.spritesheet_name,
+            function(entity, dx, dy, scale_factor)
+                if entity.components.sprite_component ~= nil then
+                    entity.components.sprite_component:render(Game, entity, dx, dy, scale_factor)
                 end
             end)
 
@@ -883,7 +909,7 @@ function keyboard_input_system(key, player, entities, entities_in_viewport)
         elseif Game.keycodes[key] == "space" then
             play_sound("warp")
             local pos = get_random_point_on_map()
-            player.components.position_component = { x = pos.x, y = pos.y }
+            set_entity_position("common", player.id, pos.x, pos.y)
 
             update_player_viewport(
                 player.components.position_component.x,
@@ -892,7 +918,8 @@ function keyboard_input_system(key, player, entities, entities_in_viewport)
         end
 
         local adjacent_points = get_adjacent_points(player.components.position_component.x, player.components.position_component.y)
-        for key, value in pairs(adjacent_points) do
+        for _, dir in ipairs(Directions) do
+            local value = adjacent_points[dir]
             if(value.x == new_position.x and value.y == new_position.y and value.blocked) then
                 play_sound("bump")
                 walk = false
@@ -905,47 +932,16 @@ function keyboard_input_system(key, player, entities, entities_in_viewport)
                 mob = blocked_mob.entity_full_name
             }
         elseif walk then
-            player.components.position_component = { x = math.max(0, math.min(new_position.x, Game.map_width - 1)),
-                y = math.max(0, math.min(new_position.y, Game.map_height - 1)) }
+            set_entity_position("common", player.id,
+                math.max(0, math.min(new_position.x, Game.map_width - 1)),
+                math.max(0, math.min(new_position.y, Game.map_height - 1)))
 
             update_player_viewport(
                 player.components.position_component.x,
                 player.components.position_component.y,
                 Game.viewport_width, Game.viewport_height)
             play_sound("walk")
-
-            get_overlapping_points("player", player.components.position_component.x,
-                player.components.position_component.y,
-                function(entity_full_name, entity_name, components)
-                    -- FIXME: This logic should be in the loot system
-
-                    if (entity_name == "health_gem") then
-                        play_sound("pickup")
-                        player.components.health_update_component = {
-                            entity_group = "items",
-                            entity_id = entities.items[entity_full_name].id,
-                            entity_full_name = entity_full_name,
-                            value = entities.items[entity_full_name].components.value_component.value
-                        }
-                    elseif (entity_name == "ordinary" or
-                            entity_name == "common" or
-                            entity_name == "ornate" or
-                            entity_name == "exquisite" or
-                            entity_name == "coin" or
-                            entity_name == "goldencandle") then
-                        play_sound("pickup")
-                        player.components.score_update_component = {
-                            entity_group = "items",
-                            entity_id = entities.items[entity_full_name].id,
-                            entity_full_name = entity_full_name,
-                            value = entities.items[entity_full_name].components.value_component.value
-                        }
-
-                        if(entity_name == "goldencandle") then
-                            player.components.current_scene_component.name = "end_scene"
-                        end
-                    end
-                end)
+            -- Anything on the tile walked onto comes back as a collide event, see on_collide
         end
     elseif player.components.current_scene_component.name == "title_scene" then
         if Game.keycodes[key] == "space" then
@@ -955,26 +951,20 @@ function keyboard_input_system(key, player, entities, entities_in_viewport)
 end
 
 function combat_system(player, entities, entities_in_viewport)
-    if(player.components.combat_component) then
-        local is_critical_attack = get_random_number(1, 100) <= player.components.stats_component.crit_chance
-        local player_attack = get_random_number(1, player.components.stats_component.attack)
+    -- Walked backwards since removing the combat_component below drops the attacker out of the view
+    local attackers = query({ "combat_component", "stats_component" }, "common")
+    for i = #attackers, 1, -1 do
+        local attacker = attackers[i]
+        local mob = entities.mobs[attacker.components.combat_component.mob]
+        local is_critical_attack = get_random_number(1, 100, "combat") <= attacker.components.stats_component.crit_chance
+        local attacker_attack = get_random_number(1, attacker.components.stats_component.attack, "combat")
         local damage = 0
 
-        player.components.stats_component:inflict_damage(player, entities)
-        entities.mobs[player.components.combat_component.mob].components.stats_component:inflict_damage(player, entities)
-
-        if(entities.mobs[player.components.combat_component.mob].components.stats_component.health <= 0) then
-            player.components.stats_component:add_kill(player, entities.mobs[player.components.combat_component.mob])
-
-            player.components.score_update_component = {
-                entity_group = "mobs",
-                entity_id = entities.mobs[player.components.combat_component.mob].id,
-                entity_full_name = player.components.combat_component.mob,
-                value = entities.mobs[player.components.combat_component.mob].components.stats_component.max_health
-            }
-        end
+        attacker.components.stats_component:inflict_damage(attacker, entities)
+        mob.components.stats_component:inflict_damage(attacker, entities)
+        -- A mob killed here comes back as a death event, see on_death
 
-        remove_component("common", "player", "combat_component")
+        remove_component("common", attacker.name, "combat_component")
     end
 end
 
@@ -987,14 +977,56 @@ function leveling_system(player, entities, entities_in_viewport)
     end
 end
 
-function loot_system(player, entities, entities_in_viewport)
-    if(player.components.score_update_component ~= nil) then
-        player.components.stats_component:add_score(player, player.components.score_update_component.value)
-        local treasure_chest_spawn_position = entities[player.components.score_update_component.entity_group][player.components.score_update_component.entity_full_name].components.position_component
-        remove_entity(player.components.score_update_component.entity_group, player.components.score_update_component.entity_id)
+-- Walking onto an item picks it up
+function on_collide(events)
+    for _, event in ipairs(events) do
+        if event.name == "player" and event.other_group == "items" and event.other ~= nil then
+            publish_event("pickup", { player = event.entity, item = event.other })
+        end
+    end
+end
+
+function on_pickup(events)
+    for _, event in ipairs(events) do
+        local player, item = event.player, event.item
+        local value = item.components.value_component.value
+
+        if (item.name == "health_gem") then
+            play_sound("pickup")
+            player.components.stats_component:add_health(player, value)
+            remove_entity("items", item.id)
+        elseif (item.name == "ordinary" or
+                item.name == "common" or
+                item.name == "ornate" or
+                item.name == "exquisite" or
+                item.name == "coin" or
+                item.name == "goldencandle") then
+            play_sound("pickup")
+            player.components.stats_component:add_score(player, value)
+            remove_entity("items", item.id)
+
+            if(item.name == "goldencandle") then
+                player.components.current_scene_component.name = "end_scene"
+            end
+        end
+    end
+end
 
-        if(player.components.score_update_component.entity_group == "mobs") then
-            local treasure_chest_drop_chance = get_random_number(1, 100)
+-- Only the player kills mobs, so every mob death scores for the player and may drop a treasure chest
+function on_death(events)
+    local player = find_entity_with_name("common", "player")
+    for _, event in ipairs(events) do
+        if event.group == "mobs" and event.entity ~= nil then
+            local mob = event.entity
+            local treasure_chest_spawn_position = { x = event.x, y = event.y }
+
+            player.components.stats_component:add_kill(player, mob)
+            player.components.stats_component:add_score(player, mob.components.stats_component.max_health)
+            remove_entity("mobs", mob.id)
+            -- Kills are the only source of experience
+            leveling_system(player)
+
+            local treasure_chest_drop_chance = get_random_number(1, 100, "loot")
             local treasure_chest_name = nil
 
             if(treasure_chest_drop_chance >= 90) then
@@ -1011,12 +1043,6 @@ function loot_system(player, entities, entities_in_viewport)
                 spawn_treasure_chest(treasure_chest_name, treasure_chest_spawn_position)
             end
         end
-
-        remove_component("common", "player", "score_update_component")
-    elseif (player.components.health_update_component ~= nil) then
-        player.components.stats_component:add_health(player, player.components.health_update_component.value)
-        remove_entity(player.components.health_update_component.entity_group, player.components.health_update_component.entity_id)
-        remove_component("common", "player", "health_update_component")
     end
 end
 
@@ -1029,24 +1055,42 @@ function tick_system(player, entities, entities_in_viewport)
 
         if(player.components.stats_component.health < player.components.stats_component.max_health) then
             player.components.tick_component:tick(Game, player)
-            force_redraw_map()
         end
     end
 end
 
 function mob_movement_system(player, entities, entities_in_viewport)
-    local move_chance = get_random_number(1, 100)
+    local move_chance = get_random_number(1, 100, "mobs")
 
     if(move_chance <= 20) then
+        -- In id order rather than pairs order, which changes from run to run, so a seeded game draws the same
+        -- directions for the same mobs every time
+        local mobs = {}
         for key, value in pairs(entities_in_viewport) do
-            if(entities.mobs[key] ~= nil) then
-                local adjacent_points = get_adjacent_points(entities.mobs[key].components.position_component.x, entities.mobs[key].components.position_component.y)
-                local dir = get_random_key_from_table(adjacent_points)
-                if not adjacent_points[dir].blocked and
-                       adjacent_points[dir].x ~= player.components.position_component.x and
-                       adjacent_points[dir].y ~= player.components.position_component.y
+            -- Mobs killed this frame stay until the death events are handled at the end of it, and mustn't move
+            if(entities.mobs[key] ~= nil and entities.mobs[key].components.stats_component.health > 0) then
+                mobs[#mobs + 1] = key
+            end
+        end
+        table.sort(mobs, function(a, b) return entities.mobs[a].id < entities.mobs[b].id end)
+
+        for _, key in ipairs(mobs) do
+            local mob = entities.mobs[key]
+            local mob_x = mob.components.position_component.x
+            local mob_y = mob.components.position_component.y
+            -- The engine floods one distance field from the player and shares it among all mobs, so chasing
+            -- costs a table lookup per mob rather than a path search
+            local step = get_step_toward_player(mob_x, mob_y)
+            if step ~= nil and step.distance <= Game.mob_chase_distance then
+                set_entity_position("mobs", mob.id, step.x, step.y)
+            else
+                local dir = Directions[get_random_number(1, #Directions, "mobs")]
+                local point = get_adjacent_points(mob_x, mob_y)[dir]
+                if not point.blocked and
+                       point.x ~= player.components.position_component.x and
+                       point.y ~= player.components.position_component.y
                 then
-                    entities.mobs[key].components.position_component = { x = adjacent_points[dir].x, y = adjacent_points[dir].y }
+                    set_entity_position("mobs", mob.id, point.x, point.y)
                 end
             end
         end